@@ -2,6 +2,28 @@
 #include "top.h"
 
 
+/*
+ * Set to 0 to synthesize call progress tones sample by sample instead of playing them from precomputed wavetables
+ */
+
+#define AUDIO_CPT_WAVETABLES 1
+
+/*
+ * Audio frame length and the number of frames in the I2S DMA ring.
+ *
+ * A command takes effect at the DAC within AUDIO_RING_SEGMENTS frames, so shorter frames cut the latency of
+ * stop() and new tones, at the cost of more render task wakeups. More segments give the render task more slack
+ * before an underrun, at the cost of latency. Frame length: 2, 5, 10 or 20 mS. Segments: 2 to 4.
+ */
+
+#ifndef AUDIO_FRAME_MS
+#define AUDIO_FRAME_MS 20
+#endif
+
+#ifndef AUDIO_RING_SEGMENTS
+#define AUDIO_RING_SEGMENTS 2
+#endif
+
 namespace Audio {
 
 enum {AS_IDLE=0,
@@ -10,15 +32,23 @@ enum {AS_IDLE=0,
 	AS_GEN_RINGING_TONE, AS_RINGING_WAIT_TONE_END, AS_RINGING_WAIT_SILENCE_END,
 	AS_SEND_MF, AS_SEND_MF_WAIT_TONE_END, AS_SEND_MF_WAIT_SILENCE_END,
 	AS_SEND_DTMF, AS_SEND_DTMF_WAIT_TONE_END, AS_SEND_DTMF_WAIT_SILENCE_END,
-	AS_SEND_AUDIO, AS_SEND_AUDIO_WAIT, AS_SEND_AUDIO_LOOP, AS_SEND_AUDIO_LOOP_WAIT
+	AS_SEND_AUDIO, AS_SEND_AUDIO_WAIT, AS_SEND_AUDIO_LOOP, AS_SEND_AUDIO_LOOP_WAIT,
+	AS_SEND_STREAM, AS_SEND_STREAM_PRIME, AS_SEND_STREAM_WAIT
 };
 
 enum {CPT_DIAL_TONE=0, CPT_BUSY, CPT_CONGESTION, CPT_RINGING, CPT_MAX};
 
+/* Sample encodings for send() and send_loop() */
+enum {AE_LINEAR=0, AE_ULAW, AE_ALAW};
+
+/* Commands posted by the control tasks to the render task */
+enum {AC_START=0, AC_STOP, AC_RELEASE, AC_ROUTE};
+
 const float SAMPLE_FREQ_HZ = 8000; /* Actual sample freq is slightly higher at 8012 Hz, but setting this to 8000 Hz reduces jitter in the tone frequencies. */
 const uint16_t SINE_TABLE_BIT_WIDTH = 10; /* 1KB of sine table */
 const uint16_t PHASE_ACCUMULATOR_WIDTH = 16; /* 16 bits gives appx. 0.14 Hz of frequency resolution */
-const uint16_t LR_AUDIO_BUFFER_SIZE = 320; /* Left and right audio buffer audio samples for a 20mS frame of both */
+const uint8_t FRAME_MS = AUDIO_FRAME_MS;
+const uint8_t RING_SEGMENTS = AUDIO_RING_SEGMENTS;
 const int16_t TONE_SHUTOFF_THRESHOLD = 200; /* Adjustment to trade off clicking at the end of a tone, vs. the length of the tone */
 
 
@@ -26,13 +56,25 @@ const uint8_t DIGIT_STRING_MAX_LENGTH = 20;
 const uint16_t NUM_MF_TONE_PAIRS = 15;
 const uint16_t NUM_DTMF_TONE_PAIRS = 16;
 const uint8_t MAX_TONES = 2;
-const uint8_t NUM_AUDIO_CHANNELS = 2;
-const uint16_t AUDIO_BUFFER_SIZE = (LR_AUDIO_BUFFER_SIZE/NUM_AUDIO_CHANNELS);
+const uint8_t NUM_AUDIO_CHANNELS = 8; /* Logical sources handed out by seize(), mixed onto the output slots */
+const uint8_t NUM_OUTPUT_SLOTS = 2; /* Left and right I2S slots */
+const uint8_t OUTPUT_SLOT_DEFAULT = 0xFF; /* Route odd channel numbers left and even channel numbers right */
+const uint16_t AUDIO_BUFFER_SIZE = (uint16_t) ((SAMPLE_FREQ_HZ * FRAME_MS) / 1000); /* Samples per slot in one frame */
+const uint16_t LR_AUDIO_BUFFER_SIZE = (AUDIO_BUFFER_SIZE * NUM_OUTPUT_SLOTS); /* Left and right audio samples for one frame of both */
 const uint16_t SINE_TABLE_LENGTH = (1 << SINE_TABLE_BIT_WIDTH);
 const uint16_t PHASE_ACCUMULATOR_TRUNCATION = (PHASE_ACCUMULATOR_WIDTH - SINE_TABLE_BIT_WIDTH);
 const uint32_t PHASE_ACCUM_MODULO_N = (1 << PHASE_ACCUMULATOR_WIDTH);
 const uint32_t PHASE_ACCUMULATOR_MASK = (PHASE_ACCUM_MODULO_N - 1);
 const uint32_t TIME_PER_SAMPLE_US = 1000000UL/SAMPLE_FREQ_HZ;
+const uint16_t CPT_WAVETABLE_POOL_SIZE = 1600; /* Samples shared by all call progress tone wavetables. 3.2KB */
+const uint8_t Q15_SHIFT = 15;
+const int32_t Q15_MAX = 0x7FFF;
+const uint8_t COMMAND_QUEUE_DEPTH = 4; /* Commands per channel waiting for the render task. Must be a power of 2 */
+const uint8_t COMPLETION_QUEUE_DEPTH = 16; /* Completions waiting to be dispatched. Must be a power of 2 */
+const uint8_t STREAM_QUEUE_DEPTH = 4; /* Chunks per channel queued for streaming playback. Must be a power of 2 */
+const uint32_t STREAM_LOW_WATER_DEFAULT = (uint32_t) ((SAMPLE_FREQ_HZ * 80) / 1000); /* 80mS, longer than the switch task dispatch interval */
+const uint16_t G711_TABLE_SIZE = 256; /* One linear sample for each G.711 code */
+const uint32_t DEADLINE_REPORT_MS = 1000; /* Minimum time between deadline monitor log messages */
 
 
 
@@ -40,24 +82,105 @@ const uint32_t TIME_PER_SAMPLE_US = 1000000UL/SAMPLE_FREQ_HZ;
 typedef struct ChannelInfo {
 	bool in_use;
 	bool is_stoppable;
+	uint8_t output_slot;
 	void (*callback)(uint32_t descriptor);
 	uint8_t state;
 	uint8_t digit_string[DIGIT_STRING_MAX_LENGTH];
 	float f1;
 	float f2;
-	float f1_level;
-	float f2_level;
+	int16_t level_q15[MAX_TONES]; /* Tone levels as Q15 fractions of full scale */
+	uint32_t completed_at; /* Sample time the last operation finished at, valid during its callback */
 	uint32_t cadence_timing;
 	uint32_t cadence_timer;
 	uint32_t phase_accum[MAX_TONES];
 	uint16_t tuning_word[MAX_TONES];
+	const int16_t *wavetable; /* When not NULL, the tone is played from this precomputed period instead of synthesized */
+	uint16_t wavetable_length;
+	uint16_t wavetable_index;
 	uint32_t audio_sample_size;
 	uint32_t audio_sample_index;
 	size_t digit_string_length;
 	size_t digit_string_index;
-	const int16_t *audio_sample;
+	const void *audio_sample; /* 16 bit linear, or 8 bit G.711 codes when expand_table is set */
+	const int16_t *expand_table; /* G.711 code to linear sample, NULL for linear samples */
+	void (*refill)(uint32_t descriptor); /* Streaming playback wants more chunks */
+	uint32_t stream_low_water;
+	uint32_t stream_underruns;
 } ChannelInfo;
 
+/*
+ * A command for one channel. AC_START carries everything needed to start an operation in the given state.
+ */
+
+typedef struct AudioCommand {
+	uint8_t op;
+	uint8_t state;
+	uint8_t output_slot;
+	uint8_t digit_string_length;
+	uint8_t digit_string[DIGIT_STRING_MAX_LENGTH];
+	void (*callback)(uint32_t descriptor);
+	void (*refill)(uint32_t descriptor);
+	const void *audio_sample;
+	uint8_t audio_encoding;
+	uint32_t audio_sample_size;
+	uint32_t stream_low_water;
+	uint8_t stream_mark; /* Stream queue tail when posted. Chunks before it belong to whatever the command replaces */
+} AudioCommand;
+
+/*
+ * Single producer, single consumer ring of commands for one channel.
+ * The control tasks are serialized with the audio lock, the render task picks commands up without any lock.
+ */
+
+typedef struct CommandQueue {
+	AudioCommand commands[COMMAND_QUEUE_DEPTH];
+	uint8_t head; /* Next command to apply, written by the render task */
+	uint8_t tail; /* Next free slot, written by the control tasks */
+} CommandQueue;
+
+/*
+ * Posted by the render task when an operation finishes: channel N finished at sample S
+ */
+
+typedef struct CompletionEvent {
+	void (*callback)(uint32_t descriptor);
+	uint32_t channel_number;
+	uint32_t sample_time;
+	bool is_refill; /* A request for more streaming chunks rather than the end of an operation */
+} CompletionEvent;
+
+/*
+ * Streaming playback. Chunks are played in place, so a chunk's samples must stay untouched
+ * until its slot has been given back (stream_space() goes up). A chunk with NULL samples ends the stream.
+ */
+
+typedef struct StreamChunk {
+	const int16_t *samples;
+	uint32_t length;
+} StreamChunk;
+
+typedef struct StreamQueue {
+	StreamChunk chunks[STREAM_QUEUE_DEPTH];
+	uint8_t head; /* Chunk being played, written by the render task */
+	uint8_t tail; /* Next free slot, written by the control tasks */
+} StreamQueue;
+
+/*
+ * Render deadline monitor. Slack is how far ahead of the I2S DMA a segment was when its render finished.
+ */
+
+typedef struct DeadlineStats {
+	uint32_t renders;
+	uint32_t late_renders; /* The DMA was already playing the segment when its render started or finished */
+	uint32_t segments_skipped; /* Freed segments the DMA came round to again before the audio task could render them */
+	int32_t min_slack_us; /* Worst case slack, negative if a render finished after the DMA started its segment */
+} DeadlineStats;
+
+typedef struct Wavetable {
+	const int16_t *samples;
+	uint16_t length;
+} Wavetable;
+
 typedef struct Indications {
 	struct Dial_Tone {
 		float tone_pair[2];
@@ -178,15 +301,31 @@ const Mf MF = {
 class Audio {
 public:
 	void setup(void);
-	uint32_t seize(void);
+	uint32_t seize(uint8_t output_slot = OUTPUT_SLOT_DEFAULT);
+	bool route(uint32_t channel_number, uint8_t output_slot);
 	bool release(uint32_t channel_number);
 	bool send_call_progress_tones(uint32_t channel_number, uint8_t type);
 	bool send_mf(uint32_t channel_number, const char *digit_string, void (*callback)(uint32_t channel_number));
 	bool send_dtmf(uint32_t channel_number, const char *digit_string, void (*callback)(uint32_t channel_number));
 	bool send(uint32_t channel_number, const int16_t *samples, uint32_t length, void (*callback)(uint32_t channel_number));
 	bool send_loop(uint32_t channel_number, const int16_t *samples, uint32_t length);
+	bool send_g711(uint32_t channel_number, const uint8_t *codes, uint32_t length, uint8_t encoding, void (*callback)(uint32_t channel_number));
+	bool send_loop_g711(uint32_t channel_number, const uint8_t *codes, uint32_t length, uint8_t encoding);
+	bool send_stream(uint32_t channel_number, void (*refill)(uint32_t channel_number), void (*callback)(uint32_t channel_number),
+			uint32_t low_water = STREAM_LOW_WATER_DEFAULT);
+	bool stream_queue(uint32_t channel_number, const int16_t *samples, uint32_t length);
+	bool stream_end(uint32_t channel_number);
+	uint8_t stream_space(uint32_t channel_number);
+	uint32_t stream_underruns(uint32_t channel_number);
 	bool stop(uint32_t channel_number);
 	void request_block(uint8_t buffer_number);
+	void render_segments(uint32_t sequence);
+	uint32_t dispatch_completions(void);
+	uint32_t completed_at(uint32_t channel_number);
+	uint32_t completions_dropped(void) { return _completions_dropped; };
+	void deadline_stats(DeadlineStats *stats);
+	void reset_deadline_stats(void);
+	void report_deadlines(void);
 
 
 protected:
@@ -196,13 +335,58 @@ protected:
 	void _process_left_right(void);
 	void _dma_start(void);
 	void _dma_stop(void);
+	uint32_t _dma_position(void);
+	int32_t _segment_slack(uint8_t segment);
 	int16_t _next_tone_value(ChannelInfo *channel_info);
+	int16_t _db_to_q15(float db_level);
+	void _render_tone(ChannelInfo *ch_info, int16_t *out, uint16_t count);
+	uint16_t _render_tone_cadence(ChannelInfo *ch_info, int16_t *out, uint16_t count, bool *ended);
+	uint16_t _render_silence_cadence(ChannelInfo *ch_info, int16_t *out, uint16_t count, bool *ended);
+	void _render_channel(uint8_t channel_index, int16_t *out, uint16_t count);
+	void _mix_block(int16_t *dest, const int16_t *source, uint16_t count);
+	void _build_cpt_wavetables(void);
+	bool _build_wavetable(Wavetable *table, const float *tone_pair, const float *level_pair);
+	void _use_cpt_wavetable(ChannelInfo *ch_info, uint8_t type);
 	void _generate_tone(ChannelInfo *channel_info, float freq, float level);
 	void _generate_dual_tone(ChannelInfo *channel_info, float freq1, float freq2, float db_level1, float db_level2);
 	bool _validate_channel(uint32_t descriptor);
+	void _build_g711_tables(void);
+	bool _post_sample(uint32_t channel_number, const void *samples, uint32_t length, uint8_t encoding, uint8_t state, void (*callback)(uint32_t channel_number));
+	void _copy_sample_run(ChannelInfo *ch_info, int16_t *out, uint32_t count);
+	AudioCommand *_command_slot(uint32_t channel_number);
+	void _command_post(uint32_t channel_number);
+	bool _post_simple_command(uint32_t channel_number, uint8_t op, uint8_t state = AS_IDLE, uint8_t output_slot = 0);
+	void _apply_commands(uint8_t channel_index);
+	void _post_completion(uint8_t channel_index, uint16_t sample_offset, bool is_refill = false);
+	uint32_t _stream_queued(uint8_t channel_index);
+	void _stream_discard(uint8_t channel_index, uint8_t mark);
 	ChannelInfo channel_info[NUM_AUDIO_CHANNELS];
-	osMutexId_t _lock;
-	int16_t lr_audio_output_buffer[LR_AUDIO_BUFFER_SIZE * 2]; /* 2 buffers in circular buffer for double buffering */
+	CommandQueue _commands[NUM_AUDIO_CHANNELS];
+	StreamQueue _streams[NUM_AUDIO_CHANNELS];
+	CompletionEvent _completions[COMPLETION_QUEUE_DEPTH];
+	uint8_t _completion_head; /* Next completion to dispatch, written by the dispatching task */
+	uint8_t _completion_tail; /* Next free slot, written by the render task */
+	uint32_t _completions_dropped;
+	uint32_t _sample_time; /* Samples rendered per output slot since setup */
+	uint32_t _renders;
+	uint32_t _late_renders;
+	uint32_t _segment_sequence; /* Last I2S DMA event handled by render_segments() */
+	uint8_t _next_segment; /* Segment freed by the next I2S DMA event */
+	uint32_t _segments_skipped;
+	int32_t _min_slack; /* Samples per slot */
+	uint32_t _reported_late_renders; /* Counts at the last report_deadlines() log */
+	uint32_t _reported_segments_skipped;
+	uint32_t _reported_at; /* Kernel tick of the last report_deadlines() log */
+	osMutexId_t _lock; /* Serializes the control tasks. Never taken by the render task */
+	int16_t lr_audio_output_buffer[LR_AUDIO_BUFFER_SIZE * RING_SEGMENTS]; /* Ring of frames played by the I2S DMA */
+	int16_t _channel_block[AUDIO_BUFFER_SIZE] __attribute__((aligned(4))); /* Render block for one channel */
+	int16_t _slot_block[NUM_OUTPUT_SLOTS][AUDIO_BUFFER_SIZE] __attribute__((aligned(4))); /* Mixed blocks for each output slot */
+	int16_t _g711_expand[2][G711_TABLE_SIZE]; /* Indexed by encoding - AE_ULAW */
+#if AUDIO_CPT_WAVETABLES
+	Wavetable _cpt_wavetables[CPT_MAX];
+	int16_t _cpt_wavetable_pool[CPT_WAVETABLE_POOL_SIZE];
+	uint16_t _cpt_wavetable_pool_used;
+#endif
 };
 
 
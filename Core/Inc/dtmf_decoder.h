@@ -0,0 +1,68 @@
+#pragma once
+#include "logging.h"
+#include "goertzel.h"
+#include "mf_decoder.h"
+
+namespace Dtmfd {
+
+
+
+const uint8_t NUM_DTMF_ROWS = 4;
+const uint8_t NUM_DTMF_COLUMNS = 4;
+const uint8_t NUM_DTMF_FREQUENCIES = (NUM_DTMF_ROWS + NUM_DTMF_COLUMNS);
+const uint8_t DTMF_NUM_RECEIVERS = Mfd::MF_NUM_RECEIVERS; // One per ADC input, shares the frames with the MF receivers
+const uint8_t DTMF_MAX_DIGITS = 32;
+const float DTMF_SIGNAL_THRESHOLD = 2.0; // Minimum magnitude for both tones, same scale as the MF decoder
+const float DTMF_MAX_NORMAL_TWIST = 2.512; // Row tone may be up to 8dB above the column tone
+const float DTMF_MAX_REVERSE_TWIST = 1.585; // Column tone may be up to 4dB above the row tone
+const float DTMF_MIN_PEAK_RATIO = 2.0; // Tones must be 6dB above any other tone in their group
+const float DTMF_MIN_ENERGY_RATIO = 0.75; // The two tones must hold at least 3/4 of the energy in the frame
+const uint8_t DTMF_MIN_DIGIT_BLOCK_COUNT = 2; // 40mS
+const uint16_t DTMF_INTERDIGIT_TIMEOUT = 50*5; // 5 Seconds
+
+
+enum {DTE_OK=0, DTE_TIMEOUT};
+enum {DTR_IDLE=0, DTR_WAIT_DIGIT, DTR_WAIT_DIGIT_SILENCE, DTR_TIMEOUT, DTR_DONE, DTR_WAIT_RELEASE};
+
+typedef void (*dtmfCallback)(uint32_t descriptor, uint8_t error_code, uint8_t digit_count, char *data);
+
+typedef struct dtmfData {
+	char tone_digit;
+	uint8_t timer;
+	uint8_t state;
+	uint8_t error_code;
+	uint8_t tone_block_count;
+	uint8_t digit_count;
+	uint32_t descriptor;
+	dtmfCallback callback;
+	float dc_level;
+	char digits[DTMF_MAX_DIGITS];
+
+} dtmfData;
+
+// Functions
+
+class DTMF_decoder {
+
+public:
+
+
+void setup(Mfd::MF_decoder *sampler); /* Called once during initialization, after the MF decoder which owns the ADC */
+uint32_t seize(dtmfCallback callback); /* Called to seize a free DTMF receiver */
+bool release(uint32_t descriptor); /* Called to release a DTMF receiver */
+
+void handle_buffer(uint8_t buffer_no); // Called after the MF decoder for each ADC frame
+
+
+protected:
+char _detect_digit(uint8_t receiver, const uint16_t *frame);
+void _update_state(dtmfData *dtmf_data, char digit);
+Goertzel::Bank<NUM_DTMF_FREQUENCIES> _goertzel[DTMF_NUM_RECEIVERS];
+Mfd::MF_decoder *_sampler;
+osMutexId_t _lock;
+dtmfData _dtmf_data[DTMF_NUM_RECEIVERS];
+
+};
+
+} // END Namespace Dtmfd
+
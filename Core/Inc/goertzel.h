@@ -0,0 +1,106 @@
+#pragma once
+#include <math.h>
+#include <stdint.h>
+
+/*
+ * Goertzel filter bank
+ *
+ * The filter state is kept as a structure of arrays so the per sample recurrence for every bin
+ * can be held in registers. On the Cortex-M4 the bins are unrolled into a run of fused multiply-adds
+ * on the single precision FPU. On the host build the bins are packed into GCC vector types,
+ * which compile to SSE/AVX on x86 and NEON on ARM, and the bank is padded to a whole number of vectors.
+ */
+
+namespace Goertzel {
+
+#ifdef HOST_BUILD
+const uint8_t VECTOR_LANES = 4;
+typedef float Vector __attribute__((vector_size(VECTOR_LANES * sizeof(float))));
+#else
+const uint8_t VECTOR_LANES = 1;
+typedef float Vector;
+#endif
+
+/* Number of lanes needed to hold a bank of bins */
+constexpr uint8_t lanes(uint8_t bins) {
+	return ((bins + VECTOR_LANES - 1) / VECTOR_LANES) * VECTOR_LANES;
+}
+
+/* __builtin_fmaf() only takes scalars. GCC contracts the vector form into vector fused multiply-adds where there are any */
+#if defined(__ARM_FEATURE_FMA) && !defined(HOST_BUILD)
+#define GOERTZEL_FMA(a, b, c) __builtin_fmaf((a), (b), (c))
+#else
+#define GOERTZEL_FMA(a, b, c) (((a) * (b)) + (c))
+#endif
+
+template <uint8_t BINS>
+class Bank {
+public:
+	static const uint8_t LANES = lanes(BINS);
+	static const uint8_t VECTORS = LANES / VECTOR_LANES;
+
+	/* Set up the coefficients for each bin. Unused padding lanes get a coefficient of zero. */
+	void setup(const float *frequencies, float sample_rate) {
+		for(uint8_t lane = 0; lane < LANES; lane++) {
+			this->coeff[lane] = (lane < BINS) ? (float) (2.0 * cos((2.0 * M_PI * frequencies[lane]) / sample_rate)) : 0.0f;
+		}
+		this->clear();
+	};
+
+	/* Clear the filter state before the start of a block */
+	void clear(void) {
+		for(uint8_t lane = 0; lane < LANES; lane++) {
+			this->q1[lane] = this->q2[lane] = 0.0f;
+		}
+	};
+
+	/* Run a block of samples through every bin */
+	void run(const float * __restrict block, uint16_t count) {
+		this->run_source([block](uint16_t index) { return block[index]; }, count);
+	};
+
+	/*
+	 * Run samples produced by a callable through every bin. The callable is given the sample index
+	 * and returns the sample as a float, so conversion and filtering can be fused into the same pass.
+	 */
+	template <typename Source>
+	void run_source(Source source, uint16_t count) {
+		Vector k[VECTORS], s1[VECTORS], s2[VECTORS];
+
+		for(uint8_t v = 0; v < VECTORS; v++) {
+			k[v] = ((const Vector *) this->coeff)[v];
+			s1[v] = ((const Vector *) this->q1)[v];
+			s2[v] = ((const Vector *) this->q2)[v];
+		}
+
+		for(uint16_t index = 0; index < count; index++) {
+			float s = source(index);
+#pragma GCC unroll 16
+			for(uint8_t v = 0; v < VECTORS; v++) {
+				/* q0 = k * q1 - q2 + s */
+				Vector q0 = GOERTZEL_FMA(k[v], s1[v], s - s2[v]);
+				s2[v] = s1[v];
+				s1[v] = q0;
+			}
+		}
+
+		for(uint8_t v = 0; v < VECTORS; v++) {
+			((Vector *) this->q1)[v] = s1[v];
+			((Vector *) this->q2)[v] = s2[v];
+		}
+	};
+
+	/* Magnitude of one bin at the end of a block */
+	float magnitude(uint8_t bin) {
+		float q1 = this->q1[bin];
+		float q2 = this->q2[bin];
+		return sqrtf((q1 * q1) + (q2 * q2) - (this->coeff[bin] * q1 * q2));
+	};
+
+	/* Lane storage, aligned so it can be loaded a vector at a time */
+	float coeff[LANES] __attribute__((aligned(sizeof(Vector))));
+	float q1[LANES] __attribute__((aligned(sizeof(Vector))));
+	float q2[LANES] __attribute__((aligned(sizeof(Vector))));
+};
+
+} /* End namespace Goertzel */
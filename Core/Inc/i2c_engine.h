@@ -3,16 +3,25 @@
 
 namespace I2C_Engine {
 
-enum {I2CS_IDLE=0, I2CS_READ_REG, I2CS_READ_REG_WAIT_REG_XMIT, I2CS_READ_REG_WAIT_RCV, I2CS_WRITE_REG,
-	I2CS_WRITE_REG_WAIT_REG_XMIT, I2CS_WRITE_REG_WAIT_DATA_XMIT, I2CS_FINISH};
+enum {I2CS_IDLE=0, I2CS_READ_REG, I2CS_READ_REG_WAIT_RCV, I2CS_WRITE_REG, I2CS_WRITE_REG_WAIT_XMIT, I2CS_FINISH};
 
-enum {I2CT_READ_REG8=0, I2CT_WRITE_REG8, I2CT_MAX_I2C_TYPES};
-enum {I2CEC_OK=0, I2CEC_NO_DEVICE, I2CEC_TRANS_FAILED, I2CEC_DMA_FAILED};
+/* Register reads and writes with 8 or 16 bit register addresses. Each is one memory mode DMA transfer */
+enum {I2CT_READ_REG8=0, I2CT_WRITE_REG8, I2CT_READ_REG16, I2CT_WRITE_REG16, I2CT_MAX_I2C_TYPES};
+enum {I2CEC_OK=0, I2CEC_NO_DEVICE, I2CEC_TRANS_FAILED, I2CEC_DMA_FAILED, I2CEC_NOT_RUN};
+/* Shadow register read results */
+enum {I2CSR_FAILED=0, I2CSR_CACHED, I2CSR_QUEUED};
 
 const uint8_t NUM_I2C_BUSSES = 2;
 const uint8_t MAX_I2C_REG_DATA = 8;
-const uint8_t I2C_TRANSACTION_QUEUE_DEPTH = 16;
+const uint8_t I2C_TRANSACTION_POOL_SIZE = 16; /* Shared by both busses. Each bus queue can hold all of them */
+const uint8_t I2C_MAX_POLLS = 8; /* Each one holds a transaction from the pool */
+const uint8_t I2C_MAX_POLL_DATA = 4; /* Bytes read by a poll, assembled little endian into a 32 bit value */
+const uint8_t I2C_MAX_SHADOWS = 4; /* Each one holds a transaction from the pool */
+const uint8_t I2C_SHADOW_REGISTERS = 32; /* 8 bit registers at 8 bit addresses 0 to 31, one bit each in the masks */
 
+struct I2C_Batch;
+struct I2C_Poll;
+struct I2C_Shadow;
 
 typedef struct I2C_Transaction {
 	uint32_t hal_i2c_error_code;
@@ -22,14 +31,100 @@ typedef struct I2C_Transaction {
 	uint8_t bus_num;
 	uint8_t device_address;
 	uint8_t device_address8;
-	uint8_t register_address;
+	uint16_t register_address;
+	uint16_t register_address_size; /* I2C_MEMADD_SIZE_8BIT or I2C_MEMADD_SIZE_16BIT */
 	uint8_t data_length;
 	uint8_t *caller_register_data;
 	void (*callback)(I2C_Transaction *trans);
 	I2C_HandleTypeDef *bus;
-	uint8_t local_register_data[MAX_I2C_REG_DATA+1]; // One more for write case to store register address
+	uint8_t local_register_data[MAX_I2C_REG_DATA];
+	I2C_Transaction *next; /* Pool free list link */
+	bool caller_owned; /* Reserved by the caller for reuse, not returned to the pool when done */
+	bool in_flight; /* Submitted and not yet finished */
+	struct I2C_Batch *batch; /* Batch this transaction is carrying, or NULL */
+	uint8_t batch_step; /* Step of the batch in progress */
+	struct I2C_Poll *poll; /* Poll this transaction reads for, or NULL */
+	struct I2C_Shadow *shadow; /* Shadow this transaction writes out or reads into, or NULL */
 } I2C_Transaction;
 
+/*
+ * A batch is an ordered list of register reads and writes on one bus, run back to back
+ * with a single callback at the end. The caller owns the batch and its steps, and they
+ * must stay put until the callback. Each step's status is filled in by the engine.
+ */
+
+typedef struct I2C_Batch_Step {
+	uint8_t type;
+	uint8_t device_address;
+	uint16_t register_address;
+	uint8_t data_length;
+	uint8_t *register_data;
+	uint8_t status; /* I2CEC_NOT_RUN if an earlier step failed and the batch stops on errors */
+} I2C_Batch_Step;
+
+typedef struct I2C_Batch {
+	I2C_Batch_Step *steps;
+	uint8_t step_count;
+	uint8_t bus;
+	bool stop_on_error; /* Skip the remaining steps after a failure */
+	uint8_t failed; /* Steps which did not finish with I2CEC_OK, filled in by the engine */
+	uint32_t id;
+	void (*callback)(I2C_Batch *batch);
+	bool in_flight; /* Submitted and not yet finished */
+} I2C_Batch;
+
+/*
+ * A register polled by the engine at a fixed period. The callback runs in the I2C task,
+ * only when masked bits change or the read status changes. The first good read is always reported.
+ */
+
+typedef struct I2C_Poll {
+	uint32_t id;
+	uint32_t period; /* Kernel ticks */
+	uint32_t due; /* Kernel tick of the next read */
+	uint32_t mask; /* Bits which are reported when they change */
+	uint32_t value; /* Last good read */
+	uint32_t changed; /* Masked bits which changed on the last read */
+	uint32_t reads;
+	uint8_t status; /* Status of the last read */
+	bool valid; /* value holds a good read */
+	bool active;
+	uint8_t data[I2C_MAX_POLL_DATA];
+	I2C_Transaction *trans;
+	void (*callback)(I2C_Poll *poll);
+} I2C_Poll;
+
+/*
+ * Cached copy of the registers of one device. Writes are masked updates applied to the cache and
+ * written out later by one engine owned transaction, so updates to a register which pile up while
+ * the bus is busy go out as one write. Reads of registers declared non-volatile come from the cache.
+ */
+
+typedef struct I2C_Shadow {
+	uint8_t bus;
+	uint8_t device_address;
+	uint32_t nonvolatile; /* Registers which only change when written */
+	uint32_t valid; /* Registers the cache holds the device value for */
+	uint32_t dirty; /* Registers changed in the cache and not yet written */
+	uint8_t registers[I2C_SHADOW_REGISTERS];
+	I2C_Transaction *flush; /* Writes out the dirty registers, in flight until none are left */
+	uint32_t updates;
+	uint32_t writes; /* Register writes sent on the bus */
+	uint32_t cached_reads;
+	uint32_t write_errors;
+} I2C_Shadow;
+
+/*
+ * Each bus has its own state machine and transaction queue, so a slow device on one bus does not hold up the other
+ */
+
+typedef struct I2C_Bus_State {
+	uint8_t state;
+	bool msg_ready;
+	I2C_Queue_Message msg; /* Last HAL completion message for this bus, valid while msg_ready */
+	I2C_Transaction *trans; /* Transaction in progress */
+	osMessageQueueId_t transactions; /* Queue of transaction pointers */
+} I2C_Bus_State;
 
 
 class I2C_Engine {
@@ -37,13 +132,50 @@ public:
 	void setup(void);
 	void loop(void);
 	bool queue_transaction(uint8_t type, uint8_t bus, uint8_t device_address,
-			uint8_t register_address, uint8_t data_length, uint8_t *register_data, void (*callback)(I2C_Transaction *trans), uint32_t trans_id);
+			uint16_t register_address, uint8_t data_length, uint8_t *register_data, void (*callback)(I2C_Transaction *trans), uint32_t trans_id);
+	I2C_Transaction *reserve_transaction(uint8_t type, uint8_t bus, uint8_t device_address,
+			uint16_t register_address, uint8_t data_length, uint8_t *register_data, void (*callback)(I2C_Transaction *trans), uint32_t trans_id);
+	bool submit_transaction(I2C_Transaction *trans);
+	bool release_transaction(I2C_Transaction *trans);
+	uint8_t transactions_free(void);
+	bool submit_batch(I2C_Batch *batch);
+	I2C_Poll *add_poll(uint8_t type, uint8_t bus, uint8_t device_address, uint16_t register_address, uint8_t data_length,
+			uint32_t mask, uint32_t period_ms, void (*callback)(I2C_Poll *poll), uint32_t id);
+	bool remove_poll(I2C_Poll *poll);
+	I2C_Shadow *add_shadow(uint8_t bus, uint8_t device_address, uint32_t nonvolatile);
+	void shadow_set(I2C_Shadow *shadow, uint8_t register_address, uint8_t value);
+	bool shadow_update(I2C_Shadow *shadow, uint8_t register_address, uint8_t mask, uint8_t value);
+	uint8_t shadow_read(I2C_Shadow *shadow, uint8_t register_address, uint8_t data_length, uint8_t *register_data,
+			void (*callback)(I2C_Transaction *trans), uint32_t trans_id);
 protected:
 	bool _check_i2c_message(I2C_Queue_Message *m, uint8_t expected_message);
-	bool _i2c_msg_ready;
-	uint8_t _state;
-	I2C_Transaction trans;
-	osMessageQueueId_t _queue_i2c_transactions;
+	bool _check_parameters(uint8_t type, uint8_t bus, uint8_t device_address, uint16_t register_address, uint8_t data_length, uint8_t *register_data);
+	void _load_transfer(I2C_Transaction *trans, uint8_t type, uint8_t device_address, uint16_t register_address,
+			uint8_t data_length, uint8_t *register_data);
+	bool _next_batch_step(I2C_Transaction *trans);
+	uint8_t _start_state(uint8_t type);
+	uint32_t _run_polls(void);
+	void _poll_done(I2C_Transaction *trans);
+	bool _next_shadow_write(I2C_Transaction *trans);
+	void _shadow_write_done(I2C_Transaction *trans);
+	void _shadow_read_done(I2C_Transaction *trans);
+	I2C_Transaction *_alloc_transaction(void);
+	void _free_transaction(I2C_Transaction *trans);
+	bool _build_transaction(I2C_Transaction *trans, uint8_t type, uint8_t bus, uint8_t device_address,
+			uint16_t register_address, uint8_t data_length, uint8_t *register_data, void (*callback)(I2C_Transaction *trans), uint32_t trans_id);
+	bool _route_messages(void);
+	bool _step(I2C_Bus_State *bs);
+	I2C_Bus_State _busses[NUM_I2C_BUSSES];
+	I2C_Transaction _pool[I2C_TRANSACTION_POOL_SIZE];
+	I2C_Transaction *_free; /* Head of the pool free list */
+	osMutexId_t _pool_lock;
+	I2C_Poll _polls[I2C_MAX_POLLS];
+	osMutexId_t _poll_lock; /* Serializes adding and removing polls with the scheduler */
+	I2C_Shadow _shadows[I2C_MAX_SHADOWS];
+	uint8_t _shadow_count;
+	osMutexId_t _shadow_lock; /* Serializes cache updates with the flush transactions */
 };
 
 } /* End namespace I2C_Engine */
+
+extern I2C_Engine::I2C_Engine I2c;
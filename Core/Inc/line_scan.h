@@ -0,0 +1,54 @@
+#pragma once
+#include "top.h"
+#include "i2c_engine.h"
+
+namespace Line_Scan {
+
+/*
+ * Lines are held 32 to a word. Bit n of word w is line (w * 32) + n, set when the line is off hook.
+ * Line cards are input expander ports read by I2C engine polls, which only report changes.
+ */
+
+const uint8_t LINES_PER_WORD = 32;
+const uint16_t MAX_LINES = 2048;
+const uint16_t MAX_WORDS = MAX_LINES / LINES_PER_WORD;
+const uint8_t ACTIVE_WORDS = MAX_WORDS / LINES_PER_WORD; /* Bitmap of the words still being debounced */
+const uint8_t MAX_CARD_PORTS = 4; /* 8 bit ports per card, all of them in one word */
+const uint16_t EVENT_QUEUE_SIZE = 64; /* Must be a power of 2 */
+const uint8_t DEBOUNCE_SCANS = 4; /* Scans a line must read the same in a row to change. Set by the 2 bit counters */
+
+static_assert((MAX_LINES % (LINES_PER_WORD * LINES_PER_WORD)) == 0, "Line count must fill the active word bitmap");
+static_assert((EVENT_QUEUE_SIZE & (EVENT_QUEUE_SIZE - 1)) == 0, "Event queue size must be a power of 2");
+
+typedef struct Hook_Event {
+	uint32_t timestamp; /* Kernel tick of the scan which saw the change */
+	uint16_t line;
+	bool off_hook;
+} Hook_Event;
+
+class Line_Scan {
+public:
+	void setup(void);
+	bool add_card(uint8_t bus, uint8_t device_address, uint16_t register_address, uint8_t ports, uint16_t first_line, uint32_t period_ms);
+	void set_port(uint16_t word, uint32_t sample);
+	void set_port_bits(uint16_t word, uint32_t sample, uint32_t mask);
+	void scan(void);
+	bool get_event(Hook_Event *event);
+	bool off_hook(uint16_t line);
+	uint32_t events_dropped(void) { return __atomic_load_n(&this->_events_dropped, __ATOMIC_RELAXED); };
+protected:
+	void _post_events(uint16_t word, uint32_t toggled, uint32_t state, uint32_t timestamp);
+	uint32_t _sample[MAX_WORDS]; /* Latest port snapshots, written by the I2C task */
+	uint32_t _state[MAX_WORDS]; /* Debounced hook state */
+	uint32_t _count0[MAX_WORDS]; /* Bit sliced 2 bit debounce counters, one bit of each line's count per word */
+	uint32_t _count1[MAX_WORDS];
+	uint32_t _active[ACTIVE_WORDS];
+	Hook_Event _events[EVENT_QUEUE_SIZE];
+	uint32_t _event_head; /* Written by the scanning task only */
+	uint32_t _event_tail; /* Written by the event reader only */
+	uint32_t _events_dropped;
+};
+
+} /* End namespace Line_Scan */
+
+extern Line_Scan::Line_Scan Lines;
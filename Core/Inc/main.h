@@ -51,11 +51,18 @@ extern I2S_HandleTypeDef hi2s2;
 extern DMA_HandleTypeDef hdma_spi2_tx;
 
 extern osMessageQueueId_t Queue_I2C_BussesHandle;
+extern osThreadId_t MF_ReceiverHandle;
+extern osThreadId_t I2sAudioHandle;
+extern osThreadId_t I2C_TaskHandle;
+extern uint32_t MF_frame_sequence;
+extern uint32_t I2S_frame_sequence;
 
 /* USER CODE END ET */
 
 /* Exported constants --------------------------------------------------------*/
 /* USER CODE BEGIN EC */
+#define FRAME_EVENT_FLAG 0x00000001U /* Thread flag set by the ADC and I2S DMA half/full interrupts */
+#define I2C_EVENT_FLAG 0x00000001U /* Thread flag set on the I2C task for new transactions and HAL completion messages */
 
 /* USER CODE END EC */
 
@@ -109,6 +116,10 @@ void Error_Handler(void);
 #define LEDN_GPIO_Port GPIOC
 #define MF_DECODER_ADC_Pin GPIO_PIN_0
 #define MF_DECODER_ADC_GPIO_Port GPIOA
+#define MF_DECODER_ADC2_Pin GPIO_PIN_1 /* Additional MF receiver inputs, scan converted after ADC1_IN0 */
+#define MF_DECODER_ADC2_GPIO_Port GPIOA
+#define MF_DECODER_ADC3_Pin GPIO_PIN_2
+#define MF_DECODER_ADC3_GPIO_Port GPIOA
 #define DTMF0_Pin GPIO_PIN_3
 #define DTMF0_GPIO_Port GPIOA
 #define DTMF1_Pin GPIO_PIN_4
@@ -1,5 +1,6 @@
 #pragma once
 #include "logging.h"
+#include "goertzel.h"
 
 namespace Mfd {
 
@@ -10,8 +11,11 @@ const uint8_t MF_MAX_DIGITS = 16;
 const uint8_t MF_DECODE_TABLE_SIZE = 15;
 const float MF_SAMPLE_RATE = 16000.0; // 16000 Hz simplifies the anti-aliasing low pass filter requirements.
 const uint16_t MF_FRAME_SIZE = 320; // 20mS
-const uint16_t MF_ADC_BUF_LEN = (2*MF_FRAME_SIZE);
+const uint8_t MF_NUM_RECEIVERS = 2; // One ADC input per receiver, all scan converted on each sample clock
+const uint8_t MF_MAX_RECEIVERS = 3; // Number of ADC inputs wired up for MF receivers
+const uint16_t MF_ADC_BUF_LEN = (2*MF_FRAME_SIZE*MF_NUM_RECEIVERS); // Samples are interleaved by receiver
 const float MIN_ADC = -2048.0;
+const float DC_TRACKING_RATE = 1.0/256.0; // DC removal filter, corner at about 10Hz
 const float SILENCE_THRESHOLD = 2.0; // Digit detect noise floor 
 const uint8_t MIN_KP_GATE_BLOCK_COUNT = 3;
 const uint8_t MIN_DIGIT_BLOCK_COUNT = 2;
@@ -21,16 +25,7 @@ const uint16_t MF_INTERDIGIT_TIMEOUT = 50*5; // 5 Seconds
 enum {MFE_OK=0, MFE_TIMEOUT};
 enum {MFR_IDLE=0, MFR_WAIT_KP, MFR_KP_SILENCE, MFR_WAIT_DIGIT, MFR_WAIT_DIGIT_SILENCE, MFR_TIMEOUT, MFR_DONE, MFR_WAIT_RELEASE};
 
-// Data for each goertzel tone decoder
-
-typedef struct goertzelData {
-	float q1;
-	float q2;
-	float coeff_k;
-	float power;
-} goertzelData;
-
-
+typedef void (*mfCallback)(uint32_t descriptor, uint8_t error_code, uint8_t digit_count, char *data);
 
 typedef struct mfData {
 	char tone_digit;
@@ -40,7 +35,8 @@ typedef struct mfData {
 	uint8_t tone_block_count;
 	uint8_t digit_count;
 	uint32_t descriptor;
-	void (*callback)(uint8_t error_code, uint8_t digit_count, char *data);
+	mfCallback callback;
+	float dc_level;
 	char digits[MF_MAX_DIGITS];
 
 
@@ -54,17 +50,25 @@ public:
 
 
 void setup(); /* Called once during initialization to set up the decoder */
-uint32_t seize(void (*callback)(uint8_t error_code, uint8_t digit_count, char *data)); /* Called to seize the MF receiver */
-bool release(uint32_t descriptor); /* Called to release the MF receiver */
+uint32_t seize(mfCallback callback); /* Called to seize a free MF receiver */
+bool release(uint32_t descriptor); /* Called to release an MF receiver */
 
 void handle_buffer(uint8_t buffer_no); // Called by the DMA engine when half full and full.'
 
+/* The ADC sampling is shared with the DTMF decoder */
+const uint16_t *frame(uint8_t buffer_no) { return (buffer_no) ? this->_mf_adc_buffer + (MF_FRAME_SIZE * MF_NUM_RECEIVERS) : this->_mf_adc_buffer; };
+bool start_sampling(void); /* Reference counted, the sample clock runs while anyone needs it */
+bool stop_sampling(void);
+
 
 protected:
-float _goertzel_block[MF_FRAME_SIZE];
-goertzelData _goertzel_data[NUM_MF_FREQUENCIES];
+void _configure_adc(void);
+uint8_t _detect_tones(uint8_t receiver, const uint16_t *frame);
+void _update_state(mfData *mf_data, uint8_t mf_code);
+Goertzel::Bank<NUM_MF_FREQUENCIES> _goertzel[MF_NUM_RECEIVERS];
 osMutexId_t _lock;
-mfData _mf_data;
+uint8_t _sampling_users;
+mfData _mf_data[MF_NUM_RECEIVERS];
 uint16_t _mf_adc_buffer[MF_ADC_BUF_LEN];
 
 };
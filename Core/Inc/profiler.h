@@ -0,0 +1,72 @@
+#pragma once
+#include "top.h"
+#ifdef HOST_BUILD
+#include <time.h>
+#endif
+
+/*
+ * Set to 0 to compile out the profiling points
+ */
+
+#define PROFILER_ENABLED 1
+
+namespace Profiler {
+
+/* Profiling sites */
+enum {PS_AUDIO_REQUEST_BLOCK=0, PS_MF_HANDLE_BUFFER, PS_DTMF_HANDLE_BUFFER,
+	PS_I2C_IDLE, PS_I2C_READ_REG, PS_I2C_READ_REG_WAIT_RCV, PS_I2C_WRITE_REG, PS_I2C_WRITE_REG_WAIT_XMIT, PS_I2C_FINISH,
+	PS_LINE_SCAN, PS_MAX_SITES};
+
+const uint8_t HISTOGRAM_BUCKETS = 12;
+const uint8_t HISTOGRAM_MIN_BIT = 10; /* Bucket 0 holds everything below 2^10 ticks, each following bucket doubles */
+const uint8_t MAX_HISTOGRAM_TEXT = 50;
+const uint8_t DUMP_IDLE = 0;
+
+typedef struct SiteStats {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+	uint32_t histogram[HISTOGRAM_BUCKETS];
+} SiteStats;
+
+
+class Profiler {
+public:
+	void setup(void);
+	void loop(void);
+	void record(uint8_t site, uint32_t ticks);
+	void request_dump(bool reset_after = false);
+	bool dump_pending(void) { return _dump_step != DUMP_IDLE; };
+	void reset(void);
+	uint32_t tick_hz(void);
+
+	/* Free running tick counter: DWT cycle counter on the target, nanoseconds on the host */
+	static inline uint32_t now(void) {
+#ifdef HOST_BUILD
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint32_t) (((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec);
+#else
+		return DWT->CYCCNT;
+#endif
+	};
+
+protected:
+	bool _dump_line(uint8_t step);
+	SiteStats _stats[PS_MAX_SITES];
+	volatile uint8_t _dump_step;
+	volatile bool _reset_after_dump;
+};
+
+} /* End namespace Profiler */
+
+extern Profiler::Profiler Prof;
+
+#if PROFILER_ENABLED
+#define PROFILE_START(var) uint32_t var = Profiler::Profiler::now()
+#define PROFILE_STOP(site, var) Prof.record(site, Profiler::Profiler::now() - (var))
+#else
+#define PROFILE_START(var)
+#define PROFILE_STOP(site, var)
+#endif
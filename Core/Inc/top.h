@@ -25,11 +25,11 @@ extern "C" {
 #endif
 
 extern void Top_init(void);
-extern void Top_process_MF_frame(uint8_t buffer_number);
+extern void Top_process_MF_frame(uint32_t sequence);
 extern void Top_switch_task(void);
 extern void Top_console_task(void);
 extern void Top_i2c_task(void);
-extern void Top_send_I2S_Audio_Frame(uint8_t buffer_number);
+extern void Top_send_I2S_Audio_Frame(uint32_t sequence);
 extern void Top_Int_Handler_Uart6(void);
 
 #ifdef __cplusplus
@@ -2,25 +2,77 @@
 #include "audio.h"
 #include "logging.h"
 #include "util.h"
+#include "profiler.h"
 #include <math.h>
 
 namespace Audio {
 
 static const char *TAG = "audio";
 
+static_assert((AUDIO_BUFFER_SIZE & 1) == 0, "The mixer works on pairs of samples");
+static_assert((FRAME_MS == 2) || (FRAME_MS == 5) || (FRAME_MS == 10) || (FRAME_MS == 20), "Unsupported audio frame length");
+static_assert((RING_SEGMENTS >= 2) && (RING_SEGMENTS <= 4), "Unsupported number of audio ring segments");
+
 #include "sine.h"
 
 
 
 
 
+#if AUDIO_RING_SEGMENTS > 2
+/*
+ * With more than two segments the I2S DMA runs in double buffer mode. When a memory pointer finishes
+ * its segment it is moved on to the segment after the one now playing, and the finished segment
+ * is handed to the render task. These run in the DMA interrupt.
+ */
+
+static int16_t *dma_ring;
+static volatile uint8_t dma_playing; /* Segment the DMA is playing */
+
+static void dma_segment_done(DMA_HandleTypeDef *hdma, HAL_DMA_MemoryTypeDef memory) {
+	dma_playing = (dma_playing + 1) % RING_SEGMENTS;
+	HAL_DMAEx_ChangeMemory(hdma, (uintptr_t) (dma_ring + (((dma_playing + 1) % RING_SEGMENTS) * LR_AUDIO_BUFFER_SIZE)), memory);
+	__atomic_fetch_add(&I2S_frame_sequence, 1, __ATOMIC_RELEASE);
+	osThreadFlagsSet(I2sAudioHandle, FRAME_EVENT_FLAG); /* Wake the audio processing task */
+}
+
+static void dma_m0_done(DMA_HandleTypeDef *hdma) {
+	dma_segment_done(hdma, MEMORY0);
+}
+
+static void dma_m1_done(DMA_HandleTypeDef *hdma) {
+	dma_segment_done(hdma, MEMORY1);
+}
+
+static void dma_error(DMA_HandleTypeDef *hdma) {
+	/* Nothing to do, the ring keeps going */
+}
+#endif
+
 /*
  * Start the DMA to the I2S audio device
  */
 
 void Audio::_dma_start(void) {
+	/* The first event after the start frees segment 0 */
+	this->_segment_sequence = __atomic_load_n(&I2S_frame_sequence, __ATOMIC_ACQUIRE);
+	this->_next_segment = 0;
+
 	/* Start up the DMA */
-	HAL_I2S_Transmit_DMA(&hi2s2, (uint16_t *) this->lr_audio_output_buffer, LR_AUDIO_BUFFER_SIZE * 2);
+#if AUDIO_RING_SEGMENTS > 2
+	dma_ring = this->lr_audio_output_buffer;
+	dma_playing = 0;
+	hi2s2.hdmatx->XferCpltCallback = dma_m0_done;
+	hi2s2.hdmatx->XferM1CpltCallback = dma_m1_done;
+	hi2s2.hdmatx->XferErrorCallback = dma_error;
+	HAL_DMAEx_MultiBufferStart_IT(hi2s2.hdmatx, (uintptr_t) this->lr_audio_output_buffer, (uintptr_t) &hi2s2.Instance->DR,
+			(uintptr_t) (this->lr_audio_output_buffer + LR_AUDIO_BUFFER_SIZE), LR_AUDIO_BUFFER_SIZE);
+	SET_BIT(hi2s2.Instance->CR2, SPI_CR2_TXDMAEN);
+	__HAL_I2S_ENABLE(&hi2s2);
+#else
+	/* Two segments are the two halves of a circular DMA, the I2S half and full callbacks hand them to the render task */
+	HAL_I2S_Transmit_DMA(&hi2s2, (uint16_t *) this->lr_audio_output_buffer, LR_AUDIO_BUFFER_SIZE * RING_SEGMENTS);
+#endif
 }
 
 /*
@@ -31,6 +83,95 @@ void Audio::_dma_stop(void) {
 	HAL_I2S_DMAStop(&hi2s2);
 }
 
+/*
+ * Read position of the I2S DMA in the output ring, in 16 bit samples.
+ * In double buffer mode a segment change between reading the segment and the counter can make this one segment off.
+ */
+
+uint32_t Audio::_dma_position(void) {
+	uint32_t remaining = __HAL_DMA_GET_COUNTER(hi2s2.hdmatx);
+#if AUDIO_RING_SEGMENTS > 2
+	return ((dma_playing * LR_AUDIO_BUFFER_SIZE) + (LR_AUDIO_BUFFER_SIZE - remaining)) % (LR_AUDIO_BUFFER_SIZE * RING_SEGMENTS);
+#else
+	return ((LR_AUDIO_BUFFER_SIZE * RING_SEGMENTS) - remaining) % (LR_AUDIO_BUFFER_SIZE * RING_SEGMENTS);
+#endif
+}
+
+/*
+ * How far ahead of the I2S DMA a segment is, in samples per slot. Zero or negative if the DMA is already playing it.
+ */
+
+int32_t Audio::_segment_slack(uint8_t segment) {
+	const uint32_t ring = LR_AUDIO_BUFFER_SIZE * RING_SEGMENTS;
+	uint32_t ahead = ((segment * LR_AUDIO_BUFFER_SIZE) + ring - this->_dma_position()) % ring;
+
+	if((ahead == 0) || (ahead > (ring - LR_AUDIO_BUFFER_SIZE))) {
+		/* Playing it, this far in */
+		return -(int32_t) (((ring - ahead) % ring) / NUM_OUTPUT_SLOTS);
+	}
+	return ahead / NUM_OUTPUT_SLOTS;
+}
+
+/*
+ * Return the render deadline statistics
+ */
+
+void Audio::deadline_stats(DeadlineStats *stats) {
+	stats->renders = this->_renders;
+	stats->late_renders = this->_late_renders;
+	stats->segments_skipped = this->_segments_skipped;
+	stats->min_slack_us = this->_min_slack * (int32_t) TIME_PER_SAMPLE_US;
+}
+
+/*
+ * Clear the render deadline statistics
+ */
+
+void Audio::reset_deadline_stats(void) {
+	this->_renders = 0;
+	this->_late_renders = 0;
+	this->_segments_skipped = 0;
+	this->_min_slack = AUDIO_BUFFER_SIZE * RING_SEGMENTS;
+	this->_reported_late_renders = 0;
+	this->_reported_segments_skipped = 0;
+	this->_reported_at = osKernelGetTickCount() - ((DEADLINE_REPORT_MS * osKernelGetTickFreq()) / 1000);
+}
+
+/*
+ * Called from the console task. Logs the deadline statistics when there have been new late renders or skipped segments,
+ * at most once every DEADLINE_REPORT_MS.
+ */
+
+void Audio::report_deadlines(void) {
+	DeadlineStats stats;
+
+	this->deadline_stats(&stats);
+	if((stats.late_renders == this->_reported_late_renders) && (stats.segments_skipped == this->_reported_segments_skipped)) {
+		return;
+	}
+	uint32_t now = osKernelGetTickCount();
+	if((now - this->_reported_at) < ((DEADLINE_REPORT_MS * osKernelGetTickFreq()) / 1000)) {
+		return;
+	}
+	this->_reported_at = now;
+	this->_reported_late_renders = stats.late_renders;
+	this->_reported_segments_skipped = stats.segments_skipped;
+	LOG_WARN(TAG, "Audio deadline: renders %lu, late %lu, skipped %lu, min slack %lduS", stats.renders,
+			stats.late_renders, stats.segments_skipped, stats.min_slack_us);
+}
+
+/*
+ * Convert a level in dB to a Q15 gain, saturating at 0dB
+ */
+
+int16_t Audio::_db_to_q15(float db_level) {
+	int32_t level = (int32_t) ((pow(10, (db_level / 20)) * (1 << Q15_SHIFT)) + 0.5);
+	if(level > Q15_MAX) {
+		level = Q15_MAX;
+	}
+	return (int16_t) level;
+}
+
 /*
  * Set up the generation of a single tone
  */
@@ -46,9 +187,11 @@ void Audio::_generate_dual_tone(ChannelInfo *channel_info, float freq1, float fr
 
 	channel_info->f1 = freq1;
 	channel_info->f2 = freq2;
-	// Treat as DbV here.
-	channel_info->f1_level = pow(10,(db_level1/20));
-	channel_info->f2_level = pow(10,(db_level2/20));
+	// Treat as DbV here. Converted once to Q15 so the per-sample path is integer only.
+	// An unused tone gets a level of zero, which removes the need to test for it per sample.
+	channel_info->level_q15[0] = (freq1 != 0.0) ? this->_db_to_q15(db_level1) : 0;
+	channel_info->level_q15[1] = (freq2 != 0.0) ? this->_db_to_q15(db_level2) : 0;
+	channel_info->wavetable = NULL;
 
 	channel_info->phase_accum[0] = 0;
 	channel_info->phase_accum[1] = 0;
@@ -70,48 +213,172 @@ void Audio::_generate_dual_tone(ChannelInfo *channel_info, float freq1, float fr
 
 
 /*
- * Call to return the next computed value
+ * Render one exact common period of a dual tone into the wavetable pool.
+ *
+ * The period is the sample rate divided by the greatest common divisor of the two
+ * frequencies, so both tones complete a whole number of cycles and the table loops
+ * seamlessly. Returns false if the frequencies are not whole numbers of Hz, or if
+ * the period does not fit in what is left of the pool.
  */
 
+bool Audio::_build_wavetable(Wavetable *table, const float *tone_pair, const float *level_pair) {
+#if AUDIO_CPT_WAVETABLES
+	uint32_t a = (uint32_t) tone_pair[0];
+	uint32_t b = (uint32_t) tone_pair[1];
 
-int16_t Audio::_next_tone_value(ChannelInfo *channel_info) {
+	table->samples = NULL;
+	table->length = 0;
+
+	if((!a) || (!b) || (a != tone_pair[0]) || (b != tone_pair[1])) {
+		return false;
+	}
+
+	/* Euclid's algorithm */
+	while(b) {
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	uint32_t sample_rate = (uint32_t) SAMPLE_FREQ_HZ;
+	if(sample_rate % a) {
+		return false;
+	}
+	uint32_t length = sample_rate / a;
+	if(length > (uint32_t) (CPT_WAVETABLE_POOL_SIZE - this->_cpt_wavetable_pool_used)) {
+		return false;
+	}
 
+	int16_t *samples = this->_cpt_wavetable_pool + this->_cpt_wavetable_pool_used;
+	int32_t level_f1 = this->_db_to_q15(level_pair[0]);
+	int32_t level_f2 = this->_db_to_q15(level_pair[1]);
 
-	int16_t rawval_f1 = 0;
-	int16_t rawval_f2 = 0;
+	uint32_t f1 = (uint32_t) tone_pair[0];
+	uint32_t f2 = (uint32_t) tone_pair[1];
 
-	if(channel_info->f1 != 0.0) {
-		uint16_t sine_table_index = (uint16_t) (channel_info->phase_accum[0] >> PHASE_ACCUMULATOR_TRUNCATION); /* Get sine table index for F1 */
-		rawval_f1 = lut[sine_table_index];
-		/* For signed audio, positive and negative excursions need to be handled differently */
-		if(rawval_f1 >= 0){
-			rawval_f1 = rawval_f1 * channel_info->f1_level;
-		}
-		else {
-			rawval_f1 = -(-rawval_f1 * channel_info->f1_level);
-		}
+	/* Same scaling as the synthesized path, with the sine table replaced by exact values. Phase is kept in whole cycles. */
+	for(uint32_t n = 0; n < length; n++) {
+		int32_t raw_f1 = (int32_t) lroundf(Q15_MAX * sinf((2.0f * (float) M_PI * ((f1 * n) % sample_rate)) / SAMPLE_FREQ_HZ));
+		int32_t raw_f2 = (int32_t) lroundf(Q15_MAX * sinf((2.0f * (float) M_PI * ((f2 * n) % sample_rate)) / SAMPLE_FREQ_HZ));
+		samples[n] = (int16_t) (((raw_f1 * level_f1) + (raw_f2 * level_f2)) >> Q15_SHIFT);
 	}
 
-	if(channel_info->f2 != 0.0) {
-		uint16_t sine_table_index = (uint16_t) (channel_info->phase_accum[1] >> PHASE_ACCUMULATOR_TRUNCATION); /* Get sine table index for F2 */
-		rawval_f2 = lut[sine_table_index];
-		/* For signed audio, positive and negative excursions need to be handled differently */
-		if(rawval_f2 >= 0){
-			rawval_f2 = rawval_f2 * channel_info->f2_level;
+	this->_cpt_wavetable_pool_used += length;
+	table->samples = samples;
+	table->length = length;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Precompute the call progress tone wavetables. Called once from setup().
+ */
+
+void Audio::_build_cpt_wavetables(void) {
+#if AUDIO_CPT_WAVETABLES
+	this->_cpt_wavetable_pool_used = 0;
+
+	if(!this->_build_wavetable(&this->_cpt_wavetables[CPT_DIAL_TONE], INDICATIONS.dial_tone.tone_pair, INDICATIONS.dial_tone.level_pair)) {
+		LOG_WARN(TAG, "Dial tone will be synthesized");
+	}
+	if(!this->_build_wavetable(&this->_cpt_wavetables[CPT_BUSY], INDICATIONS.busy.tone_pair, INDICATIONS.busy.level_pair)) {
+		LOG_WARN(TAG, "Busy tone will be synthesized");
+	}
+	/* Congestion uses the same tones as busy with a different cadence */
+	this->_cpt_wavetables[CPT_CONGESTION] = this->_cpt_wavetables[CPT_BUSY];
+	if(!this->_build_wavetable(&this->_cpt_wavetables[CPT_RINGING], INDICATIONS.ringing.tone_pair, INDICATIONS.ringing.level_pair)) {
+		LOG_WARN(TAG, "Ringing tone will be synthesized");
+	}
+#endif
+}
+
+/*
+ * Switch a channel which has just been set up for a call progress tone over to its wavetable, if there is one
+ */
+
+void Audio::_use_cpt_wavetable(ChannelInfo *ch_info, uint8_t type) {
+#if AUDIO_CPT_WAVETABLES
+	Wavetable *table = &this->_cpt_wavetables[type];
+	if(table->samples) {
+		ch_info->wavetable = table->samples;
+		ch_info->wavetable_length = table->length;
+		ch_info->wavetable_index = 0;
+	}
+#endif
+}
+
+/*
+ * Build the G.711 expansion tables, one linear sample for each of the 256 codes (ITU-T G.711).
+ * Codes are stored inverted (mu-law) or with the even bits inverted (A-law), sign in the top bit,
+ * then a 3 bit segment and a 4 bit step within the segment.
+ */
+
+void Audio::_build_g711_tables(void) {
+	for(uint16_t code = 0; code < G711_TABLE_SIZE; code++) {
+		/* mu-law: biased by 0x84 so every segment is a plain shift */
+		uint8_t u = ~code;
+		int16_t magnitude = ((((u & 0x0F) << 3) + 0x84) << ((u & 0x70) >> 4)) - 0x84;
+		this->_g711_expand[AE_ULAW - AE_ULAW][code] = (u & 0x80) ? -magnitude : magnitude;
+
+		/* A-law: segment 0 is linear, no bias */
+		uint8_t a = code ^ 0x55;
+		uint8_t segment = (a & 0x70) >> 4;
+		magnitude = ((a & 0x0F) << 4) + 8;
+		if(segment) {
+			magnitude = (magnitude + 0x100) << (segment - 1);
 		}
-		else {
-			rawval_f2 = -(-rawval_f2 * channel_info->f2_level);
+		this->_g711_expand[AE_ALAW - AE_ULAW][code] = (a & 0x80) ? magnitude : -magnitude;
+	}
+}
+
+/*
+ * Copy a run of samples from the channel's sample to a block, expanding G.711 codes through the table.
+ */
+
+void Audio::_copy_sample_run(ChannelInfo *ch_info, int16_t *out, uint32_t count) {
+	if(ch_info->expand_table) {
+		const int16_t *table = ch_info->expand_table;
+		const uint8_t *codes = (const uint8_t *) ch_info->audio_sample + ch_info->audio_sample_index;
+		for(uint32_t i = 0; i < count; i++) {
+			out[i] = table[codes[i]];
 		}
 	}
+	else {
+		memcpy(out, (const int16_t *) ch_info->audio_sample + ch_info->audio_sample_index, count * sizeof(int16_t));
+	}
+}
 
-	/* Advance to next phase accumulator value */
-	for(int i = 0; i < 2; i++) {
-		channel_info->phase_accum [i] = (channel_info->phase_accum[i] + channel_info->tuning_word[i]) & (PHASE_ACCUMULATOR_MASK);
+/*
+ * Call to return the next computed value
+ */
+
+
+int16_t Audio::_next_tone_value(ChannelInfo *channel_info) {
+
+	if(channel_info->wavetable) {
+		int16_t val = channel_info->wavetable[channel_info->wavetable_index++];
+		if(channel_info->wavetable_index >= channel_info->wavetable_length) {
+			channel_info->wavetable_index = 0;
+		}
+		return val;
 	}
 
+	/* Get sine table samples for F1 and F2 */
+	int16_t rawval_f1 = (int16_t) lut[channel_info->phase_accum[0] >> PHASE_ACCUMULATOR_TRUNCATION];
+	int16_t rawval_f2 = (int16_t) lut[channel_info->phase_accum[1] >> PHASE_ACCUMULATOR_TRUNCATION];
 
+	/*
+	 * Scale and sum both tones in Q15. 16x16 bit products with a 32 bit accumulate,
+	 * which compiles to SMULBB/SMLABB on the M4. No sign handling is needed.
+	 */
+	int32_t acc = ((int32_t) rawval_f1 * channel_info->level_q15[0]) + ((int32_t) rawval_f2 * channel_info->level_q15[1]);
+
+	/* Advance to next phase accumulator value */
+	channel_info->phase_accum[0] = (channel_info->phase_accum[0] + channel_info->tuning_word[0]) & (PHASE_ACCUMULATOR_MASK);
+	channel_info->phase_accum[1] = (channel_info->phase_accum[1] + channel_info->tuning_word[1]) & (PHASE_ACCUMULATOR_MASK);
 
-	return rawval_f1 + rawval_f2;
+	return (int16_t) (acc >> Q15_SHIFT);
 }
 
 
@@ -215,12 +482,181 @@ bool Audio::_convert_digit_string(ChannelInfo *ch_info, const char *digits, bool
  */
 
 bool Audio::_validate_channel(uint32_t channel_number) {
-	if(channel_number > NUM_AUDIO_CHANNELS){
+	if((!channel_number) || (channel_number > NUM_AUDIO_CHANNELS)){
 		return false;
 	}
 	return true;
 }
 
+/*
+ * Get the next free command slot for a channel. Must be called with the lock held.
+ *
+ * Returns NULL if the render task hasn't caught up with the commands already posted.
+ */
+
+AudioCommand *Audio::_command_slot(uint32_t channel_number) {
+	CommandQueue *queue = &this->_commands[channel_number - 1];
+	uint8_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+	if((uint8_t) (queue->tail - head) >= COMMAND_QUEUE_DEPTH) {
+		LOG_ERROR(TAG, "Command queue full on channel %lu", channel_number);
+		return NULL;
+	}
+	return &queue->commands[queue->tail & (COMMAND_QUEUE_DEPTH - 1)];
+}
+
+/*
+ * Hand the command filled in at the slot from _command_slot() to the render task. Must be called with the lock held.
+ * The stream queue position is recorded too, so chunks queued after this point are kept when it is applied.
+ */
+
+void Audio::_command_post(uint32_t channel_number) {
+	CommandQueue *queue = &this->_commands[channel_number - 1];
+	queue->commands[queue->tail & (COMMAND_QUEUE_DEPTH - 1)].stream_mark = this->_streams[channel_number - 1].tail;
+	__atomic_store_n(&queue->tail, (uint8_t) (queue->tail + 1), __ATOMIC_RELEASE);
+}
+
+/*
+ * Post a command which doesn't carry any digits, samples or callback
+ *
+ * Returns true if successful
+ */
+
+bool Audio::_post_simple_command(uint32_t channel_number, uint8_t op, uint8_t state, uint8_t output_slot) {
+	bool res = false;
+
+	osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
+	AudioCommand *cmd = this->_command_slot(channel_number);
+	if(cmd) {
+		cmd->op = op;
+		cmd->state = state;
+		cmd->output_slot = output_slot;
+		cmd->callback = NULL;
+		cmd->refill = NULL;
+		cmd->digit_string_length = 0;
+		this->_command_post(channel_number);
+		res = true;
+	}
+	osMutexRelease(this->_lock); /* Release the lock */
+	return res;
+}
+
+/*
+ * Called by the render task at the start of each block to apply the commands posted for a channel.
+ * Never blocks.
+ */
+
+void Audio::_apply_commands(uint8_t channel_index) {
+	CommandQueue *queue = &this->_commands[channel_index];
+	ChannelInfo *ch_info = &this->channel_info[channel_index];
+	uint8_t head = queue->head;
+	uint8_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+	while(head != tail) {
+		AudioCommand *cmd = &queue->commands[head & (COMMAND_QUEUE_DEPTH - 1)];
+		if(cmd->op != AC_ROUTE) {
+			/* Whatever was queued for a stream being replaced won't be played. Chunks queued since the command was posted are kept */
+			this->_stream_discard(channel_index, cmd->stream_mark);
+		}
+		switch(cmd->op) {
+			case AC_START:
+				ch_info->callback = cmd->callback;
+				ch_info->refill = cmd->refill;
+				ch_info->stream_low_water = cmd->stream_low_water;
+				ch_info->audio_sample = cmd->audio_sample;
+				ch_info->expand_table = ((cmd->state == AS_SEND_AUDIO) || (cmd->state == AS_SEND_AUDIO_LOOP)) && (cmd->audio_encoding != AE_LINEAR) ?
+						this->_g711_expand[cmd->audio_encoding - AE_ULAW] : NULL;
+				ch_info->audio_sample_size = cmd->audio_sample_size;
+				memcpy(ch_info->digit_string, cmd->digit_string, cmd->digit_string_length);
+				ch_info->digit_string_length = cmd->digit_string_length;
+				ch_info->state = cmd->state;
+				break;
+
+			case AC_STOP:
+			case AC_RELEASE:
+				ch_info->state = AS_IDLE;
+				break;
+
+			case AC_ROUTE:
+				ch_info->output_slot = cmd->output_slot;
+				break;
+
+			default:
+				break;
+		}
+		head++;
+		__atomic_store_n(&queue->head, head, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Called by the render task when an operation finishes, or a stream wants more chunks. Records the channel
+ * and the sample it happened on, the callback itself is made later by dispatch_completions().
+ */
+
+void Audio::_post_completion(uint8_t channel_index, uint16_t sample_offset, bool is_refill) {
+	uint8_t tail = this->_completion_tail;
+	uint8_t head = __atomic_load_n(&this->_completion_head, __ATOMIC_ACQUIRE);
+
+	if((uint8_t) (tail - head) >= COMPLETION_QUEUE_DEPTH) {
+		this->_completions_dropped++; /* Can't wait here, and logging would take too long */
+		return;
+	}
+	CompletionEvent *event = &this->_completions[tail & (COMPLETION_QUEUE_DEPTH - 1)];
+	event->callback = (is_refill) ? this->channel_info[channel_index].refill : this->channel_info[channel_index].callback;
+	event->channel_number = channel_index + 1;
+	event->sample_time = this->_sample_time + sample_offset;
+	event->is_refill = is_refill;
+	__atomic_store_n(&this->_completion_tail, (uint8_t) (tail + 1), __ATOMIC_RELEASE);
+}
+
+/*
+ * Make the callbacks for operations the render task has finished.
+ * Called periodically by the switch task, so the callbacks run there instead of in the I2S task.
+ *
+ * Returns the number of callbacks made
+ */
+
+uint32_t Audio::dispatch_completions(void) {
+	uint32_t count = 0;
+
+	for(;;) {
+		CompletionEvent event;
+
+		/* Take one event at a time, so the lock isn't held during the callback */
+		osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
+		uint8_t head = this->_completion_head;
+		if(head == __atomic_load_n(&this->_completion_tail, __ATOMIC_ACQUIRE)) {
+			osMutexRelease(this->_lock); /* Release the lock */
+			break;
+		}
+		event = this->_completions[head & (COMPLETION_QUEUE_DEPTH - 1)];
+		__atomic_store_n(&this->_completion_head, (uint8_t) (head + 1), __ATOMIC_RELEASE);
+		if(!event.is_refill) {
+			this->channel_info[event.channel_number - 1].completed_at = event.sample_time;
+		}
+		osMutexRelease(this->_lock); /* Release the lock */
+
+		if(event.callback) {
+			event.callback(event.channel_number);
+		}
+		count++;
+	}
+	return count;
+}
+
+/*
+ * Return the sample time the last operation on a channel finished at.
+ * Sample time counts samples per output slot since setup, at SAMPLE_FREQ_HZ.
+ */
+
+uint32_t Audio::completed_at(uint32_t channel_number) {
+	if(!this->_validate_channel(channel_number)) {
+		return 0;
+	}
+	return this->channel_info[channel_number - 1].completed_at;
+}
+
 /*
  * Called to set up the audio processing
  * before the RTOS starts running
@@ -238,6 +674,12 @@ void Audio::setup(void) {
 	/* Create intertask lock */
 	this->_lock = osMutexNew(&aud_mutex_attr);
 
+#if AUDIO_CPT_WAVETABLES
+	this->_build_cpt_wavetables();
+#endif
+	this->_build_g711_tables();
+	this->reset_deadline_stats();
+
 	/* Start I2S DMA */
 
 	this->_dma_start();
@@ -248,17 +690,35 @@ void Audio::setup(void) {
 /*
  * Seize an audio channel and return a channel number.
  *
+ * The channel is mixed onto the output slot passed in. If OUTPUT_SLOT_DEFAULT
+ * is passed in, odd channel numbers go to the left slot and even channel numbers
+ * go to the right slot.
+ *
  * If no channel is available, return 0.
  */
 
-uint32_t Audio::seize(void) {
+uint32_t Audio::seize(uint8_t output_slot) {
 	uint32_t channel_number;
+
+	if((output_slot != OUTPUT_SLOT_DEFAULT) && (output_slot >= NUM_OUTPUT_SLOTS)) {
+		return 0;
+	}
+
 	osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
 
 	for(channel_number = 1; this->_validate_channel(channel_number); channel_number++) {
 		ChannelInfo *ch_info = &this->channel_info[channel_number - 1];
 		if(!ch_info->in_use) {
 			ch_info->in_use = true;
+			/* Routing is applied by the render task, ahead of any operation started on the channel */
+			AudioCommand *cmd = this->_command_slot(channel_number);
+			if(!cmd) {
+				ch_info->in_use = false;
+				continue;
+			}
+			cmd->op = AC_ROUTE;
+			cmd->output_slot = (output_slot == OUTPUT_SLOT_DEFAULT) ? ((channel_number - 1) % NUM_OUTPUT_SLOTS) : output_slot;
+			this->_command_post(channel_number);
 			break;
 		}
 	}
@@ -270,6 +730,21 @@ uint32_t Audio::seize(void) {
 	return channel_number;
 }
 
+/*
+ * Change the output slot a channel is mixed onto
+ *
+ * Return true if successful
+ */
+
+bool Audio::route(uint32_t channel_number, uint8_t output_slot) {
+
+	if((!this->_validate_channel(channel_number)) || (output_slot >= NUM_OUTPUT_SLOTS)) {
+		return false;
+	}
+
+	return this->_post_simple_command(channel_number, AC_ROUTE, AS_IDLE, output_slot);
+}
+
 /*
  * Release an audio channel
  *
@@ -283,17 +758,20 @@ bool Audio::release(uint32_t channel_number) {
 		return false;
 	}
 
+	bool res = true;
 	osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
 	ChannelInfo *ch_info = &this->channel_info[channel_number - 1];
-	/* Release channel if in use */
+	/* Release channel if in use. The render task idles it before anything a new owner posts */
 	if(ch_info->in_use) {
-		ch_info->state = AS_IDLE;
-		ch_info->in_use = false;
+		res = this->_post_simple_command(channel_number, AC_RELEASE);
+		if(res) {
+			ch_info->in_use = false;
+		}
 	}
 	osMutexRelease(this->_lock); /* Release the lock */
 
 
-	return true;
+	return res;
 
 }
 
@@ -310,31 +788,28 @@ bool Audio::send_call_progress_tones(uint32_t channel_number, uint8_t type) {
 		return false;
 	}
 
-	osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
-
-	ChannelInfo *ch_info = &this->channel_info[channel_number - 1];
+	uint8_t state = AS_IDLE;
 
 	/* Set the call progress tone type */
 	switch(type) {
 		case CPT_DIAL_TONE:
-			ch_info->state = AS_GEN_DIAL_TONE;
+			state = AS_GEN_DIAL_TONE;
 			break;
 
 		case CPT_BUSY:
-			ch_info->state = AS_GEN_BUSY_TONE;
+			state = AS_GEN_BUSY_TONE;
 			break;
 
 		case CPT_CONGESTION:
-			ch_info->state = AS_GEN_CONGESTION_TONE;
+			state = AS_GEN_CONGESTION_TONE;
 			break;
 
 		case CPT_RINGING:
-			ch_info->state = AS_GEN_RINGING_TONE;
+			state = AS_GEN_RINGING_TONE;
 			break;
 	}
 
-	osMutexRelease(this->_lock); /* Release the lock */
-	return true;
+	return this->_post_simple_command(channel_number, AC_START, state);
 
 }
 /*
@@ -350,45 +825,53 @@ bool Audio::send_mf(uint32_t channel_number, const char *digit_string, void (*ca
 	if((!digit_string) || (!callback))
 		return false;
 
+	int len = strlen(digit_string);
+	if(len > DIGIT_STRING_MAX_LENGTH) {
+		return false;
+	}
+
 	osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
-	ChannelInfo *ch_info = &this->channel_info[channel_number - 1];
+	AudioCommand *cmd = this->_command_slot(channel_number);
+	if(!cmd) {
+		osMutexRelease(this->_lock); /* Release the lock */
+		return false;
+	}
 
-	int len = strlen(digit_string);
-	ch_info->digit_string_length = 0;
+	cmd->digit_string_length = 0;
 	for (int i = 0; i < len; i++) {
 		switch (digit_string[i]) {
 			case 0:
 				break;
 
 			case '*':
-				ch_info->digit_string[i] = 0x0a;
-				ch_info->digit_string_length++;
+				cmd->digit_string[i] = 0x0a;
+				cmd->digit_string_length++;
 				break;
 
 			case '#':
-				ch_info->digit_string[i] = 0x0b;
-				ch_info->digit_string_length++;
+				cmd->digit_string[i] = 0x0b;
+				cmd->digit_string_length++;
 				break;
 
 			case 'A':
-				ch_info->digit_string[i] = 0x0c;
-				ch_info->digit_string_length++;
+				cmd->digit_string[i] = 0x0c;
+				cmd->digit_string_length++;
 				break;
 
 			case 'B':
-				ch_info->digit_string[i] = 0x0d;
-				ch_info->digit_string_length++;
+				cmd->digit_string[i] = 0x0d;
+				cmd->digit_string_length++;
 				break;
 
 			case 'C':
-				ch_info->digit_string[i] = 0x0e;
-				ch_info->digit_string_length++;
+				cmd->digit_string[i] = 0x0e;
+				cmd->digit_string_length++;
 				break;
 
 			default:
 				if((digit_string[i] >= '0' || digit_string[i] <= '9')){
-					ch_info->digit_string[i] = digit_string[i] - 0x30;
-					ch_info->digit_string_length++;
+					cmd->digit_string[i] = digit_string[i] - 0x30;
+					cmd->digit_string_length++;
 				}
 				break;
 		}
@@ -398,8 +881,11 @@ bool Audio::send_mf(uint32_t channel_number, const char *digit_string, void (*ca
 
 
 
-	ch_info->callback = callback;
-	ch_info->state = AS_SEND_MF;
+	cmd->op = AC_START;
+	cmd->callback = callback;
+	cmd->refill = NULL;
+	cmd->state = AS_SEND_MF;
+	this->_command_post(channel_number);
 
 	osMutexRelease(this->_lock); /* Release the lock */
 	return true;
@@ -420,90 +906,121 @@ bool Audio::send_dtmf(uint32_t channel_number, const char *digit_string, void (*
 		return false;
 
 
+	int len = strlen(digit_string);
+	if(len > DIGIT_STRING_MAX_LENGTH) {
+		return false;
+	}
+
 	osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
-	ChannelInfo *ch_info = &this->channel_info[channel_number - 1];
+	AudioCommand *cmd = this->_command_slot(channel_number);
+	if(!cmd) {
+		osMutexRelease(this->_lock); /* Release the lock */
+		return false;
+	}
 
-	int len = strlen(digit_string);
-	ch_info->digit_string_length = 0;
+	cmd->digit_string_length = 0;
 	for (int i = 0; i < len; i++) {
 		switch (digit_string[i]) {
 			case 0:
 				break;
 
 			case '*':
-				ch_info->digit_string[i] = 0x0a;
-				ch_info->digit_string_length++;
+				cmd->digit_string[i] = 0x0a;
+				cmd->digit_string_length++;
 				break;
 
 			case '#':
-				ch_info->digit_string[i] = 0x0b;
-				ch_info->digit_string_length++;
+				cmd->digit_string[i] = 0x0b;
+				cmd->digit_string_length++;
 				break;
 
 			case 'A':
-				ch_info->digit_string[i] = 0x0c;
-				ch_info->digit_string_length++;
+				cmd->digit_string[i] = 0x0c;
+				cmd->digit_string_length++;
 				break;
 
 			case 'B':
-				ch_info->digit_string[i] = 0x0d;
-				ch_info->digit_string_length++;
+				cmd->digit_string[i] = 0x0d;
+				cmd->digit_string_length++;
 				break;
 
 			case 'C':
-				ch_info->digit_string[i] = 0x0e;
-				ch_info->digit_string_length++;
+				cmd->digit_string[i] = 0x0e;
+				cmd->digit_string_length++;
 				break;
 
 			case 'D':
-				ch_info->digit_string[i] = 0x0f;
-				ch_info->digit_string_length++;
+				cmd->digit_string[i] = 0x0f;
+				cmd->digit_string_length++;
 				break;
 
 			default:
 				if((digit_string[i] >= '0' || digit_string[i] <= '9')){
-					ch_info->digit_string[i] = digit_string[i] - 0x30;
-					ch_info->digit_string_length++;
+					cmd->digit_string[i] = digit_string[i] - 0x30;
+					cmd->digit_string_length++;
 				}
 				break;
 		}
 		if(!digit_string[i])
 			break;
 	}
-	ch_info->callback = callback;
-	ch_info->state = AS_SEND_DTMF;
+	cmd->op = AC_START;
+	cmd->callback = callback;
+	cmd->refill = NULL;
+	cmd->state = AS_SEND_DTMF;
+	this->_command_post(channel_number);
 
 	osMutexRelease(this->_lock); /* Release the lock */
 	return true;
 }
 
 /*
- * Send an audio sample
- * Call the callback function when the sample is completely sent
+ * Post a sample to be played from memory, linear or G.711 encoded
  */
 
-bool Audio::send(uint32_t channel_number, const int16_t *samples, uint32_t length, void (*callback)(uint32_t channel_number)) {
+bool Audio::_post_sample(uint32_t channel_number, const void *samples, uint32_t length, uint8_t encoding, uint8_t state,
+		void (*callback)(uint32_t channel_number)) {
 
 	if (!this->_validate_channel(channel_number)) {
 		return false;
 	}
 
-	if ((!samples) || (!callback)) {
+	if ((!samples) || (encoding > AE_ALAW)) {
 		return false;
 	}
 
+	bool res = false;
 	osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
 
-	ChannelInfo *ch_info = &this->channel_info[channel_number - 1];
-
-	ch_info->callback = callback;
-	ch_info->audio_sample_size = length;
-	ch_info->audio_sample = samples;
-	ch_info->state = AS_SEND_AUDIO;
+	AudioCommand *cmd = this->_command_slot(channel_number);
+	if(cmd) {
+		cmd->op = AC_START;
+		cmd->callback = callback;
+		cmd->refill = NULL;
+		cmd->audio_sample_size = length;
+		cmd->audio_sample = samples;
+		cmd->audio_encoding = encoding;
+		cmd->digit_string_length = 0;
+		cmd->state = state;
+		this->_command_post(channel_number);
+		res = true;
+	}
 
 	osMutexRelease(this->_lock); /* Release the lock */
-	return true;
+	return res;
+}
+
+/*
+ * Send an audio sample
+ * Call the callback function when the sample is completely sent
+ */
 
+bool Audio::send(uint32_t channel_number, const int16_t *samples, uint32_t length, void (*callback)(uint32_t channel_number)) {
+
+	if (!callback) {
+		return false;
+	}
+	return this->_post_sample(channel_number, samples, length, AE_LINEAR, AS_SEND_AUDIO, callback);
 }
 
 /*
@@ -513,26 +1030,187 @@ bool Audio::send(uint32_t channel_number, const int16_t *samples, uint32_t lengt
  */
 
 bool Audio::send_loop(uint32_t channel_number, const int16_t *samples, uint32_t length) {
+	return this->_post_sample(channel_number, samples, length, AE_LINEAR, AS_SEND_AUDIO_LOOP, NULL);
+}
+
+/*
+ * Send a G.711 mu-law (AE_ULAW) or A-law (AE_ALAW) encoded audio sample, one byte per sample.
+ * It is expanded to linear as it is played.
+ * Call the callback function when the sample is completely sent
+ */
+
+bool Audio::send_g711(uint32_t channel_number, const uint8_t *codes, uint32_t length, uint8_t encoding, void (*callback)(uint32_t channel_number)) {
+
+	if ((!callback) || (encoding == AE_LINEAR)) {
+		return false;
+	}
+	return this->_post_sample(channel_number, codes, length, encoding, AS_SEND_AUDIO, callback);
+}
+
+/*
+ * Send a G.711 encoded audio loop.
+ *
+ * Will continue to send the audio loop until the stop function is called.
+ */
+
+bool Audio::send_loop_g711(uint32_t channel_number, const uint8_t *codes, uint32_t length, uint8_t encoding) {
+
+	if (encoding == AE_LINEAR) {
+		return false;
+	}
+	return this->_post_sample(channel_number, codes, length, encoding, AS_SEND_AUDIO_LOOP, NULL);
+}
+
+/*
+ * Start streaming playback.
+ *
+ * The refill function is called (from dispatch_completions()) when the stream starts, and whenever a chunk
+ * has been played and less than low_water samples are left queued. It should queue more chunks with stream_queue(),
+ * or end the stream with stream_end(). Chunks can also be queued at any other time as data arrives.
+ * If the queue runs dry, silence is played until more arrives.
+ *
+ * The callback function is called after the end of the stream has been played.
+ */
+
+bool Audio::send_stream(uint32_t channel_number, void (*refill)(uint32_t channel_number), void (*callback)(uint32_t channel_number),
+		uint32_t low_water) {
 
 	if (!this->_validate_channel(channel_number)) {
 		return false;
 	}
 
-	if (!samples) {
+	if ((!refill) || (!callback)) {
 		return false;
 	}
 
+	bool res = false;
+	osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
+
+	AudioCommand *cmd = this->_command_slot(channel_number);
+	if(cmd) {
+		cmd->op = AC_START;
+		cmd->callback = callback;
+		cmd->refill = refill;
+		cmd->stream_low_water = low_water;
+		cmd->audio_sample = NULL;
+		cmd->audio_sample_size = 0;
+		cmd->digit_string_length = 0;
+		cmd->state = AS_SEND_STREAM;
+		this->_command_post(channel_number);
+		res = true;
+	}
+
+	osMutexRelease(this->_lock); /* Release the lock */
+	return res;
+}
+
+/*
+ * Queue a chunk of samples for streaming playback. The samples are played in place.
+ *
+ * Returns false if there is no room in the queue
+ */
 
+bool Audio::stream_queue(uint32_t channel_number, const int16_t *samples, uint32_t length) {
+
+	if ((!this->_validate_channel(channel_number)) || (!samples)) {
+		return false;
+	}
+
+	bool res = false;
 	osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
-	ChannelInfo *ch_info = &this->channel_info[channel_number - 1];
 
-	ch_info->audio_sample_size = length;
-	ch_info->audio_sample = samples;
-	ch_info->state = AS_SEND_AUDIO_LOOP;
+	StreamQueue *stream = &this->_streams[channel_number - 1];
+	uint8_t head = __atomic_load_n(&stream->head, __ATOMIC_ACQUIRE);
+	if((uint8_t) (stream->tail - head) < STREAM_QUEUE_DEPTH) {
+		StreamChunk *chunk = &stream->chunks[stream->tail & (STREAM_QUEUE_DEPTH - 1)];
+		chunk->samples = samples;
+		chunk->length = length;
+		__atomic_store_n(&stream->tail, (uint8_t) (stream->tail + 1), __ATOMIC_RELEASE);
+		res = true;
+	}
 
 	osMutexRelease(this->_lock); /* Release the lock */
-	return true;
+	return res;
+}
+
+/*
+ * Mark the end of the stream. The callback is made once everything queued before it has been played.
+ *
+ * Returns false if there is no room in the queue
+ */
+
+bool Audio::stream_end(uint32_t channel_number) {
+
+	if (!this->_validate_channel(channel_number)) {
+		return false;
+	}
+
+	bool res = false;
+	osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
+
+	StreamQueue *stream = &this->_streams[channel_number - 1];
+	uint8_t head = __atomic_load_n(&stream->head, __ATOMIC_ACQUIRE);
+	if((uint8_t) (stream->tail - head) < STREAM_QUEUE_DEPTH) {
+		StreamChunk *chunk = &stream->chunks[stream->tail & (STREAM_QUEUE_DEPTH - 1)];
+		chunk->samples = NULL;
+		chunk->length = 0;
+		__atomic_store_n(&stream->tail, (uint8_t) (stream->tail + 1), __ATOMIC_RELEASE);
+		res = true;
+	}
 
+	osMutexRelease(this->_lock); /* Release the lock */
+	return res;
+}
+
+/*
+ * Return the number of chunks which can be queued. Every slot given back is a chunk which has been played.
+ */
+
+uint8_t Audio::stream_space(uint32_t channel_number) {
+	if (!this->_validate_channel(channel_number)) {
+		return 0;
+	}
+	StreamQueue *stream = &this->_streams[channel_number - 1];
+	uint8_t head = __atomic_load_n(&stream->head, __ATOMIC_ACQUIRE);
+	return STREAM_QUEUE_DEPTH - (uint8_t) (stream->tail - head);
+}
+
+/*
+ * Return the number of blocks which ran out of streaming data since the stream started
+ */
+
+uint32_t Audio::stream_underruns(uint32_t channel_number) {
+	if (!this->_validate_channel(channel_number)) {
+		return 0;
+	}
+	return this->channel_info[channel_number - 1].stream_underruns;
+}
+
+/*
+ * Number of samples left to play in a channel's stream queue. Render task only.
+ */
+
+uint32_t Audio::_stream_queued(uint8_t channel_index) {
+	StreamQueue *stream = &this->_streams[channel_index];
+	uint8_t tail = __atomic_load_n(&stream->tail, __ATOMIC_ACQUIRE);
+	uint32_t queued = 0;
+
+	for(uint8_t index = stream->head; index != tail; index++) {
+		queued += stream->chunks[index & (STREAM_QUEUE_DEPTH - 1)].length;
+	}
+	return queued - this->channel_info[channel_index].audio_sample_index;
+}
+
+/*
+ * Give back the chunks queued on a channel before mark without playing them. Render task only.
+ */
+
+void Audio::_stream_discard(uint8_t channel_index, uint8_t mark) {
+	StreamQueue *stream = &this->_streams[channel_index];
+	if((uint8_t) (mark - stream->head) <= STREAM_QUEUE_DEPTH) { /* Not already played past it */
+		__atomic_store_n(&stream->head, mark, __ATOMIC_RELEASE);
+	}
+	this->channel_info[channel_index].audio_sample_index = 0;
 }
 
 /*
@@ -543,57 +1221,134 @@ bool Audio::stop(uint32_t channel_number) {
 	if(!this->_validate_channel(channel_number)) {
 		return false;
 	}
-	osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
+	return this->_post_simple_command(channel_number, AC_STOP);
 
-	ChannelInfo *ch_info = &this->channel_info[channel_number - 1];
-	ch_info->state = AS_IDLE;
+}
 
-	osMutexRelease(this->_lock); /* Release the lock */
-	return true;
+/*
+ * Render a run of tone samples into a contiguous block.
+ *
+ * Same arithmetic as _next_tone_value(), with the generator state held in locals
+ * for the whole run.
+ */
+
+void Audio::_render_tone(ChannelInfo *ch_info, int16_t *out, uint16_t count) {
+
+	if(ch_info->wavetable) {
+		/* Precomputed period, copy it out wrapping around at the end */
+		while(count) {
+			uint16_t run = ch_info->wavetable_length - ch_info->wavetable_index;
+			if(run > count) {
+				run = count;
+			}
+			memcpy(out, ch_info->wavetable + ch_info->wavetable_index, run * sizeof(int16_t));
+			out += run;
+			count -= run;
+			ch_info->wavetable_index += run;
+			if(ch_info->wavetable_index >= ch_info->wavetable_length) {
+				ch_info->wavetable_index = 0;
+			}
+		}
+		return;
+	}
+
+	uint32_t phase_accum_f1 = ch_info->phase_accum[0];
+	uint32_t phase_accum_f2 = ch_info->phase_accum[1];
+	const uint32_t tuning_word_f1 = ch_info->tuning_word[0];
+	const uint32_t tuning_word_f2 = ch_info->tuning_word[1];
+	const int32_t level_f1 = ch_info->level_q15[0];
+	const int32_t level_f2 = ch_info->level_q15[1];
+
+	for(uint16_t i = 0; i < count; i++) {
+		int32_t acc = ((int32_t) (int16_t) lut[phase_accum_f1 >> PHASE_ACCUMULATOR_TRUNCATION] * level_f1) +
+				((int32_t) (int16_t) lut[phase_accum_f2 >> PHASE_ACCUMULATOR_TRUNCATION] * level_f2);
+		out[i] = (int16_t) (acc >> Q15_SHIFT);
+		phase_accum_f1 = (phase_accum_f1 + tuning_word_f1) & (PHASE_ACCUMULATOR_MASK);
+		phase_accum_f2 = (phase_accum_f2 + tuning_word_f2) & (PHASE_ACCUMULATOR_MASK);
+	}
 
+	ch_info->phase_accum[0] = phase_accum_f1;
+	ch_info->phase_accum[1] = phase_accum_f2;
 }
 
 /*
- * This is called by the DMA half full and full interrupts to
- * request a new combined left and right audio block be created
- * at the requested buffer number (0 or 1). 0 indicates the lower
- * half of the buffer needs to be filled, and 1 indicates the upper
- * half of the buffer needs to be filled.
+ * Render tone samples until the cadence timer expires, then keep going
+ * until the tone is close to a zero crossing to reduce audio clicking.
  *
+ * Returns the number of samples rendered. *ended is set true if the
+ * last sample rendered ended the tone.
  */
 
-void Audio::request_block(uint8_t buffer_number) {
+uint16_t Audio::_render_tone_cadence(ChannelInfo *ch_info, int16_t *out, uint16_t count, bool *ended) {
+	uint16_t run = (ch_info->cadence_timer < count) ? ch_info->cadence_timer : count;
 
-	HAL_GPIO_WritePin(LEDN_GPIO_Port, LEDN_Pin, GPIO_PIN_RESET);
+	*ended = false;
 
-	/* Calculate the buffer base address into the circular buffer */
-	int16_t *buffer = (buffer_number) ? this->lr_audio_output_buffer + LR_AUDIO_BUFFER_SIZE : lr_audio_output_buffer;
+	/* Fast path, one sample per cadence timer tick */
+	this->_render_tone(ch_info, out, run);
+	ch_info->cadence_timer -= run;
 
-	/*
-	 * Left and right channels are interleaved.
-	 * Left channel (0) is at even buffer addresses
-	 * Right channel (1) is at odd buffer addresses
-	 *
-	 * We iterate through all buffer addresses here
-	 * If there's active audio for a channel, it
-	 * will be filled byte by byte here If nothing
-	 * is active, a zero will be placed into the buffer.
-	 */
+	/* Timer expired, look for the shut off point a sample at a time. Changes the tone timing ever so slightly */
+	while(run < count) {
+		int16_t val = this->_next_tone_value(ch_info);
+		out[run++] = val;
+		if((val > -TONE_SHUTOFF_THRESHOLD) && (val < TONE_SHUTOFF_THRESHOLD)) {
+			*ended = true;
+			break;
+		}
+	}
+	return run;
+}
 
-	osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
+/*
+ * Render silence until the cadence timer expires.
+ *
+ * Returns the number of samples rendered. *ended is set true if the
+ * last sample rendered ended the silence.
+ */
+
+uint16_t Audio::_render_silence_cadence(ChannelInfo *ch_info, int16_t *out, uint16_t count, bool *ended) {
+	uint16_t run = (ch_info->cadence_timer < count) ? ch_info->cadence_timer : count;
 
-	for (int i = 0; i < LR_AUDIO_BUFFER_SIZE; i++) {
-		buffer[i] = 0;
-		ChannelInfo *ch_info = &this->channel_info[(i & 1)];
+	memset(out, 0, run * sizeof(int16_t));
+	ch_info->cadence_timer -= run;
+
+	/* The sample on which the timer is found expired is silent too */
+	*ended = (run < count);
+	if(*ended) {
+		out[run++] = 0;
+	}
+	return run;
+}
+
+/*
+ * Render a block of samples for one channel.
+ *
+ * Samples are produced in runs up to the next cadence, digit or sample
+ * boundary. The state machine is only entered at those boundaries.
+ */
+
+void Audio::_render_channel(uint8_t channel_index, int16_t *out, uint16_t count) {
+	ChannelInfo *ch_info = &this->channel_info[channel_index];
+	uint16_t n = 0;
+	bool ended;
+
+	while(n < count) {
+		int16_t *run_out = out + n;
+		uint16_t remaining = count - n;
 
 		/*
 		 * State machine
+		 *
+		 * States which set up a new operation take one sample period and output silence.
 		 */
 
-
 		switch(ch_info->state) {
 
 		case AS_IDLE:
+			/* Commands are only picked up at block boundaries, so an idle channel stays idle for the rest of the block */
+			memset(run_out, 0, remaining * sizeof(int16_t));
+			n = count;
 			break;
 
 		case AS_GEN_DIAL_TONE:
@@ -604,11 +1359,16 @@ void Audio::request_block(uint8_t buffer_number) {
 				INDICATIONS.dial_tone.level_pair[0],/* L1 */
 				INDICATIONS.dial_tone.level_pair[1] /* L2 */
 			);
+			this->_use_cpt_wavetable(ch_info, CPT_DIAL_TONE);
 			ch_info->state = AS_GEN_DIAL_TONE_WAIT;
+			*run_out = 0;
+			n++;
 			break;
 
 		case AS_GEN_DIAL_TONE_WAIT:
-			buffer[i] = this->_next_tone_value(ch_info);
+			/* Continuous until stopped */
+			this->_render_tone(ch_info, run_out, remaining);
+			n = count;
 			break;
 
 
@@ -629,32 +1389,26 @@ void Audio::request_block(uint8_t buffer_number) {
 				INDICATIONS.busy.level_pair[0],/* L1 */
 				INDICATIONS.busy.level_pair[1] /* L2 */
 			);
+			this->_use_cpt_wavetable(ch_info, CPT_BUSY);
 			ch_info->state = AS_BUSY_WAIT_TONE_END;
+			*run_out = 0;
+			n++;
 			break;
 
 		case AS_BUSY_WAIT_TONE_END:
-			buffer[i] = this->_next_tone_value(ch_info);
-			if(ch_info->cadence_timer == 0){
-				if((buffer[i] > -TONE_SHUTOFF_THRESHOLD) && (buffer[i] < TONE_SHUTOFF_THRESHOLD)) { /* Shut off close to zero to reduce audio clicking. Changes the tone timing ever so slightly */
-					ch_info->cadence_timer = ch_info->cadence_timing;
-					ch_info->state = AS_BUSY_WAIT_SILENCE_END;
-				}
-			}
-			else {
-				ch_info->cadence_timer--;
+			n += this->_render_tone_cadence(ch_info, run_out, remaining, &ended);
+			if(ended) {
+				ch_info->cadence_timer = ch_info->cadence_timing;
+				ch_info->state = AS_BUSY_WAIT_SILENCE_END;
 			}
-
 			break;
 
 		case AS_BUSY_WAIT_SILENCE_END:
-			if(ch_info->cadence_timer == 0){
+			n += this->_render_silence_cadence(ch_info, run_out, remaining, &ended);
+			if(ended) {
 				ch_info->cadence_timer = ch_info->cadence_timing;
 				ch_info->state = AS_BUSY_WAIT_TONE_END;
 			}
-			else {
-				ch_info->cadence_timer--;
-			}
-
 			break;
 
 
@@ -668,33 +1422,26 @@ void Audio::request_block(uint8_t buffer_number) {
 				INDICATIONS.ringing.level_pair[0],/* L1 */
 				INDICATIONS.ringing.level_pair[1] /* L2 */
 			);
+			this->_use_cpt_wavetable(ch_info, CPT_RINGING);
 			ch_info->state = AS_RINGING_WAIT_TONE_END;
+			*run_out = 0;
+			n++;
 			break;
 
 		case AS_RINGING_WAIT_TONE_END:
-			buffer[i] = this->_next_tone_value(ch_info);
-			if(ch_info->cadence_timer == 0){
-				if((buffer[i] > -TONE_SHUTOFF_THRESHOLD) && (buffer[i] < TONE_SHUTOFF_THRESHOLD)) { /* Shut off close to zero to reduce audio clicking. Changes the tone timing ever so slightly */
-					ch_info->cadence_timer = _convert_ms(INDICATIONS.ringing.ring_off_cadence_ms);
-					ch_info->state = AS_RINGING_WAIT_SILENCE_END;
-				}
+			n += this->_render_tone_cadence(ch_info, run_out, remaining, &ended);
+			if(ended) {
+				ch_info->cadence_timer = _convert_ms(INDICATIONS.ringing.ring_off_cadence_ms);
+				ch_info->state = AS_RINGING_WAIT_SILENCE_END;
 			}
-			else {
-				ch_info->cadence_timer--;
-			}
-
-			break;	ch_info->state = AS_IDLE;
-			ch_info->state = AS_IDLE;
+			break;
 
 		case AS_RINGING_WAIT_SILENCE_END:
-			if(ch_info->cadence_timer == 0){
+			n += this->_render_silence_cadence(ch_info, run_out, remaining, &ended);
+			if(ended) {
 				ch_info->cadence_timer = _convert_ms(INDICATIONS.ringing.ring_on_cadence_ms);
 				ch_info->state = AS_RINGING_WAIT_TONE_END;
 			}
-			else {
-				ch_info->cadence_timer--;
-			}
-
 			break;
 
 
@@ -716,31 +1463,29 @@ void Audio::request_block(uint8_t buffer_number) {
 				ch_info->digit_string_index++;
 				ch_info->state = AS_SEND_MF_WAIT_TONE_END;
 			}
+			*run_out = 0;
+			n++;
 			break;
 
 		case AS_SEND_MF_WAIT_TONE_END:
-			buffer[i] = this->_next_tone_value(ch_info);
-			if (ch_info->cadence_timer == 0){
-				if ((buffer[i] > -TONE_SHUTOFF_THRESHOLD) && (buffer[i] < TONE_SHUTOFF_THRESHOLD)) { /* Shut off close to zero to reduce audio clicking. Changes the tone timing ever so slightly */
-					/* Test for end of tone sequence */
-					if (ch_info->digit_string_index >= ch_info->digit_string_length) {
-						/* Call the callback */
-						ch_info->callback((i & 1) + 1);
-						ch_info->state = AS_IDLE;
-					}
-					else {
-						ch_info->cadence_timer = _convert_ms(MF.inactive_time_ms);
-						ch_info->state = AS_SEND_MF_WAIT_SILENCE_END;
-					}
+			n += this->_render_tone_cadence(ch_info, run_out, remaining, &ended);
+			if(ended) {
+				/* Test for end of tone sequence */
+				if (ch_info->digit_string_index >= ch_info->digit_string_length) {
+					/* Queue the callback */
+					this->_post_completion(channel_index, n);
+					ch_info->state = AS_IDLE;
+				}
+				else {
+					ch_info->cadence_timer = _convert_ms(MF.inactive_time_ms);
+					ch_info->state = AS_SEND_MF_WAIT_SILENCE_END;
 				}
-			}
-			else {
-				ch_info->cadence_timer--;
 			}
 			break;
 
 		case AS_SEND_MF_WAIT_SILENCE_END:
-			if (ch_info->cadence_timer == 0){
+			n += this->_render_silence_cadence(ch_info, run_out, remaining, &ended);
+			if(ended) {
 				/* Next tone pair */
 				ch_info->cadence_timer = this->_get_mf_tone_duration(ch_info->digit_string[ch_info->digit_string_index]);
 				this->_generate_dual_tone(ch_info,
@@ -752,11 +1497,7 @@ void Audio::request_block(uint8_t buffer_number) {
 				ch_info->digit_string_index++;
 				ch_info->state = AS_SEND_MF_WAIT_TONE_END;
 			}
-			else {
-				ch_info->cadence_timer--;
-			}
-
-		break;
+			break;
 
 		case AS_SEND_DTMF:
 			ch_info->is_stoppable = false;
@@ -776,31 +1517,29 @@ void Audio::request_block(uint8_t buffer_number) {
 				ch_info->digit_string_index++;
 				ch_info->state = AS_SEND_DTMF_WAIT_TONE_END;
 			}
+			*run_out = 0;
+			n++;
 			break;
 
 		case AS_SEND_DTMF_WAIT_TONE_END:
-			buffer[i] = this->_next_tone_value(ch_info);
-			if (ch_info->cadence_timer == 0){
-				if ((buffer[i] > -TONE_SHUTOFF_THRESHOLD) && (buffer[i] < TONE_SHUTOFF_THRESHOLD)) { /* Shut off close to zero to reduce audio clicking. Changes the tone timing ever so slightly */
-					/* Test for end of tone sequence */
-					if (ch_info->digit_string_index >= ch_info->digit_string_length) {
-						/* Call the callback */
-						ch_info->callback((i & 1) + 1);
-						ch_info->state = AS_IDLE;
-					}
-					else {
-						ch_info->cadence_timer = this->_convert_ms(DTMF.inactive_time_ms);
-						ch_info->state = AS_SEND_DTMF_WAIT_SILENCE_END;
-					}
+			n += this->_render_tone_cadence(ch_info, run_out, remaining, &ended);
+			if(ended) {
+				/* Test for end of tone sequence */
+				if (ch_info->digit_string_index >= ch_info->digit_string_length) {
+					/* Queue the callback */
+					this->_post_completion(channel_index, n);
+					ch_info->state = AS_IDLE;
+				}
+				else {
+					ch_info->cadence_timer = this->_convert_ms(DTMF.inactive_time_ms);
+					ch_info->state = AS_SEND_DTMF_WAIT_SILENCE_END;
 				}
-			}
-			else {
-				ch_info->cadence_timer--;
 			}
 			break;
 
 		case AS_SEND_DTMF_WAIT_SILENCE_END:
-			if (ch_info->cadence_timer == 0){
+			n += this->_render_silence_cadence(ch_info, run_out, remaining, &ended);
+			if(ended) {
 				/* Next tone pair */
 				ch_info->cadence_timer = this->_convert_ms(DTMF.active_time_ms);
 				this->_generate_dual_tone(ch_info,
@@ -812,56 +1551,254 @@ void Audio::request_block(uint8_t buffer_number) {
 				ch_info->digit_string_index++;
 				ch_info->state = AS_SEND_DTMF_WAIT_TONE_END;
 			}
-			else {
-				ch_info->cadence_timer--;
-			}
 			break;
 
 		case AS_SEND_AUDIO_LOOP:
 			ch_info->is_stoppable = true;
 			ch_info->audio_sample_index = 0l;
 			ch_info->state = AS_SEND_AUDIO_LOOP_WAIT;
+			*run_out = 0;
+			n++;
 			break;
 
 
-		case AS_SEND_AUDIO_LOOP_WAIT:
-			buffer[i] = ch_info->audio_sample[ch_info->audio_sample_index++];
-			/* Keep sending the loop until we are stopped */
+		case AS_SEND_AUDIO_LOOP_WAIT: {
+			/* Copy up to the end of the sample, then wrap around. Keep sending the loop until we are stopped */
+			uint32_t run = (ch_info->audio_sample_index < ch_info->audio_sample_size) ? ch_info->audio_sample_size - ch_info->audio_sample_index : 1;
+			if(run > remaining) {
+				run = remaining;
+			}
+			this->_copy_sample_run(ch_info, run_out, run);
+			ch_info->audio_sample_index += run;
+			n += run;
 			if(ch_info->audio_sample_index >= ch_info->audio_sample_size) {
 				ch_info->audio_sample_index = 0l;
 			}
 			break;
+		}
 
 		case AS_SEND_AUDIO:
 			ch_info->is_stoppable = false;
 			ch_info->audio_sample_index = 0l;
 			ch_info->state = AS_SEND_AUDIO_WAIT;
+			*run_out = 0;
+			n++;
 			break;
 
 
-		case AS_SEND_AUDIO_WAIT:
-			buffer[i] = ch_info->audio_sample[ch_info->audio_sample_index++];
+		case AS_SEND_AUDIO_WAIT: {
+			/* Copy up to the end of the sample */
+			uint32_t run = (ch_info->audio_sample_index < ch_info->audio_sample_size) ? ch_info->audio_sample_size - ch_info->audio_sample_index : 1;
+			if(run > remaining) {
+				run = remaining;
+			}
+			this->_copy_sample_run(ch_info, run_out, run);
+			ch_info->audio_sample_index += run;
+			n += run;
 			if(ch_info->audio_sample_index >= ch_info->audio_sample_size) {
-				/* Call the callback */
-				ch_info->callback((i & 1) + 1);
+				/* Queue the callback */
+				this->_post_completion(channel_index, n);
 				ch_info->state = AS_IDLE;
 			}
 			break;
+		}
+
+
+		case AS_SEND_STREAM:
+			ch_info->is_stoppable = true;
+			ch_info->stream_underruns = 0;
+			ch_info->state = AS_SEND_STREAM_PRIME;
+			this->_post_completion(channel_index, n, true); /* Ask for the first chunks */
+			*run_out = 0;
+			n++;
+			break;
+
+
+		case AS_SEND_STREAM_PRIME:
+			/* Silence until the first chunk arrives, this isn't an underrun */
+			if(this->_streams[channel_index].head == __atomic_load_n(&this->_streams[channel_index].tail, __ATOMIC_ACQUIRE)) {
+				memset(run_out, 0, remaining * sizeof(int16_t));
+				n = count;
+			}
+			else {
+				ch_info->state = AS_SEND_STREAM_WAIT;
+			}
+			break;
 
 
+		case AS_SEND_STREAM_WAIT: {
+			StreamQueue *stream = &this->_streams[channel_index];
+			uint8_t head = stream->head;
+
+			if(head == __atomic_load_n(&stream->tail, __ATOMIC_ACQUIRE)) {
+				/* Ran dry, play silence for the rest of the block */
+				memset(run_out, 0, remaining * sizeof(int16_t));
+				ch_info->stream_underruns++;
+				n = count;
+				break;
+			}
+
+			StreamChunk *chunk = &stream->chunks[head & (STREAM_QUEUE_DEPTH - 1)];
+			if(!chunk->samples) {
+				/* End of the stream. Anything queued after the end is left for the next command to sort out */
+				ch_info->audio_sample_index = 0l;
+				__atomic_store_n(&stream->head, (uint8_t) (head + 1), __ATOMIC_RELEASE);
+				this->_post_completion(channel_index, n);
+				ch_info->state = AS_IDLE;
+				break;
+			}
 
+			/* Copy straight out of the caller's chunk, up to the end of the chunk */
+			uint32_t run = chunk->length - ch_info->audio_sample_index;
+			if(run > remaining) {
+				run = remaining;
+			}
+			memcpy(run_out, chunk->samples + ch_info->audio_sample_index, run * sizeof(int16_t));
+			ch_info->audio_sample_index += run;
+			n += run;
+			if(ch_info->audio_sample_index >= chunk->length) {
+				/* Give the slot back and ask for more if running low */
+				ch_info->audio_sample_index = 0l;
+				__atomic_store_n(&stream->head, (uint8_t) (head + 1), __ATOMIC_RELEASE);
+				if(this->_stream_queued(channel_index) < ch_info->stream_low_water) {
+					this->_post_completion(channel_index, n, true);
+				}
+			}
+			break;
+		}
 
 
 		default:
-			channel_info->state = AS_IDLE;
+			ch_info->state = AS_IDLE;
+			*run_out = 0;
+			n++;
 			break;
 
 		}
+	}
+}
 
+/*
+ * Saturating add of a channel block into an output slot block.
+ *
+ * On the M4, two samples are added at a time with QADD16.
+ * Elsewhere the plain C version is left for the compiler to vectorize.
+ */
+
+void Audio::_mix_block(int16_t *dest, const int16_t *source, uint16_t count) {
+#if defined(__ARM_FEATURE_DSP)
+	for(uint16_t i = 0; i < count; i += 2) {
+		uint32_t d, s;
+		memcpy(&d, dest + i, sizeof(d));
+		memcpy(&s, source + i, sizeof(s));
+		d = __QADD16(d, s);
+		memcpy(dest + i, &d, sizeof(d));
 	}
-	osMutexRelease(this->_lock); /* Release the lock */
+#else
+	for(uint16_t i = 0; i < count; i++) {
+		int32_t sum = (int32_t) dest[i] + source[i];
+		if(sum > INT16_MAX) {
+			sum = INT16_MAX;
+		}
+		if(sum < INT16_MIN) {
+			sum = INT16_MIN;
+		}
+		dest[i] = (int16_t) sum;
+	}
+#endif
+}
+
+/*
+ * Called by the audio task when woken by the I2S DMA. The sequence number is the count of DMA events,
+ * each of which freed the segment after the last one. Renders every freed segment the DMA has not
+ * come round to again, oldest first. The ones it has are counted as skipped rather than rendered late.
+ */
+
+void Audio::render_segments(uint32_t sequence) {
+	uint32_t pending = sequence - this->_segment_sequence;
+
+	if(!pending) {
+		return; /* Already rendered on an earlier wakeup */
+	}
+	this->_segment_sequence = sequence;
+
+	/* The DMA is playing the segment after the last one freed, the ones behind that are free to render */
+	if(pending > (RING_SEGMENTS - 1)) {
+		uint32_t skipped = pending - (RING_SEGMENTS - 1);
+		this->_segments_skipped += skipped;
+		this->_next_segment = (this->_next_segment + skipped) % RING_SEGMENTS;
+		pending = RING_SEGMENTS - 1;
+	}
+	while(pending--) {
+		this->request_block(this->_next_segment);
+		this->_next_segment = (this->_next_segment + 1) % RING_SEGMENTS;
+	}
+}
+
+/*
+ * This is called by render_segments() when the DMA has finished playing
+ * a segment of the ring, to request a new combined left and right
+ * audio block be created in that segment (0 to RING_SEGMENTS - 1).
+ * It will be played after the other segments in the ring.
+ *
+ */
+
+void Audio::request_block(uint8_t buffer_number) {
+
+	PROFILE_START(profile_start);
+	HAL_GPIO_WritePin(LEDN_GPIO_Port, LEDN_Pin, GPIO_PIN_RESET);
+
+	/* Calculate the buffer base address into the ring */
+	uint8_t segment = buffer_number % RING_SEGMENTS;
+	int16_t *buffer = this->lr_audio_output_buffer + (segment * LR_AUDIO_BUFFER_SIZE);
+	bool late = (this->_segment_slack(segment) <= 0);
+
+	/*
+	 * Left and right output slots are interleaved.
+	 * Left slot (0) is at even buffer addresses
+	 * Right slot (1) is at odd buffer addresses
+	 *
+	 * Each active channel is rendered as a contiguous block,
+	 * then mixed with saturation onto the block for its output slot.
+	 * The slot blocks are then interleaved into the output buffer.
+	 */
+
+	memset(this->_slot_block, 0, sizeof(this->_slot_block));
+
+	/*
+	 * No lock is taken here. Commands from the control tasks are picked up from
+	 * each channel's command queue at the start of the block.
+	 */
+
+	for (uint8_t channel_index = 0; channel_index < NUM_AUDIO_CHANNELS; channel_index++) {
+		ChannelInfo *ch_info = &this->channel_info[channel_index];
+		this->_apply_commands(channel_index);
+		if (ch_info->state == AS_IDLE) {
+			continue; /* Idle channels contribute nothing to the mix */
+		}
+		this->_render_channel(channel_index, this->_channel_block, AUDIO_BUFFER_SIZE);
+		this->_mix_block(this->_slot_block[ch_info->output_slot], this->_channel_block, AUDIO_BUFFER_SIZE);
+	}
+
+	for (int i = 0; i < AUDIO_BUFFER_SIZE; i++) {
+		for (uint8_t slot = 0; slot < NUM_OUTPUT_SLOTS; slot++) {
+			buffer[(i * NUM_OUTPUT_SLOTS) + slot] = this->_slot_block[slot][i];
+		}
+	}
+	this->_sample_time += AUDIO_BUFFER_SIZE;
+
+	/* Deadline monitor: the segment must be finished before the DMA gets to it */
+	int32_t slack = this->_segment_slack(segment);
+	if(late || (slack <= 0)) {
+		this->_late_renders++;
+	}
+	if(slack < this->_min_slack) {
+		this->_min_slack = slack;
+	}
+	this->_renders++;
 
 	HAL_GPIO_WritePin(LEDN_GPIO_Port, LEDN_Pin, GPIO_PIN_SET);
+	PROFILE_STOP(Profiler::PS_AUDIO_REQUEST_BLOCK, profile_start);
 
 }
 
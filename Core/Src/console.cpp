@@ -8,6 +8,7 @@
 
 #include "console.h"
 #include "logging.h"
+#include "profiler.h"
 #include "uart.h"
 
 
@@ -42,7 +43,15 @@ void Console::setup(void) {
  */
 
 void Console::loop(void) {
+	/* Single key commands: p dumps the profiler, P dumps it and then resets it */
+	while(Uart.available()) {
+		char c = Uart.getc();
+		if((c == 'p') || (c == 'P')) {
+			Prof.request_dump(c == 'P');
+		}
+	}
 	Logger.loop();
+	Prof.loop(); /* Profiler dumps are written through the logger one line at a time */
 }
 
 
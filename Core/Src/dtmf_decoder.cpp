@@ -0,0 +1,302 @@
+
+#include <math.h>
+#include "logging.h"
+#include "dtmf_decoder.h"
+#include "profiler.h"
+
+
+/*
+* Software DTMF receiver
+*
+* Runs on the same ADC frames as the MF receivers, one receiver per ADC input.
+* A digit is accepted when one row and one column tone are both above the signal threshold,
+* each stands clear of the other tones in its group, the twist between them is within limits,
+* and together they hold most of the energy in the frame. It must be present for
+* DTMF_MIN_DIGIT_BLOCK_COUNT frames, and is recorded when it goes away.
+*
+* The digit string ends on '#', when it is full, or after the interdigit timeout.
+*/
+
+namespace Dtmfd {
+
+static const char *TAG = "dtmf_receiver";
+
+/* Rows first, then columns */
+static const float frequencies[NUM_DTMF_FREQUENCIES] = {697.0, 770.0, 852.0, 941.0, 1209.0, 1336.0, 1477.0, 1633.0};
+
+static const char digit_map[NUM_DTMF_ROWS][NUM_DTMF_COLUMNS] = {
+	{'1', '2', '3', 'A'},
+	{'4', '5', '6', 'B'},
+	{'7', '8', '9', 'C'},
+	{'*', '0', '#', 'D'}
+};
+
+
+
+void DTMF_decoder::setup(Mfd::MF_decoder *sampler) {
+
+	/* Create mutex to protect dtmf receiver data between tasks */
+	static const osMutexAttr_t dtmfd_mutex_attr = {
+		"DTMFDecoderMutex",
+		osMutexRecursive | osMutexPrioInherit,
+		NULL,
+		0U
+	};
+
+	this->_lock = osMutexNew(&dtmfd_mutex_attr);
+	this->_sampler = sampler;
+
+	/* Initialize the goertzel filter data */
+	for (int receiver = 0; receiver < DTMF_NUM_RECEIVERS; receiver++) {
+		this->_goertzel[receiver].setup(frequencies, Mfd::MF_SAMPLE_RATE);
+		this->_dtmf_data[receiver].state = DTR_IDLE;
+		this->_dtmf_data[receiver].descriptor = receiver + 1;
+	}
+}
+
+/*
+* Attempt to seize a DTMF receiver.
+* Will return a non zero positive number as a descriptor if successful.
+* Will return 0 on an error or if all the DTMF receivers are in use.
+*/
+
+uint32_t DTMF_decoder::seize(dtmfCallback callback) {
+
+	uint32_t descriptor = 0;
+
+	if(!callback) {
+		LOG_DEBUG(TAG, "Null pointer passed in for callback function");
+		return 0;
+	}
+
+	osMutexAcquire(this->_lock, osWaitForever);
+	for (uint8_t receiver = 0; receiver < DTMF_NUM_RECEIVERS; receiver++) {
+		if (this->_dtmf_data[receiver].state == DTR_IDLE) {
+			descriptor = receiver + 1;
+			break;
+		}
+	}
+
+	/* The ADC sample clock has to be running */
+	if (descriptor && !this->_sampler->start_sampling()) {
+		descriptor = 0;
+	}
+
+	if(descriptor) {
+		dtmfData *dtmf_data = &this->_dtmf_data[descriptor - 1];
+		dtmf_data->callback = callback;
+		dtmf_data->error_code = 0;
+		dtmf_data->tone_digit = 0;
+		dtmf_data->digit_count = 0;
+		dtmf_data->digits[0] = 0;
+		dtmf_data->tone_block_count = 0;
+		dtmf_data->timer = 0;
+		dtmf_data->dc_level = 0.0;
+		dtmf_data->state = DTR_WAIT_DIGIT;
+	}
+
+	osMutexRelease(this->_lock);
+	return descriptor;
+}
+
+
+/*
+* Release a DTMF receiver. Must be called outside of the callback or a deadlock will result.
+*
+* Returns true if successful
+*/
+
+bool DTMF_decoder::release(uint32_t descriptor) {
+	bool res = true;
+	osMutexAcquire(this->_lock, osWaitForever);
+	if((descriptor == 0) || (descriptor > DTMF_NUM_RECEIVERS) || (this->_dtmf_data[descriptor - 1].state == DTR_IDLE)) {
+		res = false;
+	}
+	else {
+		this->_dtmf_data[descriptor - 1].state = DTR_IDLE;
+		res = this->_sampler->stop_sampling();
+	}
+
+	osMutexRelease(this->_lock);
+	return res;
+}
+
+/*
+* Run one receiver's samples from an interleaved frame through its goertzel tone decoders.
+*
+* Returns the DTMF digit present in the frame, or 0 if there isn't a valid one
+*/
+
+char DTMF_decoder::_detect_digit(uint8_t receiver, const uint16_t *frame) {
+	Goertzel::Bank<NUM_DTMF_FREQUENCIES> *goertzel = &this->_goertzel[receiver];
+	const uint16_t *buffer = frame + receiver;
+	float dc_level = this->_dtmf_data[receiver].dc_level;
+	float energy = 0.0;
+
+	/* Same single pass front end as the MF receivers, also totalling up the frame energy */
+	goertzel->clear();
+	goertzel->run_source([buffer, &dc_level, &energy](uint16_t sample_index) {
+		/* Center around 0 and scale to range -1 to 1 */
+		float val = (((float) buffer[sample_index * Mfd::MF_NUM_RECEIVERS]) + Mfd::MIN_ADC) * (1.0f / -Mfd::MIN_ADC);
+
+		/* First order DC tracking filter, carried over from frame to frame */
+		dc_level += (val - dc_level) * Mfd::DC_TRACKING_RATE;
+		val -= dc_level;
+		energy += val * val;
+		return val;
+	}, Mfd::MF_FRAME_SIZE);
+	this->_dtmf_data[receiver].dc_level = dc_level;
+
+	/* Find the strongest tone in each group, and the runner up */
+	float magnitudes[NUM_DTMF_FREQUENCIES];
+	uint8_t peak[2] = {0, NUM_DTMF_ROWS};
+	float second[2] = {0.0, 0.0};
+
+	for (uint8_t tone_index = 0; tone_index < NUM_DTMF_FREQUENCIES; tone_index++) {
+		uint8_t group = (tone_index >= NUM_DTMF_ROWS) ? 1 : 0;
+		magnitudes[tone_index] = goertzel->magnitude(tone_index);
+		if (tone_index == peak[group]) {
+			continue;
+		}
+		if (magnitudes[tone_index] > magnitudes[peak[group]]) {
+			second[group] = magnitudes[peak[group]];
+			peak[group] = tone_index;
+		}
+		else if (magnitudes[tone_index] > second[group]) {
+			second[group] = magnitudes[tone_index];
+		}
+	}
+
+	float row = magnitudes[peak[0]];
+	float column = magnitudes[peak[1]];
+
+	/* Energy check: both tones present */
+	if ((row < DTMF_SIGNAL_THRESHOLD) || (column < DTMF_SIGNAL_THRESHOLD)) {
+		return 0;
+	}
+
+	/* Twist check */
+	if ((row > column * DTMF_MAX_NORMAL_TWIST) || (column > row * DTMF_MAX_REVERSE_TWIST)) {
+		return 0;
+	}
+
+	/* Each tone must stand clear of the others in its group */
+	if ((row < second[0] * DTMF_MIN_PEAK_RATIO) || (column < second[1] * DTMF_MIN_PEAK_RATIO)) {
+		return 0;
+	}
+
+	/*
+	 * The tones must account for most of the frame energy, which rejects speech and noise.
+	 * A pure tone of amplitude A gives a magnitude of A*N/2 and an energy of N*A*A/2.
+	 */
+	if (((row * row) + (column * column)) < (DTMF_MIN_ENERGY_RATIO * energy * (Mfd::MF_FRAME_SIZE / 2))) {
+		return 0;
+	}
+
+	return digit_map[peak[0]][peak[1] - NUM_DTMF_ROWS];
+}
+
+
+void DTMF_decoder::handle_buffer(uint8_t buffer_no) {
+	PROFILE_START(profile_start);
+	const uint16_t *frame = this->_sampler->frame(buffer_no);
+
+	for (uint8_t receiver = 0; receiver < DTMF_NUM_RECEIVERS; receiver++) {
+		/* Don't spend any time on idle receivers. A seizure racing with this check just starts a frame later. */
+		if (this->_dtmf_data[receiver].state == DTR_IDLE) {
+			continue;
+		}
+
+		char digit = this->_detect_digit(receiver, frame);
+
+		osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
+		this->_update_state(&this->_dtmf_data[receiver], digit);
+		osMutexRelease(this->_lock); /* Release the lock */
+	}
+
+	PROFILE_STOP(Profiler::PS_DTMF_HANDLE_BUFFER, profile_start);
+}
+
+/*
+* Advance a receiver's decoder state machine with the digit from one frame.
+* Must be called with the lock held.
+*/
+
+void DTMF_decoder::_update_state(dtmfData *dtmf_data, char digit) {
+
+	switch(dtmf_data->state) {
+		case DTR_IDLE:
+			break;
+
+		case DTR_WAIT_DIGIT:
+			if (digit) {
+				if (digit != dtmf_data->tone_digit) {
+					/* New or changed digit, start counting again */
+					dtmf_data->tone_digit = digit;
+					dtmf_data->tone_block_count = 0;
+				}
+				if (dtmf_data->tone_block_count >= DTMF_MIN_DIGIT_BLOCK_COUNT - 1) {
+					dtmf_data->state = DTR_WAIT_DIGIT_SILENCE;
+					dtmf_data->timer = 0;
+				}
+				else {
+					dtmf_data->tone_block_count++;
+				}
+			}
+			else {
+				dtmf_data->tone_digit = 0;
+				dtmf_data->tone_block_count = 0;
+				dtmf_data->timer++;
+				if (dtmf_data->timer >= DTMF_INTERDIGIT_TIMEOUT) {
+					dtmf_data->state = DTR_TIMEOUT;
+				}
+			}
+			break;
+
+		case DTR_WAIT_DIGIT_SILENCE:
+			if (digit != dtmf_data->tone_digit) {
+				/* Digit has gone away, record it */
+				dtmf_data->digits[dtmf_data->digit_count++] = dtmf_data->tone_digit;
+				dtmf_data->digits[dtmf_data->digit_count] = 0;
+				if ((dtmf_data->tone_digit == '#') || (dtmf_data->digit_count >= DTMF_MAX_DIGITS - 1)) {
+					dtmf_data->state = DTR_DONE;
+				}
+				else {
+					/* Wait for next digit */
+					dtmf_data->tone_digit = 0;
+					dtmf_data->tone_block_count = 0;
+					dtmf_data->timer = 0;
+					dtmf_data->state = DTR_WAIT_DIGIT;
+				}
+			}
+			else {
+				dtmf_data->timer++;
+				if (dtmf_data->timer >= DTMF_INTERDIGIT_TIMEOUT) {
+					dtmf_data->state = DTR_TIMEOUT;
+				}
+			}
+			break;
+
+		case DTR_TIMEOUT:
+			/* A timeout after some digits just ends the string */
+			dtmf_data->error_code = (dtmf_data->digit_count) ? DTE_OK : DTE_TIMEOUT;
+			dtmf_data->state = DTR_DONE;
+			break;
+
+		case DTR_DONE:
+			/* Call the user's callback function */
+			(*dtmf_data->callback)(dtmf_data->descriptor, dtmf_data->error_code, dtmf_data->digit_count, dtmf_data->digits);
+			dtmf_data->state = DTR_WAIT_RELEASE;
+			break;
+
+		case DTR_WAIT_RELEASE:
+			break;
+
+		default:
+			dtmf_data->state = DTR_DONE;
+			break;
+	}
+}
+
+} // End Namespace Dtmfd
+
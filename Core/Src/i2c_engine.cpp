@@ -1,12 +1,17 @@
 #include "i2c_engine.h"
 #include "logging.h"
+#include "profiler.h"
 
 namespace I2C_Engine {
 
 const char *TAG = "i2c_engine";
 
-const osMessageQueueAttr_t queue_I2C_transactions_attributes = {
-  .name = "Queue_I2C_Transactions"
+/* Each engine state has its own profiling site */
+static_assert(((int) Profiler::PS_I2C_IDLE + (int) I2CS_FINISH) == (int) Profiler::PS_I2C_FINISH, "I2C states and profiling sites out of step");
+
+const osMessageQueueAttr_t queue_I2C_transactions_attributes[NUM_I2C_BUSSES] = {
+  {.name = "Queue_I2C_Transactions0"},
+  {.name = "Queue_I2C_Transactions1"}
 };
 
 
@@ -33,231 +38,890 @@ bool I2C_Engine::_check_i2c_message(I2C_Queue_Message *m, uint8_t expected_messa
  */
 
 void I2C_Engine::setup(void) {
-	/* Definitions for Queue_I2C_Transactions */
+	/* Put every transaction on the free list */
+	this->_free = NULL;
+	for(uint8_t i = 0; i < I2C_TRANSACTION_POOL_SIZE; i++) {
+		this->_pool[i].next = this->_free;
+		this->_free = &this->_pool[i];
+	}
+	this->_pool_lock = osMutexNew(NULL);
+	this->_poll_lock = osMutexNew(NULL);
+	this->_shadow_lock = osMutexNew(NULL);
+	this->_shadow_count = 0;
+	for(uint8_t i = 0; i < I2C_MAX_POLLS; i++) {
+		this->_polls[i].active = false;
+		this->_polls[i].trans = NULL;
+	}
 
-	/* Create queue_I2C_transactions */
-	this->_queue_i2c_transactions = osMessageQueueNew (I2C_TRANSACTION_QUEUE_DEPTH, sizeof(I2C_Transaction), &queue_I2C_transactions_attributes);
+	/* Create a transaction queue for each bus. Only pointers to the pool entries are queued */
+	for(uint8_t i = 0; i < NUM_I2C_BUSSES; i++) {
+		this->_busses[i].state = I2CS_IDLE;
+		this->_busses[i].msg_ready = false;
+		this->_busses[i].trans = NULL;
+		this->_busses[i].transactions = osMessageQueueNew (I2C_TRANSACTION_POOL_SIZE, sizeof(I2C_Transaction *), &queue_I2C_transactions_attributes[i]);
+	}
 }
 
 /*
- * This function is used to place an i2c transaction in the outgoing queue
+ * Take a transaction from the pool. Returns NULL if the pool is empty
  */
 
+I2C_Transaction *I2C_Engine::_alloc_transaction(void) {
+	osMutexAcquire(this->_pool_lock, osWaitForever);
+	I2C_Transaction *trans = this->_free;
+	if(trans) {
+		this->_free = trans->next;
+	}
+	osMutexRelease(this->_pool_lock);
+	return trans;
+}
 
-bool I2C_Engine::queue_transaction(uint8_t type, uint8_t bus, uint8_t device_address,
-		uint8_t register_address, uint8_t data_length, uint8_t *register_data, void (*callback)(I2C_Transaction *trans), uint32_t trans_id) {
-	I2C_Transaction trans;
+/*
+ * Return a transaction to the pool
+ */
 
-	/*  Sanity check parameters */
+void I2C_Engine::_free_transaction(I2C_Transaction *trans) {
+	osMutexAcquire(this->_pool_lock, osWaitForever);
+	trans->next = this->_free;
+	this->_free = trans;
+	osMutexRelease(this->_pool_lock);
+}
+
+/*
+ * Return the number of transactions in the pool free list
+ */
+
+uint8_t I2C_Engine::transactions_free(void) {
+	uint8_t count = 0;
+	osMutexAcquire(this->_pool_lock, osWaitForever);
+	for(I2C_Transaction *trans = this->_free; trans; trans = trans->next) {
+		count++;
+	}
+	osMutexRelease(this->_pool_lock);
+	return count;
+}
+
+/*
+ * Check the parameters of a register read or write. Returns false if they are bad
+ */
+
+bool I2C_Engine::_check_parameters(uint8_t type, uint8_t bus, uint8_t device_address, uint16_t register_address, uint8_t data_length, uint8_t *register_data) {
 	if((type >= I2CT_MAX_I2C_TYPES) || (device_address > 0x7F) ||
-			(bus >= NUM_I2C_BUSSES) || (data_length > MAX_I2C_REG_DATA) || (!register_data) || (!callback)) {
+			(bus >= NUM_I2C_BUSSES) || (data_length > MAX_I2C_REG_DATA) || (!register_data)) {
 		return false;
 	}
-	trans.id = trans_id;
-	trans.type = type;
-	trans.bus_num = bus;
-	trans.device_address = device_address;
-	trans.device_address8 = device_address << 1;
-	trans.register_address = register_address;
-	trans.data_length = data_length;
-	trans.caller_register_data = register_data;
-	trans.callback = callback;
-	/* Copy data if type is write */
-	if(trans.type == I2CT_WRITE_REG8) {
-		/* We write the register address and the data in one DMA transfer */
-		trans.local_register_data[0] = trans.register_address;
-		/* Append the data */
-		memcpy(trans.local_register_data + 1, trans.caller_register_data, trans.data_length);
+	bool address16 = (type == I2CT_READ_REG16) || (type == I2CT_WRITE_REG16);
+	if((!address16) && (register_address > 0xFF)) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Fill in the register transfer part of a transaction
+ */
+
+void I2C_Engine::_load_transfer(I2C_Transaction *trans, uint8_t type, uint8_t device_address, uint16_t register_address,
+		uint8_t data_length, uint8_t *register_data) {
+	bool address16 = (type == I2CT_READ_REG16) || (type == I2CT_WRITE_REG16);
+
+	trans->type = type;
+	trans->device_address = device_address;
+	trans->device_address8 = device_address << 1;
+	trans->register_address = register_address;
+	trans->register_address_size = address16 ? I2C_MEMADD_SIZE_16BIT : I2C_MEMADD_SIZE_8BIT;
+	trans->data_length = data_length;
+	trans->caller_register_data = register_data;
+}
+
+/*
+ * Check the parameters and fill in a transaction. Returns false if the parameters are bad.
+ * The callback is not checked, batches leave it NULL.
+ */
+
+bool I2C_Engine::_build_transaction(I2C_Transaction *trans, uint8_t type, uint8_t bus, uint8_t device_address,
+		uint16_t register_address, uint8_t data_length, uint8_t *register_data, void (*callback)(I2C_Transaction *trans), uint32_t trans_id) {
+
+	/*  Sanity check parameters */
+	if(!this->_check_parameters(type, bus, device_address, register_address, data_length, register_data)) {
+		return false;
 	}
+	this->_load_transfer(trans, type, device_address, register_address, data_length, register_data);
+	trans->id = trans_id;
+	trans->bus_num = bus;
+	trans->callback = callback;
+	trans->caller_owned = false;
+	trans->in_flight = false;
+	trans->batch = NULL;
+	trans->poll = NULL;
+	trans->shadow = NULL;
 
 	/* Choose the correct I2C bus handle */
-	switch(trans.bus_num) {
+	switch(trans->bus_num) {
 		case 0:
-			trans.bus = &hi2c1;
+			trans->bus = &hi2c1;
 			break;
 
 		case 1:
-			trans.bus = &hi2c2;
+			trans->bus = &hi2c2;
 			break;
 
 	}
+	return true;
+}
+
+/*
+ * This function is used to place a one shot i2c transaction in the outgoing queue.
+ * The transaction comes from the pool and goes back to it after the callback.
+ */
+
+bool I2C_Engine::queue_transaction(uint8_t type, uint8_t bus, uint8_t device_address,
+		uint16_t register_address, uint8_t data_length, uint8_t *register_data, void (*callback)(I2C_Transaction *trans), uint32_t trans_id) {
+	if(!callback) {
+		return false;
+	}
+	I2C_Transaction *trans = this->_alloc_transaction();
+	if(!trans) {
+		LOG_ERROR(TAG, "I2C transaction pool empty");
+		return false;
+	}
+	if(!this->_build_transaction(trans, type, bus, device_address, register_address, data_length, register_data, callback, trans_id) ||
+			!this->submit_transaction(trans)) {
+		this->_free_transaction(trans);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Reserve a transaction from the pool and fill it in, for a caller which submits the same
+ * transaction over and over, such as a periodic poll. It stays reserved until released.
+ * Returns NULL if the pool is empty or the parameters are bad.
+ */
+
+I2C_Transaction *I2C_Engine::reserve_transaction(uint8_t type, uint8_t bus, uint8_t device_address,
+		uint16_t register_address, uint8_t data_length, uint8_t *register_data, void (*callback)(I2C_Transaction *trans), uint32_t trans_id) {
+	if(!callback) {
+		return NULL;
+	}
+	I2C_Transaction *trans = this->_alloc_transaction();
+	if(!trans) {
+		LOG_ERROR(TAG, "I2C transaction pool empty");
+		return NULL;
+	}
+	if(!this->_build_transaction(trans, type, bus, device_address, register_address, data_length, register_data, callback, trans_id)) {
+		this->_free_transaction(trans);
+		return NULL;
+	}
+	trans->caller_owned = true;
+	return trans;
+}
+
+/*
+ * Return a reserved transaction to the pool. Fails if it is still in flight
+ */
+
+bool I2C_Engine::release_transaction(I2C_Transaction *trans) {
+	if(!trans || !trans->caller_owned || __atomic_load_n(&trans->in_flight, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+	trans->caller_owned = false;
+	this->_free_transaction(trans);
+	return true;
+}
+
+/*
+ * Queue a built transaction on its bus. Only the pointer is queued.
+ * Write data is copied from the caller's buffer now, so a reserved transaction sends the current data each time.
+ * Fails if the transaction is already in flight.
+ */
+
+bool I2C_Engine::submit_transaction(I2C_Transaction *trans) {
+	if(__atomic_exchange_n(&trans->in_flight, true, __ATOMIC_ACQ_REL)) {
+		return false;
+	}
+	trans->status = I2CEC_OK;
+	trans->hal_i2c_error_code = HAL_I2C_ERROR_NONE;
+	/* Copy data if type is write, the caller's buffer may be reused before the transfer */
+	if((trans->type == I2CT_WRITE_REG8) || (trans->type == I2CT_WRITE_REG16)) {
+		memcpy(trans->local_register_data, trans->caller_register_data, trans->data_length);
+	}
+
 	/* Queue Transaction */
 	osStatus_t status;
-	status = osMessageQueuePut(this->_queue_i2c_transactions, &trans, 0U, 0U );
-	if(status == osOK)
+	status = osMessageQueuePut(this->_busses[trans->bus_num].transactions, &trans, 0U, 0U );
+	if(status == osOK) {
+		osThreadFlagsSet(I2C_TaskHandle, I2C_EVENT_FLAG); /* Wake the I2C task */
 		return true;
+	}
 	else {
+		__atomic_store_n(&trans->in_flight, false, __ATOMIC_RELEASE);
 		LOG_ERROR(TAG, "I2C transaction put failed, os status: %d", (uint8_t) status);
 		return false;
 	}
 }
+
+/*
+ * Queue a batch of register reads and writes on one bus. The engine runs the steps back to back
+ * in one pool transaction without going back through the queue, then calls the batch callback once.
+ * Fails if the batch is already in flight, any step is bad, or the pool is empty.
+ */
+
+bool I2C_Engine::submit_batch(I2C_Batch *batch) {
+	if(!batch || !batch->steps || !batch->step_count || !batch->callback) {
+		return false;
+	}
+	for(uint8_t i = 0; i < batch->step_count; i++) {
+		I2C_Batch_Step *step = &batch->steps[i];
+		if(!this->_check_parameters(step->type, batch->bus, step->device_address, step->register_address, step->data_length, step->register_data)) {
+			LOG_ERROR(TAG, "Bad I2C batch step: %d", i);
+			return false;
+		}
+	}
+	if(__atomic_exchange_n(&batch->in_flight, true, __ATOMIC_ACQ_REL)) {
+		return false;
+	}
+
+	I2C_Transaction *trans = this->_alloc_transaction();
+	if(!trans) {
+		LOG_ERROR(TAG, "I2C transaction pool empty");
+		__atomic_store_n(&batch->in_flight, false, __ATOMIC_RELEASE);
+		return false;
+	}
+	for(uint8_t i = 0; i < batch->step_count; i++) {
+		batch->steps[i].status = I2CEC_NOT_RUN;
+	}
+	batch->failed = 0;
+
+	/* The first step goes in the transaction, the engine loads the rest as each one finishes */
+	I2C_Batch_Step *step = &batch->steps[0];
+	this->_build_transaction(trans, step->type, batch->bus, step->device_address, step->register_address, step->data_length, step->register_data,
+			NULL, batch->id);
+	trans->batch = batch;
+	trans->batch_step = 0;
+	if(!this->submit_transaction(trans)) {
+		this->_free_transaction(trans);
+		__atomic_store_n(&batch->in_flight, false, __ATOMIC_RELEASE);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Record the result of the batch step just finished, and load the next one into the transaction.
+ * Returns false when the batch is done.
+ */
+
+bool I2C_Engine::_next_batch_step(I2C_Transaction *trans) {
+	I2C_Batch *batch = trans->batch;
+
+	batch->steps[trans->batch_step].status = trans->status;
+	if(trans->status != I2CEC_OK) {
+		batch->failed++;
+		if(batch->stop_on_error) {
+			batch->failed += batch->step_count - trans->batch_step - 1; /* The rest are not run */
+			return false;
+		}
+	}
+	if(++trans->batch_step >= batch->step_count) {
+		return false;
+	}
+	I2C_Batch_Step *step = &batch->steps[trans->batch_step];
+	this->_load_transfer(trans, step->type, step->device_address, step->register_address, step->data_length, step->register_data);
+	trans->status = I2CEC_OK;
+	trans->hal_i2c_error_code = HAL_I2C_ERROR_NONE;
+	if((trans->type == I2CT_WRITE_REG8) || (trans->type == I2CT_WRITE_REG16)) {
+		memcpy(trans->local_register_data, trans->caller_register_data, trans->data_length);
+	}
+	return true;
+}
+
+/*
+ * Register a register read for the engine to issue every period_ms, calling back only when the bits in mask change.
+ * New polls are staggered through their period by slot, so polls added together do not all land on the same tick.
+ * Returns NULL if there is no free poll slot, the pool is empty, or the parameters are bad.
+ */
+
+I2C_Poll *I2C_Engine::add_poll(uint8_t type, uint8_t bus, uint8_t device_address, uint16_t register_address, uint8_t data_length,
+		uint32_t mask, uint32_t period_ms, void (*callback)(I2C_Poll *poll), uint32_t id) {
+	if(((type != I2CT_READ_REG8) && (type != I2CT_READ_REG16)) || (!data_length) || (data_length > I2C_MAX_POLL_DATA) ||
+			(!period_ms) || (!callback)) {
+		return NULL;
+	}
+	uint32_t period = (period_ms * osKernelGetTickFreq()) / 1000;
+	if(!period) {
+		period = 1;
+	}
+
+	osMutexAcquire(this->_poll_lock, osWaitForever);
+	I2C_Poll *poll = NULL;
+	uint8_t slot;
+	for(slot = 0; slot < I2C_MAX_POLLS; slot++) {
+		if((!this->_polls[slot].active) && (!this->_polls[slot].trans)) {
+			poll = &this->_polls[slot];
+			break;
+		}
+	}
+	if(!poll) {
+		osMutexRelease(this->_poll_lock);
+		LOG_ERROR(TAG, "No free I2C poll slot");
+		return NULL;
+	}
+	I2C_Transaction *trans = this->_alloc_transaction();
+	if(!trans) {
+		osMutexRelease(this->_poll_lock);
+		LOG_ERROR(TAG, "I2C transaction pool empty");
+		return NULL;
+	}
+	if(!this->_build_transaction(trans, type, bus, device_address, register_address, data_length, poll->data, NULL, id)) {
+		this->_free_transaction(trans);
+		osMutexRelease(this->_poll_lock);
+		return NULL;
+	}
+	trans->caller_owned = true;
+	trans->poll = poll;
+	poll->id = id;
+	poll->period = period;
+	poll->due = osKernelGetTickCount() + ((period * slot) / I2C_MAX_POLLS);
+	poll->mask = mask;
+	poll->value = 0;
+	poll->changed = 0;
+	poll->reads = 0;
+	poll->status = I2CEC_NOT_RUN;
+	poll->valid = false;
+	poll->trans = trans;
+	poll->callback = callback;
+	poll->active = true;
+	osMutexRelease(this->_poll_lock);
+
+	osThreadFlagsSet(I2C_TaskHandle, I2C_EVENT_FLAG); /* Let the scheduler see it */
+	return poll;
+}
+
+/*
+ * Stop a poll. If its read is in flight, the transaction goes back to the pool when the read finishes.
+ * The callback may run once more if the read was finishing as the poll was removed.
+ */
+
+bool I2C_Engine::remove_poll(I2C_Poll *poll) {
+	if(!poll) {
+		return false;
+	}
+	osMutexAcquire(this->_poll_lock, osWaitForever);
+	if(!poll->active) {
+		osMutexRelease(this->_poll_lock);
+		return false;
+	}
+	poll->active = false;
+	if(this->release_transaction(poll->trans)) {
+		poll->trans = NULL;
+	}
+	osMutexRelease(this->_poll_lock);
+	return true;
+}
+
+/*
+ * Submit the polls which are due. Returns the ticks until the next one is due, for the engine wait.
+ * Polls still in flight are left out, their completion wakes the engine anyway.
+ */
+
+uint32_t I2C_Engine::_run_polls(void) {
+	uint32_t timeout = osWaitForever;
+	uint32_t now = osKernelGetTickCount();
+
+	osMutexAcquire(this->_poll_lock, osWaitForever);
+	for(uint8_t i = 0; i < I2C_MAX_POLLS; i++) {
+		I2C_Poll *poll = &this->_polls[i];
+		if((!poll->active) || __atomic_load_n(&poll->trans->in_flight, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		int32_t wait = (int32_t) (poll->due - now);
+		if(wait <= 0) {
+			if(this->submit_transaction(poll->trans)) {
+				poll->due += poll->period;
+				if((int32_t) (poll->due - now) <= 0) {
+					poll->due = now + poll->period; /* Fell behind, don't try to catch up */
+				}
+			}
+			continue;
+		}
+		if((uint32_t) wait < timeout) {
+			timeout = wait;
+		}
+	}
+	osMutexRelease(this->_poll_lock);
+	return timeout;
+}
+
+/*
+ * A poll read has finished. Work out which masked bits changed and call back if anything is worth reporting
+ */
+
+void I2C_Engine::_poll_done(I2C_Transaction *trans) {
+	I2C_Poll *poll = trans->poll;
+	bool report;
+
+	osMutexAcquire(this->_poll_lock, osWaitForever);
+	/* Under the lock, so remove_poll() either leaves the release to us or runs after we are done with it */
+	__atomic_store_n(&trans->in_flight, false, __ATOMIC_RELEASE);
+	if(!poll->active) {
+		/* Removed while the read was in flight */
+		this->release_transaction(trans);
+		poll->trans = NULL;
+		osMutexRelease(this->_poll_lock);
+		return;
+	}
+	poll->reads++;
+	report = (trans->status != poll->status);
+	poll->status = trans->status;
+	poll->changed = 0;
+	if(trans->status == I2CEC_OK) {
+		uint32_t value = 0;
+		for(uint8_t i = 0; i < trans->data_length; i++) {
+			value |= ((uint32_t) poll->data[i]) << (i * 8);
+		}
+		poll->changed = poll->valid ? ((value ^ poll->value) & poll->mask) : poll->mask;
+		poll->value = value;
+		poll->valid = true;
+		report |= (poll->changed != 0);
+	}
+	osMutexRelease(this->_poll_lock);
+
+	if(report) {
+		(*poll->callback)(poll);
+	}
+}
+
+/*
+ * Add a register cache for a device with 8 bit registers at 8 bit addresses.
+ * Bits set in nonvolatile are the registers whose reads can come from the cache.
+ * Returns NULL if there is no free shadow, the pool is empty, or the parameters are bad.
+ */
+
+I2C_Shadow *I2C_Engine::add_shadow(uint8_t bus, uint8_t device_address, uint32_t nonvolatile) {
+	osMutexAcquire(this->_shadow_lock, osWaitForever);
+	if(this->_shadow_count >= I2C_MAX_SHADOWS) {
+		osMutexRelease(this->_shadow_lock);
+		LOG_ERROR(TAG, "No free I2C shadow");
+		return NULL;
+	}
+	I2C_Shadow *shadow = &this->_shadows[this->_shadow_count];
+	I2C_Transaction *trans = this->_alloc_transaction();
+	if(!trans) {
+		osMutexRelease(this->_shadow_lock);
+		LOG_ERROR(TAG, "I2C transaction pool empty");
+		return NULL;
+	}
+	if(!this->_build_transaction(trans, I2CT_WRITE_REG8, bus, device_address, 0, 1, shadow->registers, NULL, device_address)) {
+		this->_free_transaction(trans);
+		osMutexRelease(this->_shadow_lock);
+		return NULL;
+	}
+	trans->caller_owned = true;
+	trans->shadow = shadow;
+	shadow->bus = bus;
+	shadow->device_address = device_address;
+	shadow->nonvolatile = nonvolatile;
+	shadow->valid = 0;
+	shadow->dirty = 0;
+	memset(shadow->registers, 0, sizeof(shadow->registers));
+	shadow->flush = trans;
+	shadow->updates = 0;
+	shadow->writes = 0;
+	shadow->cached_reads = 0;
+	shadow->write_errors = 0;
+	this->_shadow_count++;
+	osMutexRelease(this->_shadow_lock);
+	return shadow;
+}
+
+/*
+ * Tell the cache what a register holds, such as its value after reset, without any bus traffic
+ */
+
+void I2C_Engine::shadow_set(I2C_Shadow *shadow, uint8_t register_address, uint8_t value) {
+	if((!shadow) || (register_address >= I2C_SHADOW_REGISTERS)) {
+		return;
+	}
+	osMutexAcquire(this->_shadow_lock, osWaitForever);
+	shadow->registers[register_address] = value;
+	shadow->valid |= 1UL << register_address;
+	osMutexRelease(this->_shadow_lock);
+}
+
+/*
+ * Change the bits of a register in mask to those in value, without reading the device.
+ * The register must be cached unless every bit is changed. No write is sent if the register already holds the value.
+ * Updates made before the flush transaction gets to the register go out as one write.
+ */
+
+bool I2C_Engine::shadow_update(I2C_Shadow *shadow, uint8_t register_address, uint8_t mask, uint8_t value) {
+	if((!shadow) || (register_address >= I2C_SHADOW_REGISTERS)) {
+		return false;
+	}
+	uint32_t bit = 1UL << register_address;
+	bool res = true;
+
+	osMutexAcquire(this->_shadow_lock, osWaitForever);
+	if((!(shadow->valid & bit)) && (mask != 0xFF)) {
+		osMutexRelease(this->_shadow_lock);
+		LOG_ERROR(TAG, "Shadow register %d not cached", register_address);
+		return false;
+	}
+	shadow->updates++;
+	uint8_t new_value = (shadow->registers[register_address] & ~mask) | (value & mask);
+	if((!(shadow->valid & bit)) || (new_value != shadow->registers[register_address])) {
+		shadow->registers[register_address] = new_value;
+		shadow->valid |= bit;
+		shadow->dirty |= bit;
+		/* Only start the flush if it is not already queued or writing, it picks up every dirty register */
+		if(!__atomic_load_n(&shadow->flush->in_flight, __ATOMIC_ACQUIRE)) {
+			res = this->submit_transaction(shadow->flush);
+		}
+	}
+	osMutexRelease(this->_shadow_lock);
+	return res;
+}
+
 /*
- * Called repeatedly after RTOS initialization
+ * Read registers through the cache. If they are all non-volatile and cached, the data is copied
+ * at once and I2CSR_CACHED returned with no callback. Otherwise the read is queued, the cache is
+ * filled from the result, and I2CSR_QUEUED returned.
+ */
+
+uint8_t I2C_Engine::shadow_read(I2C_Shadow *shadow, uint8_t register_address, uint8_t data_length, uint8_t *register_data,
+		void (*callback)(I2C_Transaction *trans), uint32_t trans_id) {
+	if((!shadow) || (!data_length) || ((register_address + data_length) > I2C_SHADOW_REGISTERS) || (!callback)) {
+		return I2CSR_FAILED;
+	}
+	uint32_t range = (uint32_t) (((1ULL << data_length) - 1) << register_address);
+
+	osMutexAcquire(this->_shadow_lock, osWaitForever);
+	if((shadow->nonvolatile & shadow->valid & range) == range) {
+		memcpy(register_data, &shadow->registers[register_address], data_length);
+		shadow->cached_reads++;
+		osMutexRelease(this->_shadow_lock);
+		return I2CSR_CACHED;
+	}
+	osMutexRelease(this->_shadow_lock);
+
+	I2C_Transaction *trans = this->_alloc_transaction();
+	if(!trans) {
+		LOG_ERROR(TAG, "I2C transaction pool empty");
+		return I2CSR_FAILED;
+	}
+	if(!this->_build_transaction(trans, I2CT_READ_REG8, shadow->bus, shadow->device_address, register_address, data_length,
+			register_data, callback, trans_id)) {
+		this->_free_transaction(trans);
+		return I2CSR_FAILED;
+	}
+	trans->shadow = shadow;
+	if(!this->submit_transaction(trans)) {
+		this->_free_transaction(trans);
+		return I2CSR_FAILED;
+	}
+	return I2CSR_QUEUED;
+}
+
+/*
+ * Load the lowest dirty register into the flush transaction. When there are none left the flush
+ * stops being in flight, under the lock so an update can't see it busy after it has finished looking.
+ * Returns false when there is nothing to write.
+ */
+
+bool I2C_Engine::_next_shadow_write(I2C_Transaction *trans) {
+	I2C_Shadow *shadow = trans->shadow;
+
+	osMutexAcquire(this->_shadow_lock, osWaitForever);
+	if(!shadow->dirty) {
+		__atomic_store_n(&trans->in_flight, false, __ATOMIC_RELEASE);
+		osMutexRelease(this->_shadow_lock);
+		return false;
+	}
+	uint8_t register_address = __builtin_ctz(shadow->dirty);
+	shadow->dirty &= ~(1UL << register_address);
+	trans->register_address = register_address;
+	trans->local_register_data[0] = shadow->registers[register_address];
+	trans->status = I2CEC_OK;
+	trans->hal_i2c_error_code = HAL_I2C_ERROR_NONE;
+	shadow->writes++;
+	osMutexRelease(this->_shadow_lock);
+	return true;
+}
+
+/*
+ * A flush write has finished. If it failed the device value is unknown, unless a newer one is waiting to be written.
+ */
+
+void I2C_Engine::_shadow_write_done(I2C_Transaction *trans) {
+	if(trans->status == I2CEC_OK) {
+		return;
+	}
+	I2C_Shadow *shadow = trans->shadow;
+	uint32_t bit = 1UL << trans->register_address;
+
+	osMutexAcquire(this->_shadow_lock, osWaitForever);
+	shadow->write_errors++;
+	if(!(shadow->dirty & bit)) {
+		shadow->valid &= ~bit;
+	}
+	osMutexRelease(this->_shadow_lock);
+	LOG_ERROR(TAG, "Shadow register %d write failed, status: %d", trans->register_address, trans->status);
+}
+
+/*
+ * Fill the cache from a read through it. Registers with a write waiting keep the newer cached value.
+ */
+
+void I2C_Engine::_shadow_read_done(I2C_Transaction *trans) {
+	if(trans->status != I2CEC_OK) {
+		return;
+	}
+	I2C_Shadow *shadow = trans->shadow;
+
+	osMutexAcquire(this->_shadow_lock, osWaitForever);
+	for(uint8_t i = 0; i < trans->data_length; i++) {
+		uint8_t register_address = trans->register_address + i;
+		uint32_t bit = 1UL << register_address;
+		if(!(shadow->dirty & bit)) {
+			shadow->registers[register_address] = trans->local_register_data[i];
+			shadow->valid |= bit;
+		}
+	}
+	osMutexRelease(this->_shadow_lock);
+}
+
+/*
+ * Called repeatedly after RTOS initialization. Submits the polls which are due, runs the state machines
+ * of both busses until neither can go further, then blocks until a transaction is queued, a HAL completion
+ * arrives or the next poll is due.
  */
 
 void I2C_Engine::loop(void) {
-	osStatus_t status;
-	I2C_Queue_Message msg;
-	int res;
+	bool progress;
+	uint32_t timeout = this->_run_polls();
 
+	do {
+		progress = this->_route_messages();
+		for(uint8_t i = 0; i < NUM_I2C_BUSSES; i++) {
+			progress |= this->_step(&this->_busses[i]);
+		}
+	} while(progress);
+	osThreadFlagsWait(I2C_EVENT_FLAG, osFlagsWaitAny, timeout);
+}
 
-	/* Process an I2C interrupt callback if there is one */
-	if(osMessageQueueGetCount(Queue_I2C_BussesHandle)) {
-		status = osMessageQueueGet(Queue_I2C_BussesHandle, &msg, NULL, osWaitForever);
-		if (status == osOK) {
-			this->_i2c_msg_ready = true;
+/*
+ * Hand the HAL completion messages to the bus they are for. Returns true if there were any
+ */
+
+bool I2C_Engine::_route_messages(void) {
+	I2C_Queue_Message msg;
+	bool routed = false;
+
+	while(osMessageQueueGet(Queue_I2C_BussesHandle, &msg, NULL, 0U) == osOK) {
+		if(msg.bus >= NUM_I2C_BUSSES) {
+			LOG_ERROR(TAG, "Completion message for unknown bus: %d", msg.bus);
+			continue;
 		}
-		else {
-			LOG_ERROR(TAG, "osMessageQueGet() failed");
+		I2C_Bus_State *bs = &this->_busses[msg.bus];
+		if(bs->msg_ready) {
+			LOG_DEBUG(TAG, "Bus %d completion message overwritten", msg.bus);
 		}
+		bs->msg = msg;
+		bs->msg_ready = true;
+		routed = true;
+	}
+	return routed;
+}
+
+/*
+ * Decode the transaction type into the state which starts the transfer
+ */
+
+uint8_t I2C_Engine::_start_state(uint8_t type) {
+	switch (type) {
+		case I2CT_READ_REG8:
+		case I2CT_READ_REG16:
+			return I2CS_READ_REG;
+		case I2CT_WRITE_REG8:
+		case I2CT_WRITE_REG16:
+			return I2CS_WRITE_REG;
+		default:
+			return I2CS_IDLE;
 	}
+}
+
+/*
+ * Advance the state machine of one bus by one state. Returns false when there was nothing to do
+ */
 
-	switch(this->_state) {
+bool I2C_Engine::_step(I2C_Bus_State *bs) {
+	osStatus_t status;
+	int res;
+	uint8_t entry_state = bs->state;
+	PROFILE_START(profile_start);
+
+	switch(bs->state) {
 		case I2CS_IDLE:
 			/* Look for work */
-			if (osMessageQueueGetCount(this->_queue_i2c_transactions)) {
-				status = osMessageQueueGet(this->_queue_i2c_transactions, &this->trans, NULL, osWaitForever);
-				if (status == osOK) {
-					/* Decode Transaction Type */
-					switch (this->trans.type) {
-						case I2CT_READ_REG8:
-							this->_state = I2CS_READ_REG;
-							break;
-						case I2CT_WRITE_REG8:
-							this->_state = I2CS_WRITE_REG;
-							break;
-					}
-				}
-				else {
-					LOG_ERROR(TAG, "osMessageQueGet() failed");
+			status = osMessageQueueGet(bs->transactions, &bs->trans, NULL, 0U);
+			if (status == osOK) {
+				/* A shadow flush picks up its register now, so later updates still join it */
+				if (bs->trans->shadow && (bs->trans == bs->trans->shadow->flush) && !this->_next_shadow_write(bs->trans)) {
+					bs->trans = NULL;
+					break;
 				}
+				bs->state = this->_start_state(bs->trans->type);
 			}
 			break;
 
 
 		case I2CS_READ_REG:  /* I2C register read */
-			this->_i2c_msg_ready = false;
-			/* Send write register address transaction */
-			res = HAL_I2C_Master_Transmit_DMA(this->trans.bus, this->trans.device_address8, &this->trans.register_address, 1);
+			bs->msg_ready = false;
+			/* Register address write, repeated start and data read as one transfer */
+			res = HAL_I2C_Mem_Read_DMA(bs->trans->bus, bs->trans->device_address8, bs->trans->register_address, bs->trans->register_address_size,
+					bs->trans->local_register_data, bs->trans->data_length);
 			if (res != HAL_OK) {
-				LOG_ERROR(TAG, "HAL_I2C_Master_Transmit_DMA failed");
-				this->trans.hal_i2c_error_code = this->trans.bus->ErrorCode;
-				this->trans.status = I2CEC_DMA_FAILED;
-				this->_state = I2CS_FINISH;
+				LOG_ERROR(TAG, "HAL_I2C_Mem_Read_DMA failed");
+				bs->trans->hal_i2c_error_code = bs->trans->bus->ErrorCode;
+				bs->trans->status = I2CEC_DMA_FAILED;
+				bs->state = I2CS_FINISH;
 			}
-			else { /* Write register address DMA was started */
-				this->_state = I2CS_READ_REG_WAIT_REG_XMIT;
+			else {
+				bs->state = I2CS_READ_REG_WAIT_RCV;
 			}
 			break;
 
 
-		case I2CS_READ_REG_WAIT_REG_XMIT: /* Transmit register address */
-			if (this->_i2c_msg_ready) {
-				this->_i2c_msg_ready = false;
-				if (this->_check_i2c_message(&msg, MSG_I2C_TX)) {
-					/* Expected response. Get the register data */
-					res = HAL_I2C_Master_Receive_DMA(this->trans.bus, this->trans.device_address8, this->trans.local_register_data, this->trans.data_length);
-					if (res != HAL_OK) {
-						LOG_ERROR(TAG, "HAL_I2C_Master_Receive_DMA failed");
-						this->trans.hal_i2c_error_code = this->trans.bus->ErrorCode;
-						this->trans.status = I2CEC_DMA_FAILED;
-						this->_state = I2CS_FINISH;
+		case I2CS_READ_REG_WAIT_RCV: /* Wait for data to be received */
+			if (bs->msg_ready) {
+				bs->msg_ready = false;
+				if (this->_check_i2c_message(&bs->msg, MSG_I2C_RX)) { /* Expected response */
+					if (!bs->trans->poll) { /* Polls would flood the log */
+						LOG_DEBUG(TAG,"I2C Read Register Complete");
 					}
-					else {
-						this->_state = I2CS_READ_REG_WAIT_RCV;
+					bs->trans->status = I2CEC_OK;
+					bs->state = I2CS_FINISH;
 					}
-
-				}
 				else { /* Unexpected response */
-					this->trans.hal_i2c_error_code = this->trans.bus->ErrorCode;
-					if (this->trans.hal_i2c_error_code == HAL_I2C_ERROR_AF) {
-						this->trans.status = I2CEC_NO_DEVICE;
+					bs->trans->hal_i2c_error_code = bs->trans->bus->ErrorCode;
+					if (bs->trans->hal_i2c_error_code == HAL_I2C_ERROR_AF) {
+						bs->trans->status = I2CEC_NO_DEVICE;
 					}
 					else {
-						this->trans.status = I2CEC_TRANS_FAILED;
-					}
-					this->_state = I2CS_FINISH;
-				}
-			}
-
-			break;
-
-
-		case I2CS_READ_REG_WAIT_RCV: /* Wait for data to be received */
-			if (this->_i2c_msg_ready) {
-				this->_i2c_msg_ready = false;
-				if (this->_check_i2c_message(&msg, MSG_I2C_RX)) { /* Expected response */
-					LOG_DEBUG(TAG,"I2C Read Register Complete");
-					this->trans.status = I2CEC_OK;
-					this->_state = I2CS_FINISH;
+						bs->trans->status = I2CEC_TRANS_FAILED;
 					}
-				else { /* Unexpected response */
-					this->trans.hal_i2c_error_code = this->trans.bus->ErrorCode;
-					this->trans.status = I2CEC_TRANS_FAILED;
-					this->_state = I2CS_FINISH;
+					bs->state = I2CS_FINISH;
 				}
 			}
 			break;
 
 
 		case I2CS_WRITE_REG: /* I2C register write */
-			this->_i2c_msg_ready = false;
-			/* Send write register transaction */
-			/* We write the address and the data as one DMA transfer */
-			res = HAL_I2C_Master_Transmit_DMA(this->trans.bus, this->trans.device_address8, this->trans.local_register_data, this->trans.data_length + 1);
+			bs->msg_ready = false;
+			/* Register address and data as one transfer */
+			res = HAL_I2C_Mem_Write_DMA(bs->trans->bus, bs->trans->device_address8, bs->trans->register_address, bs->trans->register_address_size,
+					bs->trans->local_register_data, bs->trans->data_length);
 			if (res != HAL_OK) {
-				LOG_ERROR(TAG, "HAL_I2C_Master_Transmit_DMA failed");
-				this->trans.hal_i2c_error_code = this->trans.bus->ErrorCode;
-				this->trans.status = I2CEC_DMA_FAILED;
-				this->_state = I2CS_FINISH;
+				LOG_ERROR(TAG, "HAL_I2C_Mem_Write_DMA failed");
+				bs->trans->hal_i2c_error_code = bs->trans->bus->ErrorCode;
+				bs->trans->status = I2CEC_DMA_FAILED;
+				bs->state = I2CS_FINISH;
 			}
 			else {
-				this->_state = I2CS_WRITE_REG_WAIT_DATA_XMIT;
+				bs->state = I2CS_WRITE_REG_WAIT_XMIT;
 			}
 			break;
 
 
-		case I2CS_WRITE_REG_WAIT_DATA_XMIT:
-			if (this->_i2c_msg_ready) {
-				this->_i2c_msg_ready = false;
-				if (this->_check_i2c_message(&msg, MSG_I2C_TX)) { /* Expected response */
-					LOG_DEBUG(TAG,"I2C Write Register Complete");
-					this->trans.status = I2CEC_OK;
-					this->_state = I2CS_FINISH;
+		case I2CS_WRITE_REG_WAIT_XMIT:
+			if (bs->msg_ready) {
+				bs->msg_ready = false;
+				if (this->_check_i2c_message(&bs->msg, MSG_I2C_TX)) { /* Expected response */
+					if (!bs->trans->shadow) { /* Shadow flushes would flood the log */
+						LOG_DEBUG(TAG,"I2C Write Register Complete");
+					}
+					bs->trans->status = I2CEC_OK;
+					bs->state = I2CS_FINISH;
 					}
 				else { /* Unexpected response */
-					this->trans.hal_i2c_error_code = this->trans.bus->ErrorCode;
-					if (this->trans.hal_i2c_error_code == HAL_I2C_ERROR_AF) {
-						this->trans.status = I2CEC_NO_DEVICE;
+					bs->trans->hal_i2c_error_code = bs->trans->bus->ErrorCode;
+					if (bs->trans->hal_i2c_error_code == HAL_I2C_ERROR_AF) {
+						bs->trans->status = I2CEC_NO_DEVICE;
 					}
 					else {
-						this->trans.status = I2CEC_TRANS_FAILED;
+						bs->trans->status = I2CEC_TRANS_FAILED;
 					}
-					this->_state = I2CS_FINISH;
+					bs->state = I2CS_FINISH;
 				}
 			}
 			break;
 
 		case I2CS_FINISH: /* Final steps */
 			/* If OK and the command was a read */
-			if((this->trans.status == I2CEC_OK) && (this->trans.type == I2CT_READ_REG8)) {
+			if((bs->trans->status == I2CEC_OK) && ((bs->trans->type == I2CT_READ_REG8) || (bs->trans->type == I2CT_READ_REG16))) {
 				/* Copy the read data to the user's buffer pointer */
-				memcpy(this->trans.caller_register_data, this->trans.local_register_data, this->trans.data_length);
+				memcpy(bs->trans->caller_register_data, bs->trans->local_register_data, bs->trans->data_length);
 			}
 
-			/* Call the user-supplied callback function */
-			(*this->trans.callback)(&this->trans);
+			/* Batches go straight on to their next step */
+			if(bs->trans->batch) {
+				if(this->_next_batch_step(bs->trans)) {
+					bs->state = this->_start_state(bs->trans->type);
+					break;
+				}
+				I2C_Transaction *trans = bs->trans;
+				I2C_Batch *batch = trans->batch;
+				bs->trans = NULL;
+				this->_free_transaction(trans);
+				__atomic_store_n(&batch->in_flight, false, __ATOMIC_RELEASE);
+				(*batch->callback)(batch);
+			}
+			/* Shadow flushes keep writing until no dirty registers are left */
+			else if(bs->trans->shadow && (bs->trans == bs->trans->shadow->flush)) {
+				this->_shadow_write_done(bs->trans);
+				if(this->_next_shadow_write(bs->trans)) {
+					bs->state = I2CS_WRITE_REG;
+					break;
+				}
+				bs->trans = NULL;
+			}
+			/* Polls compare the result and only call back on a change */
+			else if(bs->trans->poll) {
+				I2C_Transaction *trans = bs->trans;
+				bs->trans = NULL;
+				this->_poll_done(trans); /* Clears in_flight itself, a remove_poll() could release it otherwise */
+			}
+			/* Finished, a reserved transaction can be submitted again from the callback */
+			else {
+				I2C_Transaction *trans = bs->trans;
+				bool caller_owned = trans->caller_owned; /* The callback may release it */
+				bs->trans = NULL;
+				__atomic_store_n(&trans->in_flight, false, __ATOMIC_RELEASE);
+				if(trans->shadow) {
+					this->_shadow_read_done(trans);
+				}
+				/* Call the user-supplied callback function */
+				(*trans->callback)(trans);
+				if(!caller_owned) {
+					this->_free_transaction(trans);
+				}
+			}
 			/* Go back to Idle and look for more work */
-			this->_state = I2CS_IDLE;
+			bs->state = I2CS_IDLE;
 			break;
 
 
 		default:
-			this->_state = I2CS_IDLE;
+			bs->state = I2CS_IDLE;
 			break;
 	}
-	/* Give other lower priority threads a chance to execute */
-	status = osThreadYield();
+	/* Only passes which change state are profiled */
+	if(bs->state != entry_state) {
+		PROFILE_STOP(Profiler::PS_I2C_IDLE + entry_state, profile_start);
+		return true;
+	}
+	return false;
 }
 
 
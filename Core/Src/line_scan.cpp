@@ -0,0 +1,188 @@
+#include <string.h>
+#include "line_scan.h"
+#include "logging.h"
+#include "profiler.h"
+
+/*
+ * Hook state supervision for the subscriber lines on the line cards.
+ *
+ * Port snapshots come in from I2C engine polls, which only call back when a port changes.
+ * Each scan debounces 32 lines at a time with bit sliced vertical counters: count0 and count1
+ * hold bit 0 and bit 1 of every line's count of scans it has differed from its debounced state.
+ * Only words which differ or are still counting are visited, so a scan costs the same however
+ * many cards are fitted, and grows only with line activity.
+ *
+ * Hook changes go into a single producer, single consumer queue. scan() must only be called
+ * from one task, and get_event() from one task.
+ */
+
+namespace Line_Scan {
+
+const char *TAG = "line_scan";
+
+/*
+ * I2C engine poll callback. The poll id is the first line of the card.
+ */
+
+static void card_changed(I2C_Engine::I2C_Poll *poll) {
+	uint16_t first_line = (uint16_t) poll->id;
+
+	if(poll->status != I2C_Engine::I2CEC_OK) {
+		LOG_WARN(TAG, "Line card for line %u read failed, status: %u", first_line, poll->status);
+		return; /* Lines hold their last state */
+	}
+	uint8_t shift = first_line % LINES_PER_WORD;
+	uint32_t mask = (poll->mask << shift);
+	Lines.set_port_bits(first_line / LINES_PER_WORD, poll->value << shift, mask);
+}
+
+/*
+ * Called once during initialization. All lines start on hook.
+ */
+
+void Line_Scan::setup(void) {
+	memset(this->_sample, 0, sizeof(this->_sample));
+	memset(this->_state, 0, sizeof(this->_state));
+	memset(this->_count0, 0, sizeof(this->_count0));
+	memset(this->_count1, 0, sizeof(this->_count1));
+	memset(this->_active, 0, sizeof(this->_active));
+	this->_event_head = 0;
+	this->_event_tail = 0;
+	this->_events_dropped = 0;
+}
+
+/*
+ * Add a line card: ports 8 bit input ports read as one little endian register block every period_ms.
+ * The card's lines must start on a port boundary and fit in one word.
+ */
+
+bool Line_Scan::add_card(uint8_t bus, uint8_t device_address, uint16_t register_address, uint8_t ports, uint16_t first_line, uint32_t period_ms) {
+	if((!ports) || (ports > MAX_CARD_PORTS) || (first_line & 7) || (first_line >= MAX_LINES) ||
+			(((first_line % LINES_PER_WORD) + (ports * 8)) > LINES_PER_WORD)) {
+		LOG_ERROR(TAG, "Bad line card for line %u", first_line);
+		return false;
+	}
+	uint32_t mask = (ports == MAX_CARD_PORTS) ? 0xFFFFFFFF : ((1UL << (ports * 8)) - 1);
+	if(!I2c.add_poll(I2C_Engine::I2CT_READ_REG8, bus, device_address, register_address, ports, mask, period_ms, card_changed, first_line)) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Store a snapshot of all 32 lines of a word. Call from one task only, normally the I2C task.
+ */
+
+void Line_Scan::set_port(uint16_t word, uint32_t sample) {
+	this->set_port_bits(word, sample, 0xFFFFFFFF);
+}
+
+/*
+ * Store a snapshot of some of the lines of a word, for cards which share a word.
+ */
+
+void Line_Scan::set_port_bits(uint16_t word, uint32_t sample, uint32_t mask) {
+	if(word >= MAX_WORDS) {
+		return;
+	}
+	uint32_t old = __atomic_load_n(&this->_sample[word], __ATOMIC_RELAXED);
+	__atomic_store_n(&this->_sample[word], (old & ~mask) | (sample & mask), __ATOMIC_RELAXED);
+	/* Have the next scan look at this word. The release orders it after the sample */
+	__atomic_fetch_or(&this->_active[word / LINES_PER_WORD], 1UL << (word % LINES_PER_WORD), __ATOMIC_RELEASE);
+}
+
+/*
+ * Debounce the words which have changed or are still counting, and queue any hook changes.
+ * Called at a fixed rate, DEBOUNCE_SCANS scans is the debounce time.
+ */
+
+void Line_Scan::scan(void) {
+	PROFILE_START(prof_start);
+	uint32_t now = osKernelGetTickCount();
+
+	for(uint8_t a = 0; a < ACTIVE_WORDS; a++) {
+		uint32_t pending = __atomic_exchange_n(&this->_active[a], 0, __ATOMIC_ACQUIRE);
+		uint32_t busy = 0;
+		while(pending) {
+			uint8_t bit = __builtin_ctz(pending);
+			pending &= pending - 1;
+			uint16_t word = (a * LINES_PER_WORD) + bit;
+
+			uint32_t sample = __atomic_load_n(&this->_sample[word], __ATOMIC_RELAXED);
+			uint32_t state = this->_state[word];
+			uint32_t delta = sample ^ state;
+			/* Count up the lines which differ, and clear the count of the ones which don't */
+			uint32_t count1 = (this->_count1[word] ^ this->_count0[word]) & delta;
+			uint32_t count0 = ~this->_count0[word] & delta;
+			/* A count which wrapped to zero has differed DEBOUNCE_SCANS times in a row */
+			uint32_t toggled = delta & ~(count0 | count1);
+			this->_count0[word] = count0;
+			this->_count1[word] = count1;
+			if(toggled) {
+				state ^= toggled;
+				__atomic_store_n(&this->_state[word], state, __ATOMIC_RELAXED);
+				this->_post_events(word, toggled, state, now);
+			}
+			if(delta & ~toggled) {
+				busy |= 1UL << bit; /* Still counting */
+			}
+		}
+		if(busy) {
+			__atomic_fetch_or(&this->_active[a], busy, __ATOMIC_RELAXED);
+		}
+	}
+	PROFILE_STOP(Profiler::PS_LINE_SCAN, prof_start);
+}
+
+/*
+ * Queue an event for each line which changed. Events are dropped and counted when the queue is full.
+ */
+
+void Line_Scan::_post_events(uint16_t word, uint32_t toggled, uint32_t state, uint32_t timestamp) {
+	uint32_t head = this->_event_head;
+	uint32_t tail = __atomic_load_n(&this->_event_tail, __ATOMIC_ACQUIRE);
+
+	while(toggled) {
+		uint8_t bit = __builtin_ctz(toggled);
+		toggled &= toggled - 1;
+		if((head - tail) >= EVENT_QUEUE_SIZE) {
+			__atomic_fetch_add(&this->_events_dropped, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		Hook_Event *event = &this->_events[head & (EVENT_QUEUE_SIZE - 1)];
+		event->timestamp = timestamp;
+		event->line = (word * LINES_PER_WORD) + bit;
+		event->off_hook = (state >> bit) & 1;
+		head++;
+	}
+	/* Publish the new events */
+	__atomic_store_n(&this->_event_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Take the oldest hook change from the queue. Returns false if there are none.
+ */
+
+bool Line_Scan::get_event(Hook_Event *event) {
+	uint32_t tail = this->_event_tail;
+
+	if(tail == __atomic_load_n(&this->_event_head, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+	*event = this->_events[tail & (EVENT_QUEUE_SIZE - 1)];
+	__atomic_store_n(&this->_event_tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/*
+ * Debounced hook state of a line
+ */
+
+bool Line_Scan::off_hook(uint16_t line) {
+	if(line >= MAX_LINES) {
+		return false;
+	}
+	return (__atomic_load_n(&this->_state[line / LINES_PER_WORD], __ATOMIC_RELAXED) >> (line % LINES_PER_WORD)) & 1;
+}
+
+} /* End namespace Line_Scan */
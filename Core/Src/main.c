@@ -97,16 +97,6 @@ const osThreadAttr_t I2C_Task_attributes = {
   .stack_size = 256 * 4,
   .priority = (osPriority_t) osPriorityNormal,
 };
-/* Definitions for Queue_MF_buffer */
-osMessageQueueId_t Queue_MF_bufferHandle;
-const osMessageQueueAttr_t Queue_MF_buffer_attributes = {
-  .name = "Queue_MF_buffer"
-};
-/* Definitions for Queue_I2S_Audio */
-osMessageQueueId_t Queue_I2S_AudioHandle;
-const osMessageQueueAttr_t Queue_I2S_Audio_attributes = {
-  .name = "Queue_I2S_Audio"
-};
 /* Definitions for Queue_I2C_Busses */
 osMessageQueueId_t Queue_I2C_BussesHandle;
 const osMessageQueueAttr_t Queue_I2C_Busses_attributes = {
@@ -114,6 +104,10 @@ const osMessageQueueAttr_t Queue_I2C_Busses_attributes = {
 };
 /* USER CODE BEGIN PV */
 
+/* DMA half/full event counts. Incremented by the interrupts, which then set FRAME_EVENT_FLAG on the task.
+   The task works out which buffers are ready, and how many it missed, from the count */
+uint32_t MF_frame_sequence;
+uint32_t I2S_frame_sequence;
 
 /* USER CODE END PV */
 
@@ -200,12 +194,6 @@ int main(void)
   /* USER CODE END RTOS_TIMERS */
 
   /* Create the queue(s) */
-  /* creation of Queue_MF_buffer */
-  Queue_MF_bufferHandle = osMessageQueueNew (1, sizeof(uint8_t), &Queue_MF_buffer_attributes);
-
-  /* creation of Queue_I2S_Audio */
-  Queue_I2S_AudioHandle = osMessageQueueNew (1, sizeof(uint8_t), &Queue_I2S_Audio_attributes);
-
   /* creation of Queue_I2C_Busses */
   Queue_I2C_BussesHandle = osMessageQueueNew (4, sizeof(I2C_Queue_Message), &Queue_I2C_Busses_attributes);
 
@@ -695,26 +683,26 @@ static void MX_GPIO_Init(void)
 
 /* Called when the first half of the buffer is filled */
 void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef* hadc1) {
-	uint8_t msg = 0;
-	osMessageQueuePut(Queue_MF_bufferHandle, &msg, 0U, 0U); /* Send message to MF receiver task */
+	__atomic_fetch_add(&MF_frame_sequence, 1, __ATOMIC_RELEASE);
+	osThreadFlagsSet(MF_ReceiverHandle, FRAME_EVENT_FLAG); /* Wake the MF receiver task */
 }
 
 /* Called when the second half of the buffer is filled */
 void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef* hadc1) {
-	uint8_t msg = 1;
-	osMessageQueuePut(Queue_MF_bufferHandle, &msg, 0U, 0U); /* Send message to MF receiver task */
+	__atomic_fetch_add(&MF_frame_sequence, 1, __ATOMIC_RELEASE);
+	osThreadFlagsSet(MF_ReceiverHandle, FRAME_EVENT_FLAG); /* Wake the MF receiver task */
 }
 
 /* Called when the first half of the audio buffer has been transmitted */
 void HAL_I2S_TxHalfCpltCallback(I2S_HandleTypeDef *hi2s) {
-	uint8_t msg = 0;
-	osMessageQueuePut(Queue_I2S_AudioHandle, &msg, 0U, 0U); /* Send message to audio processing task */
+	__atomic_fetch_add(&I2S_frame_sequence, 1, __ATOMIC_RELEASE);
+	osThreadFlagsSet(I2sAudioHandle, FRAME_EVENT_FLAG); /* Wake the audio processing task */
 }
 
 /* Called when the second half of the audio buffer has been transmitted */
 void HAL_I2S_TxCpltCallback(I2S_HandleTypeDef *hi2s) {
-	uint8_t msg = 1;
-	osMessageQueuePut(Queue_I2S_AudioHandle, &msg, 0U, 0U); /* Send message to audio processing task */
+	__atomic_fetch_add(&I2S_frame_sequence, 1, __ATOMIC_RELEASE);
+	osThreadFlagsSet(I2sAudioHandle, FRAME_EVENT_FLAG); /* Wake the audio processing task */
 }
 
 /* Called when the I2C master transmission completes */
@@ -731,6 +719,7 @@ void HAL_I2C_MasterTxCpltCallback(I2C_HandleTypeDef *hi2c) {
 	msg.type = MSG_I2C_TX;
 	msg.handle = hi2c;
 	osMessageQueuePut(Queue_I2C_BussesHandle, &msg, 0U, 0U); /* Send message to I2C task */
+	osThreadFlagsSet(I2C_TaskHandle, I2C_EVENT_FLAG);
 
 }
 
@@ -748,6 +737,41 @@ void HAL_I2C_MasterRxCpltCallback(I2C_HandleTypeDef *hi2c) {
 	msg.type = MSG_I2C_RX;
 	msg.handle = hi2c;
 	osMessageQueuePut(Queue_I2C_BussesHandle, &msg, 0U, 0U); /* Send message to I2C task */
+	osThreadFlagsSet(I2C_TaskHandle, I2C_EVENT_FLAG);
+}
+
+/* Called when an I2C memory mode write (register address and data) completes */
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c) {
+	uint8_t bus;
+	I2C_Queue_Message msg;
+	if (hi2c == &hi2c1) {
+		bus = 0;
+	}
+	else {
+		bus = 1;
+	}
+	msg.bus = bus;
+	msg.type = MSG_I2C_TX;
+	msg.handle = hi2c;
+	osMessageQueuePut(Queue_I2C_BussesHandle, &msg, 0U, 0U); /* Send message to I2C task */
+	osThreadFlagsSet(I2C_TaskHandle, I2C_EVENT_FLAG);
+}
+
+/* Called when an I2C memory mode read (register address, repeated start and data) completes */
+void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c) {
+	uint8_t bus;
+	I2C_Queue_Message msg;
+	if (hi2c == &hi2c1) {
+		bus = 0;
+	}
+	else {
+		bus = 1;
+	}
+	msg.bus = bus;
+	msg.type = MSG_I2C_RX;
+	msg.handle = hi2c;
+	osMessageQueuePut(Queue_I2C_BussesHandle, &msg, 0U, 0U); /* Send message to I2C task */
+	osThreadFlagsSet(I2C_TaskHandle, I2C_EVENT_FLAG);
 }
 
 /* Called when an error occurs during an I2C transaction */
@@ -764,6 +788,7 @@ void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c) {
 	msg.type = MSG_I2C_ERR;
 	msg.handle = hi2c;
 	osMessageQueuePut(Queue_I2C_BussesHandle, &msg, 0U, 0U); /* Send message to I2C task */
+	osThreadFlagsSet(I2C_TaskHandle, I2C_EVENT_FLAG);
 }
 
 
@@ -803,15 +828,10 @@ void Task_MF_receiver(void *argument)
 {
   /* USER CODE BEGIN Task_MF_receiver */
   /* Infinite loop */
-  uint8_t msg;
   for(;;)
   {
-	osStatus_t status;
-	status = osMessageQueueGet(Queue_MF_bufferHandle, &msg, NULL, osWaitForever); /* Wait for message */
-	if(status == osOK) {
-		Top_process_MF_frame(msg);
-	}
-
+	osThreadFlagsWait(FRAME_EVENT_FLAG, osFlagsWaitAny, osWaitForever); /* Wait for the ADC DMA */
+	Top_process_MF_frame(__atomic_load_n(&MF_frame_sequence, __ATOMIC_ACQUIRE));
   }
   osThreadTerminate(NULL);
   /* USER CODE END Task_MF_receiver */
@@ -847,14 +867,10 @@ void Task_I2S_Audio(void *argument)
 {
   /* USER CODE BEGIN Task_I2S_Audio */
   /* Infinite loop */
-  uint8_t msg;
   for(;;)
   {
-	  osStatus_t status;
-	  status = osMessageQueueGet(Queue_I2S_AudioHandle, &msg, NULL, osWaitForever); /* Wait for message */
-	  if(status == osOK) {
-		  Top_send_I2S_Audio_Frame(msg);
-	  }
+	  osThreadFlagsWait(FRAME_EVENT_FLAG, osFlagsWaitAny, osWaitForever); /* Wait for the I2S DMA */
+	  Top_send_I2S_Audio_Frame(__atomic_load_n(&I2S_frame_sequence, __ATOMIC_ACQUIRE));
   }
   osThreadTerminate(NULL);
   /* USER CODE END Task_I2S_Audio */
@@ -2,6 +2,7 @@
 #include <math.h>
 #include "logging.h"
 #include "mf_decoder.h"
+#include "profiler.h"
 
 
 /* References:
@@ -17,8 +18,6 @@ namespace Mfd {
 /* MF receiver states */
 
 
-const float PI = 3.141529;
-
 const char *TAG = "mf_receiver";
 
 /* MF tones */
@@ -55,6 +54,9 @@ static const char digit_map[MF_DECODE_TABLE_SIZE] =          { '0',   '1',   '2'
 
 
 static const float frequencies[NUM_MF_FREQUENCIES] = {1700.0, 1500.0, 1300.0, 1100.0, 900.0, 700.0};
+static const uint32_t adc_channels[MF_MAX_RECEIVERS] = {ADC_CHANNEL_0, ADC_CHANNEL_1, ADC_CHANNEL_2};
+
+static_assert((MF_NUM_RECEIVERS > 0) && (MF_NUM_RECEIVERS <= MF_MAX_RECEIVERS), "MF_NUM_RECEIVERS out of range");
 
 
 
@@ -71,57 +73,87 @@ void MF_decoder::setup() {
 		this->_lock = osMutexNew(&mfd_mutex_attr);
 
 	/* Initialize the goertzel filter data */
-	for (int i = 0; i < NUM_MF_FREQUENCIES; i++) {
-		_goertzel_data[i].power = 0.0;
-    	_goertzel_data[i].coeff_k = 2.0 * cos((2.0 * PI * frequencies[i]) / MF_SAMPLE_RATE);
+	for (int receiver = 0; receiver < MF_NUM_RECEIVERS; receiver++) {
+		this->_goertzel[receiver].setup(frequencies, MF_SAMPLE_RATE);
+		this->_mf_data[receiver].state = MFR_IDLE;
+		this->_mf_data[receiver].descriptor = receiver + 1;
 	}
-	
+	this->_sampling_users = 0;
+
+	/* Scan convert one ADC input per receiver */
+	this->_configure_adc();
 
-    /* Start the DMA for the MF receiver */
+    /* Start the DMA for the MF receivers */
     HAL_ADC_Start_DMA(&hadc1, (uint32_t *) this->_mf_adc_buffer, MF_ADC_BUF_LEN);
 
 	
 }
 
 /*
-* Attempt to seize the MF receiver.
-* Will return a non zero positive number as a descriptor if successful.
-* Will return 0 on an error or if someone else has seized the MF receiver.
+* Set ADC1 up to convert the input for every receiver on each timer 3 trigger.
+*
+* At PCLK2/8 each 112 cycle conversion takes about 10uS, so up to 6 inputs fit in the 62.5uS sample period.
 */
 
-uint32_t MF_decoder::seize(void (*callback)(uint8_t error_code, uint8_t digit_count, char *data)) {
+void MF_decoder::_configure_adc(void) {
+	ADC_ChannelConfTypeDef channel_config = {0};
 
-	uint8_t descriptor = 1;
-	osMutexAcquire(this->_lock, osWaitForever);
-	if((callback) && (this->_mf_data.state == MFR_IDLE)) {
-		/* Start sending conversion requests to the ADC */
-		if (HAL_TIM_OC_Start(&htim3, TIM_CHANNEL_2) != HAL_OK) {
-			LOG_DEBUG(TAG, "Could not start timer 3 channel 2");
-			descriptor = 0;
-		}
+	hadc1.Init.ScanConvMode = (MF_NUM_RECEIVERS > 1) ? ENABLE : DISABLE;
+	hadc1.Init.NbrOfConversion = MF_NUM_RECEIVERS;
+	hadc1.Init.EOCSelection = (MF_NUM_RECEIVERS > 1) ? ADC_EOC_SEQ_CONV : ADC_EOC_SINGLE_CONV;
+	if (HAL_ADC_Init(&hadc1) != HAL_OK) {
+		LOG_ERROR(TAG, "Could not configure ADC scan mode");
+		return;
+	}
 
-		if (HAL_TIM_PWM_Start(&htim3, TIM_CHANNEL_1 ) != HAL_OK) {
-			LOG_DEBUG(TAG, "Could not start timer 3 channel 1");
-			descriptor = 0;
-		}
-		if(descriptor) {
-			this->_mf_data.callback = callback;
-			this->_mf_data.descriptor = descriptor;
-			this->_mf_data.error_code = 0;
-			this->_mf_data.tone_digit = false;
-			this->_mf_data.digit_count = 0;
-			this->_mf_data.tone_block_count = 0;
-			this->_mf_data.timer = 0;
-			this->_mf_data.state = MFR_WAIT_KP;
+	for (uint8_t receiver = 0; receiver < MF_NUM_RECEIVERS; receiver++) {
+		channel_config.Channel = adc_channels[receiver];
+		channel_config.Rank = receiver + 1;
+		channel_config.SamplingTime = ADC_SAMPLETIME_112CYCLES;
+		if (HAL_ADC_ConfigChannel(&hadc1, &channel_config) != HAL_OK) {
+			LOG_ERROR(TAG, "Could not configure ADC rank %u", receiver + 1);
 		}
 	}
-	else {
-		descriptor = 0; /* Seized by someone else, or null pointer passed in for callback */
-		if(!callback) {
-			LOG_DEBUG(TAG, "Null pointer passed in for callback function");
+}
+
+/*
+* Attempt to seize an MF receiver.
+* Will return a non zero positive number as a descriptor if successful.
+* Will return 0 on an error or if all the MF receivers are in use.
+*/
+
+uint32_t MF_decoder::seize(mfCallback callback) {
+
+	uint32_t descriptor = 0;
+
+	if(!callback) {
+		LOG_DEBUG(TAG, "Null pointer passed in for callback function");
+		return 0;
+	}
+
+	osMutexAcquire(this->_lock, osWaitForever);
+	for (uint8_t receiver = 0; receiver < MF_NUM_RECEIVERS; receiver++) {
+		if (this->_mf_data[receiver].state == MFR_IDLE) {
+			descriptor = receiver + 1;
+			break;
 		}
 	}
 
+	if (descriptor && !this->start_sampling()) {
+		descriptor = 0;
+	}
+
+	if(descriptor) {
+		mfData *mf_data = &this->_mf_data[descriptor - 1];
+		mf_data->callback = callback;
+		mf_data->error_code = 0;
+		mf_data->tone_digit = false;
+		mf_data->digit_count = 0;
+		mf_data->tone_block_count = 0;
+		mf_data->timer = 0;
+		mf_data->dc_level = 0.0;
+		mf_data->state = MFR_WAIT_KP;
+	}
 
   	osMutexRelease(this->_lock);
   	return descriptor;
@@ -129,7 +161,7 @@ uint32_t MF_decoder::seize(void (*callback)(uint8_t error_code, uint8_t digit_co
 
 
 /*
-* Release the MF receiver. Must be called outside of the callback or a deadlock will result.
+* Release an MF receiver. Must be called outside of the callback or a deadlock will result.
 *
 * Returns true if successful
 */
@@ -137,11 +169,55 @@ uint32_t MF_decoder::seize(void (*callback)(uint8_t error_code, uint8_t digit_co
 bool MF_decoder::release(uint32_t descriptor) {
 	bool res = true;
 	osMutexAcquire(this->_lock, osWaitForever);
-	if(descriptor != this->_mf_data.descriptor) {
+	if((descriptor == 0) || (descriptor > MF_NUM_RECEIVERS) || (this->_mf_data[descriptor - 1].state == MFR_IDLE)) {
 		res = false;
 	}
 	else {
-		/* Stop sending conversion requests to the ADC */
+		this->_mf_data[descriptor - 1].state = MFR_IDLE;
+		res = this->stop_sampling();
+	}
+
+	osMutexRelease(this->_lock);
+	return res;
+}
+
+/*
+* Start sending conversion requests to the ADC if nobody else has already.
+*
+* Returns true if successful
+*/
+
+bool MF_decoder::start_sampling(void) {
+	bool res = true;
+	osMutexAcquire(this->_lock, osWaitForever);
+	if (!this->_sampling_users) {
+		if (HAL_TIM_OC_Start(&htim3, TIM_CHANNEL_2) != HAL_OK) {
+			LOG_DEBUG(TAG, "Could not start timer 3 channel 2");
+			res = false;
+		}
+
+		if (HAL_TIM_PWM_Start(&htim3, TIM_CHANNEL_1 ) != HAL_OK) {
+			LOG_DEBUG(TAG, "Could not start timer 3 channel 1");
+			res = false;
+		}
+	}
+	if (res) {
+		this->_sampling_users++;
+	}
+	osMutexRelease(this->_lock);
+	return res;
+}
+
+/*
+* Stop sending conversion requests to the ADC once the last user is done with it.
+*
+* Returns true if successful
+*/
+
+bool MF_decoder::stop_sampling(void) {
+	bool res = true;
+	osMutexAcquire(this->_lock, osWaitForever);
+	if (this->_sampling_users && !--this->_sampling_users) {
 		if (HAL_TIM_PWM_Stop(&htim3, TIM_CHANNEL_1 ) != HAL_OK) {
 			LOG_DEBUG(TAG, "Could not stop timer 3 channel 1");
 			res = false;
@@ -151,92 +227,84 @@ bool MF_decoder::release(uint32_t descriptor) {
 			LOG_DEBUG(TAG, "Could not stop timer 3 channel 2");
 			res = false;
 		}
-
-		this->_mf_data.state = MFR_IDLE;
 	}
-
 	osMutexRelease(this->_lock);
 	return res;
 }
 
+/*
+* Run one receiver's samples from an interleaved frame through its goertzel tone decoders.
+*
+* Returns the MF tone code for the frame
+*/
 
-void MF_decoder::handle_buffer(uint8_t buffer_no) {
-	float max = 1.0;
-	float min = -1.0;
-	uint16_t *buffer = (buffer_no) ? this->_mf_adc_buffer + MF_FRAME_SIZE : this->_mf_adc_buffer;
+uint8_t MF_decoder::_detect_tones(uint8_t receiver, const uint16_t *frame) {
+	Goertzel::Bank<NUM_MF_FREQUENCIES> *goertzel = &this->_goertzel[receiver];
+	const uint16_t *buffer = frame + receiver;
+	float dc_level = this->_mf_data[receiver].dc_level;
+
+	/*
+	 * Single pass over the DMA buffer: each sample is converted to bipolar format,
+	 * has the tracked DC level removed, and is fed straight into the goertzel tone decoders.
+	 */
+	goertzel->clear();
+	goertzel->run_source([buffer, &dc_level](uint16_t sample_index) {
+		/* Center around 0 and scale to range -1 to 1 */
+		float val = (((float) buffer[sample_index * MF_NUM_RECEIVERS]) + MIN_ADC) * (1.0f / -MIN_ADC);
+
+		/* First order DC tracking filter, carried over from frame to frame */
+		dc_level += (val - dc_level) * DC_TRACKING_RATE;
+		return val - dc_level;
+	}, MF_FRAME_SIZE);
+	this->_mf_data[receiver].dc_level = dc_level;
 
-	/* HAL_GPIO_WritePin(LEDN_GPIO_Port, LEDN_Pin, GPIO_PIN_RESET); */
+	uint8_t mf_code = 0;
 
-	/* PASS 1: Convert to bipolar format, and record min and max values */
-	for (int sample_index = 0; sample_index < MF_FRAME_SIZE; sample_index++) {
-		/* center around 0 */
-		float val = ((float) buffer[sample_index]) + MIN_ADC;
+    /* Test to see if MF tone component is above the threshold */
+	for(uint8_t tone_index = 0; tone_index < NUM_MF_FREQUENCIES; tone_index++) {
 
-		/* Scale to range -1 to 1 */
-		val /= -MIN_ADC;
+		if (goertzel->magnitude(tone_index) > SILENCE_THRESHOLD) {
+			mf_code |= (1 << tone_index);
 
-		if (val > max) {
-			max = val;
-		}
-		if ( val < min ) {
-			min = val;
 		}
-		this->_goertzel_block[sample_index] = val;
-	}
-
-	/* PASS 2: Use the min and max values to remove any DC offset */
-	float dc_offset = (((1.0 - max)) - (1.0 - fabs(min)));
-
-	for (int sample_index = 0; sample_index < MF_FRAME_SIZE; sample_index++) {
-		this->_goertzel_block[sample_index] -= dc_offset;
 	}
+	return mf_code;
+}
 
-	/* PASS 3: Decode MF tones */
-
-	/* Clear previous values for all goertzel tone decoders */
-	for (int mf_freq_index = 0; mf_freq_index < NUM_MF_FREQUENCIES; mf_freq_index++) {
-		this->_goertzel_data[mf_freq_index].q1 = this->_goertzel_data[mf_freq_index].q2 = 0.0;
-	}
 
-    /* Go through the frame and calculate the goertzel data values */
-	for (int sample_index = 0; sample_index < MF_FRAME_SIZE; sample_index++) { 
-		register float s = this->_goertzel_block[sample_index];
-		for (int mf_freq_index = 0; mf_freq_index < NUM_MF_FREQUENCIES; mf_freq_index++) {
-			float q0 = this->_goertzel_data[mf_freq_index].coeff_k * this->_goertzel_data[mf_freq_index].q1 -
-					this->_goertzel_data[mf_freq_index].q2 + s;
-			this->_goertzel_data[mf_freq_index].q2 = this->_goertzel_data[mf_freq_index].q1;
-			this->_goertzel_data[mf_freq_index].q1 = q0;
+void MF_decoder::handle_buffer(uint8_t buffer_no) {
+	PROFILE_START(profile_start);
+	const uint16_t *frame = this->frame(buffer_no);
 
+	/* HAL_GPIO_WritePin(LEDN_GPIO_Port, LEDN_Pin, GPIO_PIN_RESET); */
 
+	for (uint8_t receiver = 0; receiver < MF_NUM_RECEIVERS; receiver++) {
+		/* Don't spend any time on idle receivers. A seizure racing with this check just starts a frame later. */
+		if (this->_mf_data[receiver].state == MFR_IDLE) {
+			continue;
+		}
 
+		uint8_t mf_code = this->_detect_tones(receiver, frame);
 
-		}
+		osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
+		this->_update_state(&this->_mf_data[receiver], mf_code);
+		osMutexRelease(this->_lock); /* Release the lock */
 	}
-	
-	/* Calculate power from the goertzel data values */
-	for (int mf_freq_index = 0; mf_freq_index < NUM_MF_FREQUENCIES; mf_freq_index++) {
-		this->_goertzel_data[mf_freq_index].power = sqrt(this->_goertzel_data[mf_freq_index].q1 * this->_goertzel_data[mf_freq_index].q1 +
-				this->_goertzel_data[mf_freq_index].q2 * this->_goertzel_data[mf_freq_index].q2 -
-				this->_goertzel_data[mf_freq_index].coeff_k * this->_goertzel_data[mf_freq_index].q1 * this->_goertzel_data[mf_freq_index].q2);
 
+	PROFILE_STOP(Profiler::PS_MF_HANDLE_BUFFER, profile_start);
+	/* HAL_GPIO_WritePin(LEDN_GPIO_Port, LEDN_Pin, GPIO_PIN_SET); */
+}
 
-	}
+/*
+* Advance a receiver's decoder state machine with the tone code from one frame.
+* Must be called with the lock held.
+*/
 
+void MF_decoder::_update_state(mfData *mf_data, uint8_t mf_code) {
 	/* Check for tones */
 	bool silence = false;
 	bool valid_code = false;
 
-	uint8_t mf_code = 0;
-
-
-    /* Test to see if MF tone component is above the threshold */
-	for(uint8_t tone_index = 0; tone_index < NUM_MF_FREQUENCIES; tone_index++) {
-
-		if (this->_goertzel_data[tone_index].power > SILENCE_THRESHOLD) {
-			mf_code |= (1 << tone_index);
-
-		}
-	}
 	/* Count the number of tones present */
 	uint8_t tones_present = 0;
 	for (uint8_t tone_index = 0; tone_index < NUM_MF_FREQUENCIES; tone_index++) {
@@ -256,44 +324,42 @@ void MF_decoder::handle_buffer(uint8_t buffer_no) {
 
 	/* Decoder state machine */
 
-	osMutexAcquire(this->_lock, osWaitForever); /* Get the lock */
-
-	switch(this->_mf_data.state) {
+	switch(mf_data->state) {
 		case MFR_IDLE:
 			break;
 
 		case MFR_WAIT_KP:
 			if (!silence && valid_code == true && mf_code == MFC_KP) {
-				if (this->_mf_data.tone_block_count >= MIN_KP_GATE_BLOCK_COUNT){
-					this->_mf_data.digit_count = 0;
-					this->_mf_data.digits[0] = '*'; /* Add KP to string */
-					this->_mf_data.digit_count++;
-					this->_mf_data.timer = 0;
-					this->_mf_data.state = MFR_KP_SILENCE;
+				if (mf_data->tone_block_count >= MIN_KP_GATE_BLOCK_COUNT){
+					mf_data->digit_count = 0;
+					mf_data->digits[0] = '*'; /* Add KP to string */
+					mf_data->digit_count++;
+					mf_data->timer = 0;
+					mf_data->state = MFR_KP_SILENCE;
 				}
 				else {
-					this->_mf_data.tone_block_count++;
+					mf_data->tone_block_count++;
 				}
 			}
 			break;
 
 		case MFR_KP_SILENCE:
 			if (silence) {
-				this->_mf_data.state = MFR_WAIT_DIGIT;
-				this->_mf_data.tone_block_count = 0;
-				this->_mf_data.timer = 0;
+				mf_data->state = MFR_WAIT_DIGIT;
+				mf_data->tone_block_count = 0;
+				mf_data->timer = 0;
 			}
 			else {
-				this->_mf_data.timer++;
-				if (this->_mf_data.timer >= MF_INTERDIGIT_TIMEOUT) {
-					this->_mf_data.state = MFR_TIMEOUT;
+				mf_data->timer++;
+				if (mf_data->timer >= MF_INTERDIGIT_TIMEOUT) {
+					mf_data->state = MFR_TIMEOUT;
 				}
 			}
 			break;
 
 		case MFR_WAIT_DIGIT:
 			if (!silence && valid_code == true) {
-				if (this->_mf_data.tone_block_count >= MIN_DIGIT_BLOCK_COUNT - 1) {
+				if (mf_data->tone_block_count >= MIN_DIGIT_BLOCK_COUNT - 1) {
 					uint8_t tone_number;
 					for (tone_number = 0; tone_number < MF_DECODE_TABLE_SIZE; tone_number++) {
 						if (mf_code == mf_decode_table[tone_number]) {
@@ -301,71 +367,71 @@ void MF_decoder::handle_buffer(uint8_t buffer_no) {
 						}
 					}
 					if (tone_number < MF_DECODE_TABLE_SIZE) {
-						this->_mf_data.tone_digit = digit_map[tone_number];
-						this->_mf_data.state = MFR_WAIT_DIGIT_SILENCE;
-						this->_mf_data.timer = 0;
+						mf_data->tone_digit = digit_map[tone_number];
+						mf_data->state = MFR_WAIT_DIGIT_SILENCE;
+						mf_data->timer = 0;
 					}
 				}
 				else {
-					this->_mf_data.tone_block_count++;
+					mf_data->tone_block_count++;
 				}
 			}
 			else {
-				this->_mf_data.timer++;
-				if (this->_mf_data.timer >= MF_INTERDIGIT_TIMEOUT) {
-					this->_mf_data.state = MFR_TIMEOUT;
+				mf_data->timer++;
+				if (mf_data->timer >= MF_INTERDIGIT_TIMEOUT) {
+					mf_data->state = MFR_TIMEOUT;
 				}
 			}
 			break;
 
 		case MFR_WAIT_DIGIT_SILENCE:
 			if (silence) {
-				if ((this->_mf_data.tone_digit != '#') && /* If not an ST of some type */
-						(this->_mf_data.tone_digit != 'A') &&
-						(this->_mf_data.tone_digit != 'B') &&
-						(this->_mf_data.tone_digit != 'C')) {
+				if ((mf_data->tone_digit != '#') && /* If not an ST of some type */
+						(mf_data->tone_digit != 'A') &&
+						(mf_data->tone_digit != 'B') &&
+						(mf_data->tone_digit != 'C')) {
 
 
-					this->_mf_data.tone_block_count = 0;
-					this->_mf_data.timer = 0;
-					if (this->_mf_data.digit_count < MF_MAX_DIGITS) {
-						this->_mf_data.digits[this->_mf_data.digit_count++] = this->_mf_data.tone_digit;
+					mf_data->tone_block_count = 0;
+					mf_data->timer = 0;
+					if (mf_data->digit_count < MF_MAX_DIGITS) {
+						mf_data->digits[mf_data->digit_count++] = mf_data->tone_digit;
 					}
 					/* Wait for next digit */
-					this->_mf_data.state = MFR_WAIT_DIGIT;
+					mf_data->state = MFR_WAIT_DIGIT;
 				}
 				else {
 					/* Add the ST, STP, ST2P, or ST3P character to the end of the digit string */
-					if (this->_mf_data.digit_count < MF_MAX_DIGITS){
-						this->_mf_data.digits[this->_mf_data.digit_count++] = this->_mf_data.tone_digit;
+					if (mf_data->digit_count < MF_MAX_DIGITS){
+						mf_data->digits[mf_data->digit_count++] = mf_data->tone_digit;
 					}
 					/* Terminate the digit string */
-					if (this->_mf_data.digit_count < MF_MAX_DIGITS){
-						this->_mf_data.digits[this->_mf_data.digit_count] = 0;
+					if (mf_data->digit_count < MF_MAX_DIGITS){
+						mf_data->digits[mf_data->digit_count] = 0;
 					}
 					else {
-						this->_mf_data.digits[MF_MAX_DIGITS-1] = 0;
+						mf_data->digits[MF_MAX_DIGITS-1] = 0;
 					}
-					this->_mf_data.state = MFR_DONE;
+					mf_data->state = MFR_DONE;
 				}
 			}
 			else {
-				this->_mf_data.timer++;
-				if (this->_mf_data.timer >= MF_INTERDIGIT_TIMEOUT) {
-					this->_mf_data.state = MFR_TIMEOUT;
+				mf_data->timer++;
+				if (mf_data->timer >= MF_INTERDIGIT_TIMEOUT) {
+					mf_data->state = MFR_TIMEOUT;
 				}
 			}
 			break;
 
 		case MFR_TIMEOUT:
-			this->_mf_data.error_code = MFE_TIMEOUT;
-			this->_mf_data.state = MFR_DONE;
+			mf_data->error_code = MFE_TIMEOUT;
+			mf_data->state = MFR_DONE;
 			break;
 
 		case MFR_DONE:
 			/* Call the user's callback function */
-			(*this->_mf_data.callback)(this->_mf_data.error_code, this->_mf_data.digit_count, this->_mf_data.digits);
-			this->_mf_data.state = MFR_WAIT_RELEASE;
+			(*mf_data->callback)(mf_data->descriptor, mf_data->error_code, mf_data->digit_count, mf_data->digits);
+			mf_data->state = MFR_WAIT_RELEASE;
 			break;
 
 		case MFR_WAIT_RELEASE:
@@ -373,15 +439,12 @@ void MF_decoder::handle_buffer(uint8_t buffer_no) {
 
 
 		default:
-			this->_mf_data.state = MFR_DONE;
+			mf_data->state = MFR_DONE;
 			break;
 
 
 
 	}
-	osMutexRelease(this->_lock); /* Release the lock */
-
-	/* HAL_GPIO_WritePin(LEDN_GPIO_Port, LEDN_Pin, GPIO_PIN_SET); */
 }
 
 } // End Namespace MFR
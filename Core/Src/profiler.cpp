@@ -0,0 +1,178 @@
+#include "top.h"
+#include "profiler.h"
+#include "logging.h"
+#include "audio.h"
+
+/*
+ * Execution time profiler
+ *
+ * On the target, times are measured in CPU cycles using the Cortex-M4 DWT cycle counter.
+ * On the host build, times are measured in nanoseconds using clock_gettime().
+ *
+ * Each site is only ever recorded from one task, so no locking is done here.
+ * A dump or reset running concurrently with a record may see one sample torn.
+ */
+
+namespace Profiler {
+
+static const char *TAG = "profiler";
+
+static const char *site_names[PS_MAX_SITES] = {
+	"request_block",
+	"handle_buffer",
+	"dtmf_buffer",
+	"i2c_idle",
+	"i2c_read_reg",
+	"i2c_rd_wait_rcv",
+	"i2c_write_reg",
+	"i2c_wr_wait_xmit",
+	"i2c_finish",
+	"line_scan"
+};
+
+/*
+ * Called once during initialization to start the cycle counter
+ */
+
+void Profiler::setup(void) {
+#ifndef HOST_BUILD
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+	this->reset();
+	this->_dump_step = DUMP_IDLE;
+}
+
+/*
+ * Return the number of ticks per second
+ */
+
+uint32_t Profiler::tick_hz(void) {
+#ifdef HOST_BUILD
+	return 1000000000UL;
+#else
+	return SystemCoreClock;
+#endif
+}
+
+/*
+ * Clear all the statistics
+ */
+
+void Profiler::reset(void) {
+	memset(this->_stats, 0, sizeof(this->_stats));
+}
+
+/*
+ * Record one measurement for a site
+ */
+
+void Profiler::record(uint8_t site, uint32_t ticks) {
+	if(site >= PS_MAX_SITES) {
+		return;
+	}
+	SiteStats *s = &this->_stats[site];
+
+	if((!s->count) || (ticks < s->min)) {
+		s->min = ticks;
+	}
+	if(ticks > s->max) {
+		s->max = ticks;
+	}
+	s->total += ticks;
+	s->count++;
+
+	/* Log2 histogram bucket */
+	uint8_t bucket = 0;
+	if(ticks >> HISTOGRAM_MIN_BIT) {
+		bucket = (31 - __builtin_clz(ticks)) - HISTOGRAM_MIN_BIT + 1;
+		if(bucket >= HISTOGRAM_BUCKETS) {
+			bucket = HISTOGRAM_BUCKETS - 1;
+		}
+	}
+	s->histogram[bucket]++;
+}
+
+/*
+ * Request the statistics be written to the log.
+ * The dump is done a line at a time from loop() so the logging queue does not overflow.
+ */
+
+void Profiler::request_dump(bool reset_after) {
+	this->_reset_after_dump = reset_after;
+	this->_dump_step = 1;
+}
+
+/*
+ * Write a single line of the dump. Returns false if there was nothing to write for this step.
+ *
+ * Step 1 is the header, then each site takes 2 steps: statistics, then histogram.
+ */
+
+bool Profiler::_dump_line(uint8_t step) {
+	/* The budget is one audio frame */
+	uint32_t budget = (uint32_t) (((uint64_t) this->tick_hz() * Audio::FRAME_MS) / 1000);
+
+	if(step == 1) {
+		LOG_INFO(TAG, "Ticks/sec: %lu, %umS frame budget: %lu ticks", this->tick_hz(), Audio::FRAME_MS, budget);
+		return true;
+	}
+
+	uint8_t site = (step - 2) >> 1;
+	SiteStats *s = &this->_stats[site];
+	if(!s->count) {
+		return false;
+	}
+
+	if(!((step - 2) & 1)) {
+		uint32_t mean = (uint32_t) (s->total / s->count);
+		uint32_t max_pct = (uint32_t) (((uint64_t) s->max * 10000) / budget);
+		LOG_INFO(TAG, "%s n:%lu min:%lu avg:%lu max:%lu (%lu.%02lu%%)", site_names[site],
+				s->count, s->min, mean, s->max, max_pct / 100, max_pct % 100);
+	}
+	else {
+		char hist[MAX_HISTOGRAM_TEXT];
+		int len = 0;
+		for(uint8_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+			uint32_t pct = (uint32_t) (((uint64_t) s->histogram[bucket] * 100) / s->count);
+			len += snprintf(hist + len, sizeof(hist) - len, (bucket ? ",%lu" : "%lu"), pct);
+			if(len >= (int) sizeof(hist)) {
+				break;
+			}
+		}
+		LOG_INFO(TAG, "%s hist%% 2^%u+: %s", site_names[site], HISTOGRAM_MIN_BIT, hist);
+	}
+	return true;
+}
+
+/*
+ * Called repeatedly from the console task. Writes at most one line of a pending dump per call.
+ */
+
+void Profiler::loop(void) {
+	uint8_t step = this->_dump_step;
+
+	if(step == DUMP_IDLE) {
+		return;
+	}
+
+	/* Skip over sites without any measurements */
+	while((step < (2 + (2 * PS_MAX_SITES))) && (!this->_dump_line(step))) {
+		step++;
+	}
+
+	if(step >= (1 + (2 * PS_MAX_SITES))) {
+		if(this->_reset_after_dump) {
+			this->reset();
+		}
+		this->_dump_step = DUMP_IDLE;
+	}
+	else {
+		this->_dump_step = step + 1;
+	}
+}
+
+} /* End namespace Profiler */
+
+Profiler::Profiler Prof;
@@ -138,7 +138,14 @@ void HAL_ADC_MspInit(ADC_HandleTypeDef* hadc)
     __HAL_LINKDMA(hadc,DMA_Handle,hdma_adc1);
 
   /* USER CODE BEGIN ADC1_MspInit 1 */
-
+    /* Inputs for the additional MF receivers
+    PA1     ------> ADC1_IN1
+    PA2     ------> ADC1_IN2
+    */
+    GPIO_InitStruct.Pin = MF_DECODER_ADC2_Pin|MF_DECODER_ADC3_Pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_ANALOG;
+    GPIO_InitStruct.Pull = GPIO_NOPULL;
+    HAL_GPIO_Init(MF_DECODER_ADC2_GPIO_Port, &GPIO_InitStruct);
   /* USER CODE END ADC1_MspInit 1 */
   }
 
@@ -168,6 +175,7 @@ void HAL_ADC_MspDeInit(ADC_HandleTypeDef* hadc)
     /* ADC1 DMA DeInit */
     HAL_DMA_DeInit(hadc->DMA_Handle);
   /* USER CODE BEGIN ADC1_MspDeInit 1 */
+    HAL_GPIO_DeInit(MF_DECODER_ADC2_GPIO_Port, MF_DECODER_ADC2_Pin|MF_DECODER_ADC3_Pin);
 
   /* USER CODE END ADC1_MspDeInit 1 */
   }
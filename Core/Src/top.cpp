@@ -8,9 +8,12 @@
  */
 #include "console.h"
 #include "mf_decoder.h"
+#include "dtmf_decoder.h"
 #include "audio.h"
 #include "i2c_engine.h"
+#include "line_scan.h"
 #include "util.h"
+#include "profiler.h"
 #include "uart.h"
 #include "city_ring.h"
 
@@ -18,14 +21,19 @@
 static const char *TAG = "top";
 static const uint8_t UART_RX_BUFFER_SIZE = 32;
 static volatile char rx_buffer_uart6[UART_RX_BUFFER_SIZE];
+static uint32_t mf_frame_sequence; /* Last ADC DMA event processed by the MF receiver task */
+static uint32_t mf_frames_skipped; /* ADC frames overwritten before the MF receiver task got to them */
+static uint32_t mf_frames_skipped_reported;
 
 /*
  * Class instantiations
  */
 Console::Console Con;
 Mfd::MF_decoder Mfr;
+Dtmfd::DTMF_decoder Dtmfr;
 Audio::Audio Aud;
 I2C_Engine::I2C_Engine I2c;
+Line_Scan::Line_Scan Lines;
 Util::Util Utility;
 Uart_Rx::Uart_Rx Uart;
 
@@ -37,28 +45,44 @@ Uart_Rx::Uart_Rx Uart;
 
 
 void Top_init(void) {
+	Prof.setup();
 	Con.setup();
 	Mfr.setup();
+	Dtmfr.setup(&Mfr);
 	Aud.setup();
 	I2c.setup();
+	Lines.setup();
 
 }
 
 /*
- * Called when there is an MF frame to process
+ * Called when there is an MF frame to process. The DTMF receivers use the same ADC frames.
+ *
+ * The sequence number is the count of ADC DMA events. Event n filled buffer half (n - 1) & 1.
+ * Only the latest half is still intact, so any earlier events not seen are counted as skipped.
  */
 
-void Top_process_MF_frame(uint8_t buffer_number) {
+void Top_process_MF_frame(uint32_t sequence) {
+	uint32_t pending = sequence - mf_frame_sequence;
+
+	if(!pending) {
+		return; /* Already handled on an earlier wakeup */
+	}
+	mf_frame_sequence = sequence;
+	mf_frames_skipped += pending - 1;
+
+	uint8_t buffer_number = (sequence - 1) & 1;
 	Mfr.handle_buffer(buffer_number);
+	Dtmfr.handle_buffer(buffer_number);
 
 }
 
 /*
- * Called when we have to send an I2S audio frame
+ * Called when we have to send I2S audio frames. The sequence number is the count of I2S DMA events.
  */
 
-void Top_send_I2S_Audio_Frame(uint8_t buffer_number){
-	Aud.request_block(buffer_number);
+void Top_send_I2S_Audio_Frame(uint32_t sequence){
+	Aud.render_segments(sequence);
 }
 
 /*
@@ -91,7 +115,7 @@ typedef struct mf_test_obj {
 mf_test_obj mf_test;
 
 
-void mf_receiver_callback(uint8_t error_code, uint8_t digit_count, char *data) {
+void mf_receiver_callback(uint32_t descriptor, uint8_t error_code, uint8_t digit_count, char *data) {
 	mf_test.error_code = error_code;
 	mf_test.digit_count = digit_count;
 	strncpy(mf_test.digits, data, Mfd::MF_MAX_DIGITS);
@@ -109,6 +133,16 @@ void Top_switch_task(void) {
 
 	osDelay(50);
 
+	/* Audio completion callbacks run here, out of the I2S task */
+	Aud.dispatch_completions();
+
+	/* Debounce the line card ports and pick up the hook changes */
+	Lines.scan();
+	Line_Scan::Hook_Event hook_event;
+	while(Lines.get_event(&hook_event)) {
+		LOG_INFO(TAG, "Line %u %s at %lu", hook_event.line, hook_event.off_hook ? "off hook" : "on hook", hook_event.timestamp);
+	}
+
 	if(!audio_seized) {
 		audio_seized = true;
 		ch[0] = Aud.seize();
@@ -153,6 +187,11 @@ void Top_switch_task(void) {
 
 void Top_console_task(void) {
 	Con.loop();
+	Aud.report_deadlines();
+	if(mf_frames_skipped != mf_frames_skipped_reported) {
+		mf_frames_skipped_reported = mf_frames_skipped;
+		LOG_WARN(TAG, "MF receiver skipped frames: %lu", mf_frames_skipped_reported);
+	}
 }
 
 
@@ -0,0 +1,9 @@
+/*
+ * cmsis_os.h
+ *
+ * Host (Linux) stand-in for the CMSIS-RTOS wrapper header.
+ */
+
+#pragma once
+
+#include "cmsis_os2.h"
@@ -0,0 +1,127 @@
+/*
+ * cmsis_os2.h
+ *
+ * Host (Linux) stand-in for the CMSIS-RTOS v2 API.
+ *
+ * Backed by POSIX threads. Only the subset of the API used by the application code
+ * is provided. Thread priorities are accepted but ignored. See cmsis_os2_posix.cpp.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define osWaitForever 0xFFFFFFFFU
+
+#define osFlagsWaitAny 0x00000000U
+#define osFlagsWaitAll 0x00000001U
+#define osFlagsNoClear 0x00000002U
+
+#define osFlagsError 0x80000000U
+#define osFlagsErrorUnknown 0xFFFFFFFFU
+#define osFlagsErrorTimeout 0xFFFFFFFEU
+#define osFlagsErrorResource 0xFFFFFFFDU
+#define osFlagsErrorParameter 0xFFFFFFFCU
+
+typedef enum {
+	osOK = 0,
+	osError = -1,
+	osErrorTimeout = -2,
+	osErrorResource = -3,
+	osErrorParameter = -4,
+	osErrorNoMemory = -5,
+	osErrorISR = -6,
+	osStatusReserved = 0x7FFFFFFF
+} osStatus_t;
+
+typedef enum {
+	osPriorityNone = 0,
+	osPriorityIdle = 1,
+	osPriorityLow = 8,
+	osPriorityBelowNormal = 16,
+	osPriorityNormal = 24,
+	osPriorityAboveNormal = 32,
+	osPriorityHigh = 40,
+	osPriorityRealtime = 48,
+	osPriorityISR = 56,
+	osPriorityError = -1,
+	osPriorityReserved = 0x7FFFFFFF
+} osPriority_t;
+
+typedef void (*osThreadFunc_t)(void *argument);
+
+typedef void *osThreadId_t;
+typedef void *osMutexId_t;
+typedef void *osMessageQueueId_t;
+
+#define osMutexRecursive 0x00000001U
+#define osMutexPrioInherit 0x00000002U
+#define osMutexRobust 0x00000008U
+
+typedef struct {
+	const char *name;
+	uint32_t attr_bits;
+	void *cb_mem;
+	uint32_t cb_size;
+	void *stack_mem;
+	uint32_t stack_size;
+	osPriority_t priority;
+	uint32_t tz_module;
+	uint32_t reserved;
+} osThreadAttr_t;
+
+typedef struct {
+	const char *name;
+	uint32_t attr_bits;
+	void *cb_mem;
+	uint32_t cb_size;
+} osMutexAttr_t;
+
+typedef struct {
+	const char *name;
+	uint32_t attr_bits;
+	void *cb_mem;
+	uint32_t cb_size;
+	void *mq_mem;
+	uint32_t mq_size;
+} osMessageQueueAttr_t;
+
+/* Kernel */
+osStatus_t osKernelInitialize(void);
+osStatus_t osKernelStart(void);
+uint32_t osKernelGetTickCount(void);
+uint32_t osKernelGetTickFreq(void);
+
+/* Threads */
+osThreadId_t osThreadNew(osThreadFunc_t func, void *argument, const osThreadAttr_t *attr);
+osThreadId_t osThreadGetId(void);
+osStatus_t osThreadYield(void);
+void osThreadExit(void);
+osStatus_t osThreadTerminate(osThreadId_t thread_id);
+osStatus_t osDelay(uint32_t ticks);
+
+/* Thread flags */
+uint32_t osThreadFlagsSet(osThreadId_t thread_id, uint32_t flags);
+uint32_t osThreadFlagsClear(uint32_t flags);
+uint32_t osThreadFlagsWait(uint32_t flags, uint32_t options, uint32_t timeout);
+
+/* Mutexes */
+osMutexId_t osMutexNew(const osMutexAttr_t *attr);
+osStatus_t osMutexAcquire(osMutexId_t mutex_id, uint32_t timeout);
+osStatus_t osMutexRelease(osMutexId_t mutex_id);
+
+/* Message queues */
+osMessageQueueId_t osMessageQueueNew(uint32_t msg_count, uint32_t msg_size, const osMessageQueueAttr_t *attr);
+osStatus_t osMessageQueuePut(osMessageQueueId_t mq_id, const void *msg_ptr, uint8_t msg_prio, uint32_t timeout);
+osStatus_t osMessageQueueGet(osMessageQueueId_t mq_id, void *msg_ptr, uint8_t *msg_prio, uint32_t timeout);
+uint32_t osMessageQueueGetCount(osMessageQueueId_t mq_id);
+uint32_t osMessageQueueGetSpace(osMessageQueueId_t mq_id);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,17 @@
+/*
+ * g711.h
+ *
+ * G.711 mu-law and A-law encoders for the host tooling. The matching decoders are the
+ * expansion tables built by the audio renderer.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace G711 {
+
+uint8_t linear_to_ulaw(int16_t sample);
+uint8_t linear_to_alaw(int16_t sample);
+
+} /* End namespace G711 */
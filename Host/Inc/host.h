@@ -0,0 +1,21 @@
+/*
+ * host.h
+ *
+ * Host (Linux) build glue. Stands in for the parts of main.c which create the
+ * peripheral handles, the RTOS queues, the DMA event counts, and the HAL interrupt callbacks.
+ */
+
+#pragma once
+
+#include "main.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern void Host_init(void);
+extern void Host_drain_log(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,226 @@
+/*
+ * stm32f4xx_hal.h
+ *
+ * Host (Linux) stand-in for the STM32F4 HAL.
+ *
+ * Only the handle types, constants and functions used by the application code in Core/
+ * are provided. Peripherals are simulated just far enough for the audio, MF decoder and
+ * I2C engine classes to run on a workstation. See hal_stub.cpp.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	HAL_OK = 0x00U,
+	HAL_ERROR = 0x01U,
+	HAL_BUSY = 0x02U,
+	HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+#define HAL_MAX_DELAY 0xFFFFFFFFU
+
+#define DISABLE 0U
+#define ENABLE 1U
+
+#define SET_BIT(REG, BIT) ((REG) |= (BIT))
+#define CLEAR_BIT(REG, BIT) ((REG) &= ~(BIT))
+
+/* GPIO */
+
+typedef struct {
+	uint32_t ODR;
+	uint32_t IDR;
+} GPIO_TypeDef;
+
+typedef enum {
+	GPIO_PIN_RESET = 0,
+	GPIO_PIN_SET
+} GPIO_PinState;
+
+extern GPIO_TypeDef Host_GPIOA, Host_GPIOB, Host_GPIOC;
+#define GPIOA (&Host_GPIOA)
+#define GPIOB (&Host_GPIOB)
+#define GPIOC (&Host_GPIOC)
+
+#define GPIO_PIN_0 ((uint16_t)0x0001)
+#define GPIO_PIN_1 ((uint16_t)0x0002)
+#define GPIO_PIN_2 ((uint16_t)0x0004)
+#define GPIO_PIN_3 ((uint16_t)0x0008)
+#define GPIO_PIN_4 ((uint16_t)0x0010)
+#define GPIO_PIN_5 ((uint16_t)0x0020)
+#define GPIO_PIN_6 ((uint16_t)0x0040)
+#define GPIO_PIN_7 ((uint16_t)0x0080)
+#define GPIO_PIN_13 ((uint16_t)0x2000)
+#define GPIO_PIN_15 ((uint16_t)0x8000)
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+
+/* DMA */
+
+typedef struct {
+	uint32_t NDTR; /* Simulated remaining transfer count */
+} DMA_Stream_TypeDef;
+
+typedef enum {
+	MEMORY0 = 0x00U,
+	MEMORY1 = 0x01U
+} HAL_DMA_MemoryTypeDef;
+
+typedef struct __DMA_HandleTypeDef {
+	DMA_Stream_TypeDef *Instance;
+	void (*XferCpltCallback)(struct __DMA_HandleTypeDef *hdma);
+	void (*XferM1CpltCallback)(struct __DMA_HandleTypeDef *hdma);
+	void (*XferErrorCallback)(struct __DMA_HandleTypeDef *hdma);
+	DMA_Stream_TypeDef Host_Stream;
+	uintptr_t Host_Memory[2]; /* Double buffer mode memory addresses */
+	uint32_t Host_Length;
+	uint8_t Host_Current_Memory;
+	uint32_t Host_Running;
+} DMA_HandleTypeDef;
+
+#define __HAL_DMA_GET_COUNTER(__HANDLE__) ((__HANDLE__)->Instance->NDTR)
+
+/* Addresses are pointer sized on the host, uint32_t on the target */
+HAL_StatusTypeDef HAL_DMAEx_MultiBufferStart_IT(DMA_HandleTypeDef *hdma, uintptr_t SrcAddress, uintptr_t DstAddress, uintptr_t SecondMemAddress, uint32_t DataLength);
+HAL_StatusTypeDef HAL_DMAEx_ChangeMemory(DMA_HandleTypeDef *hdma, uintptr_t Address, HAL_DMA_MemoryTypeDef memory);
+
+/* ADC */
+
+#define ADC_CHANNEL_0 0x00000000U
+#define ADC_CHANNEL_1 0x00000001U
+#define ADC_CHANNEL_2 0x00000002U
+#define ADC_SAMPLETIME_112CYCLES 0x00000006U
+#define ADC_EOC_SEQ_CONV 0x00000000U
+#define ADC_EOC_SINGLE_CONV 0x00000001U
+
+typedef struct {
+	uint32_t ScanConvMode;
+	uint32_t NbrOfConversion;
+	uint32_t EOCSelection;
+} ADC_InitTypeDef;
+
+typedef struct {
+	uint32_t Channel;
+	uint32_t Rank;
+	uint32_t SamplingTime;
+} ADC_ChannelConfTypeDef;
+
+typedef struct {
+	ADC_InitTypeDef Init;
+	DMA_HandleTypeDef *DMA_Handle;
+	uint32_t *Host_Buffer;
+	uint32_t Host_Length;
+	uint32_t Host_Running;
+	uint32_t Host_Channels[16]; /* Channel converted at each rank */
+} ADC_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_ADC_Init(ADC_HandleTypeDef *hadc);
+HAL_StatusTypeDef HAL_ADC_ConfigChannel(ADC_HandleTypeDef *hadc, ADC_ChannelConfTypeDef *sConfig);
+HAL_StatusTypeDef HAL_ADC_Start_DMA(ADC_HandleTypeDef *hadc, uint32_t *pData, uint32_t Length);
+HAL_StatusTypeDef HAL_ADC_Stop_DMA(ADC_HandleTypeDef *hadc);
+void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef *hadc);
+void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *hadc);
+
+/* Timers */
+
+#define TIM_CHANNEL_1 0x00000000U
+#define TIM_CHANNEL_2 0x00000004U
+
+typedef struct {
+	uint32_t Host_Channels_Running;
+} TIM_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_TIM_OC_Start(TIM_HandleTypeDef *htim, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_OC_Stop(TIM_HandleTypeDef *htim, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef *htim, uint32_t Channel);
+HAL_StatusTypeDef HAL_TIM_PWM_Stop(TIM_HandleTypeDef *htim, uint32_t Channel);
+
+/* I2S */
+
+typedef struct {
+	uint32_t CR1;
+	uint32_t CR2;
+	uint32_t SR;
+	uint32_t DR;
+	uint32_t I2SCFGR;
+} SPI_TypeDef;
+
+#define SPI_CR2_TXDMAEN (1U << 1)
+#define SPI_I2SCFGR_I2SE (1U << 10)
+#define __HAL_I2S_ENABLE(__HANDLE__) (SET_BIT((__HANDLE__)->Instance->I2SCFGR, SPI_I2SCFGR_I2SE))
+
+typedef struct {
+	SPI_TypeDef *Instance;
+	DMA_HandleTypeDef *hdmatx;
+	uint16_t *Host_Buffer;
+	uint16_t Host_Size;
+	uint32_t Host_Running;
+} I2S_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_I2S_Transmit_DMA(I2S_HandleTypeDef *hi2s, uint16_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_I2S_DMAStop(I2S_HandleTypeDef *hi2s);
+void HAL_I2S_TxHalfCpltCallback(I2S_HandleTypeDef *hi2s);
+void HAL_I2S_TxCpltCallback(I2S_HandleTypeDef *hi2s);
+
+/* Simulate the DMA finishing the segment it is playing and moving on to the next */
+void Host_I2S_Segment_Played(I2S_HandleTypeDef *hi2s);
+
+/* I2C */
+
+#define HAL_I2C_ERROR_NONE 0x00000000U
+#define HAL_I2C_ERROR_BERR 0x00000001U
+#define HAL_I2C_ERROR_ARLO 0x00000002U
+#define HAL_I2C_ERROR_AF 0x00000004U
+
+#define I2C_MEMADD_SIZE_8BIT 0x00000001U
+#define I2C_MEMADD_SIZE_16BIT 0x00000010U
+
+#define HOST_I2C_NUM_ADDRESSES 128
+#define HOST_I2C_NUM_REGISTERS 256
+
+typedef struct {
+	uint32_t ErrorCode;
+	/* Simulated bus: a register file for each 7 bit address, and a present flag. Memory mode transfers use the low 8 bits of the register address */
+	uint8_t Host_Present[HOST_I2C_NUM_ADDRESSES];
+	uint8_t Host_Registers[HOST_I2C_NUM_ADDRESSES][HOST_I2C_NUM_REGISTERS];
+	uint8_t Host_Register_Pointer[HOST_I2C_NUM_ADDRESSES];
+	uint32_t Host_Transfer_Count;
+} I2C_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_I2C_Master_Transmit_DMA(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_I2C_Master_Receive_DMA(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_I2C_Mem_Write_DMA(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress, uint16_t MemAddSize, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_I2C_Mem_Read_DMA(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress, uint16_t MemAddSize, uint8_t *pData, uint16_t Size);
+void HAL_I2C_MasterTxCpltCallback(I2C_HandleTypeDef *hi2c);
+void HAL_I2C_MasterRxCpltCallback(I2C_HandleTypeDef *hi2c);
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c);
+void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c);
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c);
+
+/* UART */
+
+typedef struct {
+	uint32_t DR;
+} USART_TypeDef;
+
+typedef struct {
+	USART_TypeDef *Instance;
+} UART_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size, uint32_t Timeout);
+
+/* Host simulation helpers */
+
+void Host_I2C_Attach_Device(I2C_HandleTypeDef *hi2c, uint8_t device_address);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,1103 @@
+/*
+ * bench.cpp
+ *
+ * Host benchmark for the audio renderer, the MF and DTMF decoders, the I2C engine and the line scanner.
+ *
+ * Each section drives the class the same way its RTOS task would on the target,
+ * under a sustained synthetic load, and reports the time per call against the
+ * audio frame budget.
+ *
+ * Usage: mockingbird_bench [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "host.h"
+#include "audio.h"
+#include "mf_decoder.h"
+#include "dtmf_decoder.h"
+#include "i2c_engine.h"
+#include "line_scan.h"
+#include "profiler.h"
+#include "g711.h"
+
+static const uint32_t FRAME_BUDGET_NS = Audio::FRAME_MS * 1000000UL;
+static const uint32_t DEFAULT_FRAMES = 5000;
+
+Audio::Audio Aud;
+Mfd::MF_decoder Mfr;
+Dtmfd::DTMF_decoder Dtmfr;
+I2C_Engine::I2C_Engine I2c;
+Line_Scan::Line_Scan Lines;
+
+/*
+ * Simple min/max/mean accumulator for the per-call timings
+ */
+
+typedef struct BenchStats {
+	const char *name;
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+} BenchStats;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void stats_add(BenchStats *s, uint64_t ns) {
+	if (!s->count || ns < s->min_ns) {
+		s->min_ns = ns;
+	}
+	if (ns > s->max_ns) {
+		s->max_ns = ns;
+	}
+	s->total_ns += ns;
+	s->count++;
+}
+
+static void stats_print(const BenchStats *s) {
+	double mean = s->count ? (double) s->total_ns / s->count : 0.0;
+	printf("%-24s calls: %8llu  min: %8llu ns  mean: %10.1f ns  max: %8llu ns  budget used: %6.3f%%\n",
+			s->name, (unsigned long long) s->count, (unsigned long long) s->min_ns, mean,
+			(unsigned long long) s->max_ns, (100.0 * mean) / FRAME_BUDGET_NS);
+}
+
+/*
+ * Audio: every channel busy. Call progress tones, a looped sample, and MF and
+ * DTMF senders which are restarted as soon as they finish, mixed onto both slots.
+ */
+
+static uint32_t audio_sends_completed;
+static int16_t audio_loop_sample[1000];
+static uint32_t audio_late_renders;
+
+/*
+ * Play out the segment the I2S DMA is on, and return the segment it freed for the audio task.
+ * The DMA was started once, with the event count at zero.
+ */
+
+static uint8_t audio_next_segment(void) {
+	Host_I2S_Segment_Played(&hi2s2);
+	return (I2S_frame_sequence - 1) % Audio::RING_SEGMENTS;
+}
+
+static void audio_restart_sender(uint32_t channel_number);
+
+static void audio_send_complete(uint32_t channel_number) {
+	audio_sends_completed++;
+	audio_restart_sender(channel_number);
+}
+
+static void audio_restart_sender(uint32_t channel_number) {
+	/* Keep the senders busy. Completions are dispatched outside the render, so this can be done from the callback */
+	if (channel_number & 1) {
+		Aud.send_mf(channel_number, "*1234567890#", audio_send_complete);
+	}
+	else {
+		Aud.send_dtmf(channel_number, "0123456789*#", audio_send_complete);
+	}
+}
+
+static void bench_audio(uint32_t frames) {
+	BenchStats s = {"Audio::render_segments"};
+	uint32_t channels[Audio::NUM_AUDIO_CHANNELS];
+
+	for (int i = 0; i < 1000; i++) {
+		audio_loop_sample[i] = (int16_t) (8000.0 * sin((2.0 * M_PI * i) / 1000.0));
+	}
+
+	Aud.setup();
+	for (int i = 0; i < Audio::NUM_AUDIO_CHANNELS; i++) {
+		channels[i] = Aud.seize();
+		switch (i % 6) {
+			case 0:
+				Aud.send_call_progress_tones(channels[i], Audio::CPT_DIAL_TONE);
+				break;
+			case 1:
+				Aud.send_call_progress_tones(channels[i], Audio::CPT_BUSY);
+				break;
+			case 2:
+				Aud.send_call_progress_tones(channels[i], Audio::CPT_RINGING);
+				break;
+			case 3:
+				Aud.send_loop(channels[i], audio_loop_sample, 1000);
+				break;
+			default:
+				audio_restart_sender(channels[i]);
+				break;
+		}
+	}
+
+	uint64_t checksum = 0;
+	for (uint32_t frame = 0; frame < frames; frame++) {
+		uint8_t segment = audio_next_segment();
+		uint64_t start = now_ns();
+		Aud.render_segments(I2S_frame_sequence); /* As the I2S task would */
+		stats_add(&s, now_ns() - start);
+		Aud.dispatch_completions(); /* As the switch task would */
+		const int16_t *out = (const int16_t *) hi2s2.Host_Buffer + (segment * Audio::LR_AUDIO_BUFFER_SIZE);
+		for (int i = 0; i < Audio::LR_AUDIO_BUFFER_SIZE; i++) {
+			checksum = (checksum * 31) + (uint16_t) out[i];
+		}
+	}
+	stats_print(&s);
+	printf("  %u channels, MF/DTMF strings sent: %lu, completions dropped: %lu, output checksum: %016llx\n",
+			Audio::NUM_AUDIO_CHANNELS, (unsigned long) audio_sends_completed, (unsigned long) Aud.completions_dropped(),
+			(unsigned long long) checksum);
+
+	Audio::DeadlineStats deadlines;
+	Aud.deadline_stats(&deadlines);
+	audio_late_renders += deadlines.late_renders + deadlines.segments_skipped;
+	printf("  renders: %lu, late: %lu, segments skipped: %lu, min slack: %ld uS\n", (unsigned long) deadlines.renders,
+			(unsigned long) deadlines.late_renders, (unsigned long) deadlines.segments_skipped, (long) deadlines.min_slack_us);
+
+	/* Stall the audio task for a whole ring and more. The segments the DMA came round to again must be skipped, not rendered late */
+	const uint32_t stalled = Audio::RING_SEGMENTS + 4;
+	for (uint32_t i = 0; i < stalled; i++) {
+		Host_I2S_Segment_Played(&hi2s2);
+	}
+	Aud.render_segments(I2S_frame_sequence);
+	Aud.deadline_stats(&deadlines);
+	printf("  stalled audio task, late: %lu, segments skipped: %lu, min slack: %ld uS\n",
+			(unsigned long) deadlines.late_renders, (unsigned long) deadlines.segments_skipped, (long) deadlines.min_slack_us);
+	if (deadlines.late_renders || (deadlines.segments_skipped != (stalled - (Audio::RING_SEGMENTS - 1)))) {
+		audio_late_renders++; /* The monitor miscounted it */
+	}
+	Aud.report_deadlines();
+	Host_drain_log();
+	Aud.reset_deadline_stats();
+
+	for (int i = 0; i < Audio::NUM_AUDIO_CHANNELS; i++) {
+		Aud.release(channels[i]);
+	}
+}
+
+/*
+ * Streaming playback: a long announcement fed a chunk at a time from the refill callback,
+ * with the switch task dispatching completions once per frame
+ */
+
+static const uint32_t STREAM_CHUNK_SIZE = 400; /* 50mS */
+static const uint32_t STREAM_ANNOUNCEMENT_SIZE = 30 * 8000; /* 30 Seconds */
+static int16_t *stream_announcement;
+static uint32_t stream_next_sample;
+static bool stream_ended;
+static uint32_t streams_completed;
+static uint32_t stream_underruns;
+
+static void stream_refill(uint32_t channel_number) {
+	while (Aud.stream_space(channel_number)) {
+		if (stream_next_sample >= STREAM_ANNOUNCEMENT_SIZE) {
+			/* A refill can still be pending after the end has been queued */
+			if (!stream_ended) {
+				stream_ended = Aud.stream_end(channel_number);
+			}
+			break;
+		}
+		uint32_t length = STREAM_ANNOUNCEMENT_SIZE - stream_next_sample;
+		if (length > STREAM_CHUNK_SIZE) {
+			length = STREAM_CHUNK_SIZE;
+		}
+		Aud.stream_queue(channel_number, stream_announcement + stream_next_sample, length);
+		stream_next_sample += length;
+	}
+}
+
+static void stream_complete(uint32_t channel_number) {
+	streams_completed++;
+	stream_next_sample = 0;
+	stream_ended = false;
+	Aud.send_stream(channel_number, stream_refill, stream_complete); /* Play it again */
+}
+
+static bool stream_prequeued_done;
+
+static void stream_prequeued_refill(uint32_t channel_number) {
+	/* Everything was queued up front */
+}
+
+static void stream_prequeued_complete(uint32_t channel_number) {
+	stream_prequeued_done = true;
+}
+
+static void bench_stream(uint32_t frames) {
+	BenchStats s = {"Audio::render_segments stream"};
+
+	stream_announcement = (int16_t *) malloc(STREAM_ANNOUNCEMENT_SIZE * sizeof(int16_t));
+	for (uint32_t i = 0; i < STREAM_ANNOUNCEMENT_SIZE; i++) {
+		stream_announcement[i] = (int16_t) (6000.0 * sin((2.0 * M_PI * 425.0 * i) / 8000.0));
+	}
+
+	uint32_t channel = Aud.seize();
+	Aud.send_stream(channel, stream_refill, stream_complete);
+	for (uint32_t frame = 0; frame < frames; frame++) {
+		audio_next_segment(); /* The output is not checked, only the DMA needs to move on */
+		uint64_t start = now_ns();
+		Aud.render_segments(I2S_frame_sequence); /* As the I2S task would */
+		stats_add(&s, now_ns() - start);
+		Aud.dispatch_completions();
+		if (Aud.stream_underruns(channel) > stream_underruns) {
+			stream_underruns = Aud.stream_underruns(channel);
+		}
+	}
+	stats_print(&s);
+	printf("  announcements played: %lu, underruns: %lu\n", (unsigned long) streams_completed, (unsigned long) stream_underruns);
+
+	/*
+	 * Stop feeding the announcement and let its queue play out, then replace it with a short stream whose
+	 * chunks are all queued straight after send_stream(), before the render task has seen it. They all have to be played.
+	 */
+	stream_next_sample = STREAM_ANNOUNCEMENT_SIZE; /* Refills still pending for the old stream queue nothing */
+	stream_ended = true;
+	for (uint32_t frame = 0; (frame < 100) && (Aud.stream_space(channel) < Audio::STREAM_QUEUE_DEPTH); frame++) {
+		audio_next_segment();
+		Aud.render_segments(I2S_frame_sequence);
+		Aud.dispatch_completions();
+	}
+	Aud.send_stream(channel, stream_prequeued_refill, stream_prequeued_complete);
+	bool queued = Aud.stream_queue(channel, stream_announcement, STREAM_CHUNK_SIZE) &&
+			Aud.stream_queue(channel, stream_announcement + STREAM_CHUNK_SIZE, STREAM_CHUNK_SIZE) && Aud.stream_end(channel);
+	uint32_t prequeued_frames = 0;
+	while (queued && (!stream_prequeued_done) && (prequeued_frames < 50)) {
+		audio_next_segment();
+		Aud.render_segments(I2S_frame_sequence);
+		Aud.dispatch_completions();
+		prequeued_frames++;
+	}
+	if ((!stream_prequeued_done) || (prequeued_frames < ((2 * STREAM_CHUNK_SIZE) / Audio::AUDIO_BUFFER_SIZE)) || Aud.stream_underruns(channel)) {
+		stream_underruns++; /* Chunks were dropped */
+	}
+	printf("  stream queued before the start: %s after %lu frames\n", stream_prequeued_done ? "played" : "not played",
+			(unsigned long) prequeued_frames);
+	Aud.release(channel);
+	free(stream_announcement);
+}
+
+/*
+ * G.711 playback: a tone encoded with the host encoder and expanded by the renderer, checked against
+ * the linear original, and every code played back and re-encoded to check the expansion tables
+ */
+
+static const uint32_t G711_TONE_SIZE = 8000; /* 1 Second */
+static uint32_t g711_bad;
+
+static void g711_complete(uint32_t channel_number) {
+}
+
+/*
+ * Play a sample on one channel and collect what comes out of its slot, skipping the first sample
+ * of silence the renderer emits when the sample starts
+ */
+
+static void g711_play(BenchStats *s, uint32_t channel, const uint8_t *codes, uint32_t length, uint8_t encoding, int16_t *played) {
+	uint8_t slot = (channel & 1) ? 0 : 1;
+	uint32_t count = 0;
+
+	Aud.send_g711(channel, codes, length, encoding, g711_complete);
+	for (uint32_t frame = 0; count < length + 1; frame++) {
+		uint8_t segment = audio_next_segment();
+		uint64_t start = now_ns();
+		Aud.render_segments(I2S_frame_sequence); /* As the I2S task would */
+		stats_add(s, now_ns() - start);
+		Aud.dispatch_completions();
+		const int16_t *out = (const int16_t *) hi2s2.Host_Buffer + (segment * Audio::LR_AUDIO_BUFFER_SIZE);
+		for (int i = 0; i < Audio::AUDIO_BUFFER_SIZE; i++, count++) {
+			if (count && (count <= length)) {
+				played[count - 1] = out[(i * Audio::NUM_OUTPUT_SLOTS) + slot];
+			}
+		}
+	}
+}
+
+static void bench_g711(void) {
+	BenchStats s = {"Audio::render_segments g711"};
+	static const char *names[] = {"mu-law", "A-law"};
+	static int16_t tone[G711_TONE_SIZE];
+	static int16_t played[G711_TONE_SIZE];
+	static uint8_t codes[G711_TONE_SIZE];
+	double snr[2];
+	uint32_t mismatches[2];
+
+	for (uint32_t i = 0; i < G711_TONE_SIZE; i++) {
+		tone[i] = (int16_t) (16000.0 * sin((2.0 * M_PI * 1004.0 * i) / 8000.0));
+	}
+
+	uint32_t channel = Aud.seize();
+	for (uint8_t encoding = Audio::AE_ULAW; encoding <= Audio::AE_ALAW; encoding++) {
+		uint8_t (*encode)(int16_t) = (encoding == Audio::AE_ULAW) ? G711::linear_to_ulaw : G711::linear_to_alaw;
+
+		/* Signal to quantization noise ratio of the tone */
+		for (uint32_t i = 0; i < G711_TONE_SIZE; i++) {
+			codes[i] = encode(tone[i]);
+		}
+		g711_play(&s, channel, codes, G711_TONE_SIZE, encoding, played);
+		double signal = 0.0;
+		double noise = 0.0;
+		for (uint32_t i = 0; i < G711_TONE_SIZE; i++) {
+			signal += (double) tone[i] * tone[i];
+			noise += (double) (played[i] - tone[i]) * (played[i] - tone[i]);
+		}
+		snr[encoding - Audio::AE_ULAW] = 10.0 * log10(signal / noise);
+
+		/* Every code must expand to a value which encodes back to the same code */
+		uint32_t bad_codes = 0;
+		for (uint16_t code = 0; code < 256; code++) {
+			codes[code] = code;
+		}
+		g711_play(&s, channel, codes, 256, encoding, played);
+		for (uint16_t code = 0; code < 256; code++) {
+			/* 0x7F is -0 in mu-law, which encodes as +0 (0xFF) */
+			if ((encode(played[code]) != code) && !((encoding == Audio::AE_ULAW) && (code == 0x7F) && !played[code])) {
+				bad_codes++;
+			}
+		}
+		mismatches[encoding - Audio::AE_ULAW] = bad_codes;
+		if ((snr[encoding - Audio::AE_ULAW] < 30.0) || bad_codes) {
+			g711_bad++;
+		}
+	}
+	Aud.release(channel);
+	stats_print(&s);
+	for (int i = 0; i < 2; i++) {
+		printf("  %s: tone SNR %.1f dB, codes not round tripping: %lu\n", names[i], snr[i], (unsigned long) mismatches[i]);
+	}
+}
+
+/*
+ * MF decoder: synthesize MF digit strings for every receiver into the interleaved ADC DMA buffer and decode them
+ */
+
+static const float MF_TONES[][2] = {
+	{1300.0, 1500.0}, {700.0, 900.0}, {700.0, 1100.0}, {900.0, 1100.0}, {700.0, 1300.0},
+	{900.0, 1300.0}, {1100.0, 1300.0}, {700.0, 1500.0}, {900.0, 1500.0}, {1100.0, 1500.0},
+	{1100.0, 1700.0}, {1500.0, 1700.0}
+};
+static const char MF_TEST_STRING[] = "*5551212#";
+static const uint8_t MF_TONE_FRAMES = 4;
+static const uint8_t MF_SILENCE_FRAMES = 4;
+
+static uint32_t mf_strings_decoded;
+static uint32_t mf_strings_bad;
+
+static void mf_decoded(uint32_t descriptor, uint8_t error_code, uint8_t digit_count, char *data) {
+	if ((error_code == Mfd::MFE_OK) && descriptor && !strcmp(data, MF_TEST_STRING)) {
+		mf_strings_decoded++;
+	}
+	else {
+		mf_strings_bad++;
+	}
+}
+
+static int mf_tone_index(char digit) {
+	switch (digit) {
+		case '*':
+			return 10;
+		case '#':
+			return 11;
+		default:
+			return digit - '0';
+	}
+}
+
+/*
+ * Fill one frame of 12 bit unipolar ADC samples for every receiver, either with a tone pair or with silence (NULL).
+ * Each receiver gets its own noise and DC offset.
+ */
+
+static void fill_adc_frame(uint16_t *frame, const float *tone_pair, uint32_t *sample_clock) {
+	for (int i = 0; i < Mfd::MF_FRAME_SIZE; i++) {
+		float t = (float) (*sample_clock)++ / Mfd::MF_SAMPLE_RATE;
+		float v = 0.0;
+		if (tone_pair) {
+			v = 0.25 * (sinf(2.0 * M_PI * tone_pair[0] * t) + sinf(2.0 * M_PI * tone_pair[1] * t));
+		}
+		for (int receiver = 0; receiver < Mfd::MF_NUM_RECEIVERS; receiver++) {
+			float r = v + ((float) ((rand() & 0xFF) - 128)) / 32768.0; /* A little noise */
+			r += 0.05 * receiver; /* and some DC */
+			frame[(i * Mfd::MF_NUM_RECEIVERS) + receiver] = (uint16_t) (2048.0 + (r * 2047.0));
+		}
+	}
+}
+
+static void bench_mf(uint32_t frames) {
+	BenchStats s = {"MF_decoder::handle_buffer"};
+
+	Mfr.setup();
+	uint16_t *adc_buffer = (uint16_t *) hadc1.Host_Buffer;
+	uint32_t descriptors[Mfd::MF_NUM_RECEIVERS];
+	uint32_t sample_clock = 0;
+	size_t digit = 0;
+	uint8_t phase_frames = 0;
+	bool in_tone = true;
+
+	for (int receiver = 0; receiver < Mfd::MF_NUM_RECEIVERS; receiver++) {
+		descriptors[receiver] = Mfr.seize(mf_decoded);
+	}
+	for (uint32_t frame = 0; frame < frames; frame++) {
+		uint8_t half = frame & 1;
+		uint16_t *dst = adc_buffer + (half ? Mfd::MF_FRAME_SIZE * Mfd::MF_NUM_RECEIVERS : 0);
+		/* KP is sent for longer than the other digits */
+		uint8_t tone_frames = (digit == 0) ? MF_TONE_FRAMES + 2 : MF_TONE_FRAMES;
+
+		fill_adc_frame(dst, in_tone ? MF_TONES[mf_tone_index(MF_TEST_STRING[digit])] : NULL, &sample_clock);
+		if (++phase_frames >= (in_tone ? tone_frames : MF_SILENCE_FRAMES)) {
+			phase_frames = 0;
+			if (!in_tone) {
+				digit++;
+				if (digit >= strlen(MF_TEST_STRING)) {
+					digit = 0;
+					/* Restart the receivers for the next string */
+					for (int receiver = 0; receiver < Mfd::MF_NUM_RECEIVERS; receiver++) {
+						Mfr.release(descriptors[receiver]);
+						descriptors[receiver] = Mfr.seize(mf_decoded);
+					}
+				}
+			}
+			in_tone = !in_tone;
+		}
+
+		uint64_t start = now_ns();
+		Mfr.handle_buffer(half);
+		stats_add(&s, now_ns() - start);
+	}
+	for (int receiver = 0; receiver < Mfd::MF_NUM_RECEIVERS; receiver++) {
+		Mfr.release(descriptors[receiver]);
+	}
+	stats_print(&s);
+	printf("  %u receivers, MF strings decoded: %lu, bad: %lu\n", Mfd::MF_NUM_RECEIVERS,
+			(unsigned long) mf_strings_decoded, (unsigned long) mf_strings_bad);
+}
+
+/*
+ * DTMF decoder: the same interleaved ADC frames, carrying DTMF digit strings
+ */
+
+static const float DTMF_ROWS[] = {697.0, 770.0, 852.0, 941.0};
+static const float DTMF_COLUMNS[] = {1209.0, 1336.0, 1477.0, 1633.0};
+static const char DTMF_KEYS[] = "123A456B789C*0#D";
+static const char DTMF_TEST_STRING[] = "19A2B3C*D0#";
+static const uint8_t DTMF_TONE_FRAMES = 3;
+static const uint8_t DTMF_SILENCE_FRAMES = 3;
+
+static uint32_t dtmf_strings_decoded;
+static uint32_t dtmf_strings_bad;
+
+static void dtmf_decoded(uint32_t descriptor, uint8_t error_code, uint8_t digit_count, char *data) {
+	if ((error_code == Dtmfd::DTE_OK) && descriptor && !strcmp(data, DTMF_TEST_STRING)) {
+		dtmf_strings_decoded++;
+	}
+	else {
+		dtmf_strings_bad++;
+	}
+}
+
+static void bench_dtmf(uint32_t frames) {
+	BenchStats s = {"DTMF_decoder::handle_buffer"};
+	uint16_t *adc_buffer = (uint16_t *) hadc1.Host_Buffer;
+	uint32_t descriptors[Dtmfd::DTMF_NUM_RECEIVERS];
+	uint32_t sample_clock = 0;
+	size_t digit = 0;
+	uint8_t phase_frames = 0;
+	bool in_tone = true;
+
+	Dtmfr.setup(&Mfr);
+	for (int receiver = 0; receiver < Dtmfd::DTMF_NUM_RECEIVERS; receiver++) {
+		descriptors[receiver] = Dtmfr.seize(dtmf_decoded);
+	}
+	for (uint32_t frame = 0; frame < frames; frame++) {
+		uint8_t half = frame & 1;
+		uint16_t *dst = adc_buffer + (half ? Mfd::MF_FRAME_SIZE * Mfd::MF_NUM_RECEIVERS : 0);
+		float tone_pair[2];
+
+		if (in_tone) {
+			int key = strchr(DTMF_KEYS, DTMF_TEST_STRING[digit]) - DTMF_KEYS;
+			tone_pair[0] = DTMF_ROWS[key >> 2];
+			tone_pair[1] = DTMF_COLUMNS[key & 3];
+		}
+		fill_adc_frame(dst, in_tone ? tone_pair : NULL, &sample_clock);
+		if (++phase_frames >= (in_tone ? DTMF_TONE_FRAMES : DTMF_SILENCE_FRAMES)) {
+			phase_frames = 0;
+			if (!in_tone) {
+				digit++;
+				if (digit >= strlen(DTMF_TEST_STRING)) {
+					digit = 0;
+					/* Restart the receivers for the next string */
+					for (int receiver = 0; receiver < Dtmfd::DTMF_NUM_RECEIVERS; receiver++) {
+						Dtmfr.release(descriptors[receiver]);
+						descriptors[receiver] = Dtmfr.seize(dtmf_decoded);
+					}
+				}
+			}
+			in_tone = !in_tone;
+		}
+
+		uint64_t start = now_ns();
+		Dtmfr.handle_buffer(half);
+		stats_add(&s, now_ns() - start);
+	}
+	for (int receiver = 0; receiver < Dtmfd::DTMF_NUM_RECEIVERS; receiver++) {
+		Dtmfr.release(descriptors[receiver]);
+	}
+	stats_print(&s);
+	printf("  %u receivers, DTMF strings decoded: %lu, bad: %lu\n", Dtmfd::DTMF_NUM_RECEIVERS,
+			(unsigned long) dtmf_strings_decoded, (unsigned long) dtmf_strings_bad);
+}
+
+/*
+ * Goertzel kernel on its own: one 20mS frame through the six MF bins
+ */
+
+static void bench_goertzel(uint32_t frames) {
+	BenchStats s = {"Goertzel::Bank<6>::run"};
+	Goertzel::Bank<Mfd::NUM_MF_FREQUENCIES> bank;
+	static const float freqs[Mfd::NUM_MF_FREQUENCIES] = {1700.0, 1500.0, 1300.0, 1100.0, 900.0, 700.0};
+	static float block[Mfd::MF_FRAME_SIZE];
+	float sum = 0.0;
+
+	for (int i = 0; i < Mfd::MF_FRAME_SIZE; i++) {
+		block[i] = 0.5 * sinf((2.0 * M_PI * 1100.0 * i) / Mfd::MF_SAMPLE_RATE);
+	}
+	bank.setup(freqs, Mfd::MF_SAMPLE_RATE);
+	for (uint32_t frame = 0; frame < frames; frame++) {
+		uint64_t start = now_ns();
+		bank.clear();
+		bank.run(block, Mfd::MF_FRAME_SIZE);
+		stats_add(&s, now_ns() - start);
+		sum += bank.magnitude(frame % Mfd::NUM_MF_FREQUENCIES);
+	}
+	stats_print(&s);
+	printf("  %u lanes, mean magnitude: %.3f\n", (unsigned) bank.LANES, sum / frames);
+}
+
+/*
+ * I2C engine: register reads and writes against a simulated device on each bus.
+ * The engine runs in its own task, as on the target, and the time is from queueing
+ * a transaction to its callback waking the bench.
+ */
+
+static const uint8_t I2C_TEST_DEVICE = 0x20;
+static uint32_t i2c_completed;
+static uint32_t i2c_failed;
+static osMessageQueueId_t i2c_done_queue;
+
+static void i2c_done(I2C_Engine::I2C_Transaction *trans) {
+	if (trans->status == I2C_Engine::I2CEC_OK) {
+		i2c_completed++;
+	}
+	else {
+		i2c_failed++;
+	}
+	osMessageQueuePut(i2c_done_queue, &trans->status, 0U, 0U);
+}
+
+static void i2c_batch_done(I2C_Engine::I2C_Batch *batch) {
+	osMessageQueuePut(i2c_done_queue, &batch->failed, 0U, 0U);
+}
+
+static uint32_t i2c_poll_callbacks;
+
+static void i2c_poll_changed(I2C_Engine::I2C_Poll *poll) {
+	__atomic_fetch_add(&i2c_poll_callbacks, 1, __ATOMIC_RELAXED);
+}
+
+static void i2c_task(void *argument) {
+	for (;;) {
+		I2c.loop();
+	}
+}
+
+static void bench_i2c(uint32_t transactions) {
+	BenchStats s = {"I2C transaction pair"};
+	uint8_t data[2] = {0x55, 0xAA};
+	uint8_t read_back[I2C_Engine::NUM_I2C_BUSSES][2];
+
+	Host_I2C_Attach_Device(&hi2c1, I2C_TEST_DEVICE);
+	Host_I2C_Attach_Device(&hi2c2, I2C_TEST_DEVICE);
+	I2c.setup();
+	i2c_done_queue = osMessageQueueNew(I2C_Engine::NUM_I2C_BUSSES, sizeof(uint8_t), NULL);
+	I2C_TaskHandle = osThreadNew(i2c_task, NULL, NULL);
+
+	/*
+	 * One transaction on each bus at a time, the engine runs them side by side. Writes then reads, with 8 and 16 bit register addresses.
+	 * The writes are one shot transactions from the pool, the reads are reserved once and submitted again each time like a poll.
+	 */
+	static const uint8_t types[] = {I2C_Engine::I2CT_WRITE_REG8, I2C_Engine::I2CT_READ_REG8, I2C_Engine::I2CT_WRITE_REG16, I2C_Engine::I2CT_READ_REG16};
+	I2C_Engine::I2C_Transaction *polls[I2C_Engine::NUM_I2C_BUSSES][2];
+	for (uint8_t bus = 0; bus < I2C_Engine::NUM_I2C_BUSSES; bus++) {
+		polls[bus][0] = I2c.reserve_transaction(I2C_Engine::I2CT_READ_REG8, bus, I2C_TEST_DEVICE, 0x12, 2, read_back[bus], i2c_done, bus);
+		polls[bus][1] = I2c.reserve_transaction(I2C_Engine::I2CT_READ_REG16, bus, I2C_TEST_DEVICE, 0x0112, 2, read_back[bus], i2c_done, bus);
+	}
+	uint32_t transfers_before = hi2c1.Host_Transfer_Count + hi2c2.Host_Transfer_Count;
+	for (uint32_t i = 0; i < transactions; i += I2C_Engine::NUM_I2C_BUSSES) {
+		uint8_t type = types[(i >> 1) & 3];
+		bool is_read = (type == I2C_Engine::I2CT_READ_REG8) || (type == I2C_Engine::I2CT_READ_REG16);
+		uint16_t reg = (type >= I2C_Engine::I2CT_READ_REG16) ? 0x0112 : 0x12; /* The simulated devices decode the low 8 bits */
+		uint8_t queued = 0;
+		memset(read_back, 0, sizeof(read_back));
+		uint64_t start = now_ns();
+		for (uint8_t bus = 0; bus < I2C_Engine::NUM_I2C_BUSSES; bus++) {
+			bool ok = is_read ? I2c.submit_transaction(polls[bus][type == I2C_Engine::I2CT_READ_REG16]) :
+					I2c.queue_transaction(type, bus, I2C_TEST_DEVICE, reg, 2, data, i2c_done, i + bus);
+			if (ok) {
+				queued++;
+			}
+			else {
+				i2c_failed++;
+			}
+		}
+		while (queued--) {
+			uint8_t status;
+			osMessageQueueGet(i2c_done_queue, &status, NULL, osWaitForever);
+		}
+		stats_add(&s, now_ns() - start);
+		for (uint8_t bus = 0; is_read && (bus < I2C_Engine::NUM_I2C_BUSSES); bus++) {
+			if (memcmp(read_back[bus], data, sizeof(data))) {
+				i2c_failed++; /* Read back something other than what was written */
+			}
+		}
+		if ((i & 7) == 6) {
+			/* The engine logs every transaction, keep the log queue from overflowing */
+			Host_drain_log();
+		}
+	}
+	stats_print(&s);
+	uint32_t transfers = hi2c1.Host_Transfer_Count + hi2c2.Host_Transfer_Count - transfers_before;
+	Host_drain_log();
+
+	/* The same register setup and read back, one transaction at a time and as a batch on each bus */
+	static const uint8_t BATCH_STEPS = 4; /* The engine logs each step, keep within the log queue */
+	static uint8_t batch_data[I2C_Engine::NUM_I2C_BUSSES][BATCH_STEPS];
+	I2C_Engine::I2C_Batch_Step steps[I2C_Engine::NUM_I2C_BUSSES][BATCH_STEPS];
+	I2C_Engine::I2C_Batch batches[I2C_Engine::NUM_I2C_BUSSES];
+	for (uint8_t bus = 0; bus < I2C_Engine::NUM_I2C_BUSSES; bus++) {
+		for (uint8_t i = 0; i < BATCH_STEPS; i++) {
+			bool is_read = (i >= (BATCH_STEPS / 2));
+			steps[bus][i].type = is_read ? I2C_Engine::I2CT_READ_REG8 : I2C_Engine::I2CT_WRITE_REG8;
+			steps[bus][i].device_address = I2C_TEST_DEVICE;
+			steps[bus][i].register_address = 0x20 + (i % (BATCH_STEPS / 2));
+			steps[bus][i].data_length = 1;
+			steps[bus][i].register_data = &batch_data[bus][i];
+		}
+		batches[bus].steps = steps[bus];
+		batches[bus].step_count = BATCH_STEPS;
+		batches[bus].bus = bus;
+		batches[bus].stop_on_error = true;
+		batches[bus].id = bus;
+		batches[bus].callback = i2c_batch_done;
+		batches[bus].in_flight = false;
+	}
+	BenchStats single = {"I2C 4 steps one by one"};
+	BenchStats batched = {"I2C 4 step batch"};
+	for (uint32_t i = 0; i < transactions / (BATCH_STEPS * I2C_Engine::NUM_I2C_BUSSES); i++) {
+		for (uint8_t bus = 0; bus < I2C_Engine::NUM_I2C_BUSSES; bus++) {
+			for (uint8_t j = 0; j < BATCH_STEPS; j++) {
+				batch_data[bus][j] = (j < (BATCH_STEPS / 2)) ? (uint8_t) (i + j + bus) : 0;
+			}
+		}
+		uint64_t start = now_ns();
+		for (uint8_t bus = 0; bus < I2C_Engine::NUM_I2C_BUSSES; bus++) {
+			for (uint8_t j = 0; j < BATCH_STEPS; j++) {
+				I2C_Engine::I2C_Batch_Step *step = &steps[bus][j];
+				uint8_t status;
+				if (I2c.queue_transaction(step->type, bus, step->device_address, step->register_address, step->data_length, step->register_data,
+						i2c_done, j)) {
+					osMessageQueueGet(i2c_done_queue, &status, NULL, osWaitForever);
+				}
+			}
+		}
+		stats_add(&single, now_ns() - start);
+		Host_drain_log();
+
+		start = now_ns();
+		uint8_t queued = 0;
+		for (uint8_t bus = 0; bus < I2C_Engine::NUM_I2C_BUSSES; bus++) {
+			if (I2c.submit_batch(&batches[bus])) {
+				queued++;
+			}
+		}
+		while (queued--) {
+			uint8_t failed;
+			osMessageQueueGet(i2c_done_queue, &failed, NULL, osWaitForever);
+			i2c_failed += failed;
+		}
+		stats_add(&batched, now_ns() - start);
+		for (uint8_t bus = 0; bus < I2C_Engine::NUM_I2C_BUSSES; bus++) {
+			if (memcmp(&batch_data[bus][BATCH_STEPS / 2], &batch_data[bus][0], BATCH_STEPS / 2)) {
+				i2c_failed++; /* Read back something other than what was written */
+			}
+		}
+		Host_drain_log();
+	}
+	stats_print(&single);
+	stats_print(&batched);
+
+	/* A batch to a missing device has to stop at the first step and say why */
+	batches[0].steps[0].device_address = I2C_TEST_DEVICE + 1;
+	uint8_t failed = 0;
+	if (I2c.submit_batch(&batches[0])) {
+		osMessageQueueGet(i2c_done_queue, &failed, NULL, osWaitForever);
+	}
+	if ((failed != BATCH_STEPS) || (steps[0][0].status != I2C_Engine::I2CEC_NO_DEVICE) || (steps[0][1].status != I2C_Engine::I2CEC_NOT_RUN)) {
+		i2c_failed++;
+	}
+	printf("  batch to a missing device: %u of %u steps failed, first step status: %u\n", failed, BATCH_STEPS, steps[0][0].status);
+	Host_drain_log();
+
+	/*
+	 * Input expander style polls, two registers on each bus every 2mS. Every 20mS one register bit flips, alternately
+	 * inside and outside the poll mask. Only the first read and the masked flips may call back.
+	 */
+	static const uint8_t POLLS_PER_BUS = 2;
+	static const uint32_t POLL_FLIPS = 10;
+	I2C_HandleTypeDef *poll_busses[I2C_Engine::NUM_I2C_BUSSES] = {&hi2c1, &hi2c2};
+	I2C_Engine::I2C_Poll *scanned[I2C_Engine::NUM_I2C_BUSSES][POLLS_PER_BUS];
+	uint32_t masked_flips = 0;
+	for (uint8_t bus = 0; bus < I2C_Engine::NUM_I2C_BUSSES; bus++) {
+		for (uint8_t i = 0; i < POLLS_PER_BUS; i++) {
+			scanned[bus][i] = I2c.add_poll(I2C_Engine::I2CT_READ_REG8, bus, I2C_TEST_DEVICE, 0x40 + i, 1, 0x0F, 2, i2c_poll_changed,
+					(bus * POLLS_PER_BUS) + i);
+			if (!scanned[bus][i]) {
+				i2c_failed++;
+			}
+		}
+	}
+	for (uint32_t i = 0; i < POLL_FLIPS; i++) {
+		osDelay(20);
+		uint8_t bus = i % I2C_Engine::NUM_I2C_BUSSES;
+		uint8_t reg = 0x40 + ((i / I2C_Engine::NUM_I2C_BUSSES) % POLLS_PER_BUS);
+		bool masked = !(i & 1);
+		poll_busses[bus]->Host_Registers[I2C_TEST_DEVICE][reg] ^= masked ? 0x01 : 0x80;
+		if (masked) {
+			masked_flips++;
+		}
+		Host_drain_log();
+	}
+	osDelay(20);
+	uint32_t poll_reads = 0;
+	for (uint8_t bus = 0; bus < I2C_Engine::NUM_I2C_BUSSES; bus++) {
+		for (uint8_t i = 0; i < POLLS_PER_BUS; i++) {
+			if (!scanned[bus][i]) {
+				continue;
+			}
+			poll_reads += scanned[bus][i]->reads;
+			if (scanned[bus][i]->value != poll_busses[bus]->Host_Registers[I2C_TEST_DEVICE][0x40 + i]) {
+				i2c_failed++; /* The poll missed a change */
+			}
+			I2c.remove_poll(scanned[bus][i]);
+		}
+	}
+	osDelay(5); /* Polls removed while their read was in flight give back the transaction when it finishes */
+	uint32_t callbacks = __atomic_load_n(&i2c_poll_callbacks, __ATOMIC_RELAXED);
+	if (callbacks != ((I2C_Engine::NUM_I2C_BUSSES * POLLS_PER_BUS) + masked_flips)) {
+		i2c_failed++;
+	}
+	printf("  I2C polls: %lu reads, %lu callbacks for %lu masked and %lu unmasked bit flips\n", (unsigned long) poll_reads,
+			(unsigned long) callbacks, (unsigned long) masked_flips, (unsigned long) (POLL_FLIPS - masked_flips));
+	Host_drain_log();
+
+	for (uint8_t bus = 0; bus < I2C_Engine::NUM_I2C_BUSSES; bus++) {
+		I2c.release_transaction(polls[bus][0]);
+		I2c.release_transaction(polls[bus][1]);
+	}
+	uint8_t pool_free = I2c.transactions_free();
+	if (pool_free != I2C_Engine::I2C_TRANSACTION_POOL_SIZE) {
+		i2c_failed++; /* A transaction leaked from the pool */
+	}
+	printf("  I2C transactions completed: %lu, failed: %lu, bus transfers per transaction: %.2f, pool free: %u/%u\n",
+			(unsigned long) i2c_completed, (unsigned long) i2c_failed, transactions ? (double) transfers / transactions : 0.0,
+			pool_free, I2C_Engine::I2C_TRANSACTION_POOL_SIZE);
+}
+
+/*
+ * I2C register shadow: bursts of output bit changes on an expander's two output registers, as
+ * during call setup. Each change is a read-modify-write on the bus, then the same changes as
+ * masked updates through the shadow, followed by one read so the burst time includes the writes.
+ */
+
+static const uint8_t SHADOW_BURST = 16;
+static const uint8_t SHADOW_OUTPUTS = 0x14; /* Two output registers */
+static const uint8_t SHADOW_INPUTS = 0x12; /* Volatile */
+static const uint8_t SHADOW_DIRECTION = 0x00; /* Two direction registers, non-volatile */
+
+static uint8_t i2c_wait(void) {
+	uint8_t status;
+	osMessageQueueGet(i2c_done_queue, &status, NULL, osWaitForever);
+	return status;
+}
+
+static void bench_i2c_shadow(uint32_t bursts) {
+	BenchStats direct = {"I2C 16 read-mod-writes"};
+	BenchStats shadowed = {"I2C 16 shadow updates"};
+	uint8_t expected[2];
+	uint8_t data[2];
+
+	I2C_Engine::I2C_Shadow *shadow = I2c.add_shadow(0, I2C_TEST_DEVICE, 3UL << SHADOW_DIRECTION);
+	if (!shadow) {
+		i2c_failed++;
+		return;
+	}
+	/* Fill the cache from the device, then the direction registers should come from the cache */
+	uint8_t first = I2c.shadow_read(shadow, SHADOW_OUTPUTS, 2, expected, i2c_done, 0);
+	if ((first != I2C_Engine::I2CSR_QUEUED) || (i2c_wait() != I2C_Engine::I2CEC_OK)) {
+		i2c_failed++;
+	}
+	for (uint8_t i = 0; i < 2; i++) {
+		uint8_t res = I2c.shadow_read(shadow, SHADOW_DIRECTION, 2, data, i2c_done, 0);
+		if ((res == I2C_Engine::I2CSR_QUEUED) && (i2c_wait() != I2C_Engine::I2CEC_OK)) {
+			i2c_failed++;
+		}
+		if (res != (i ? I2C_Engine::I2CSR_CACHED : I2C_Engine::I2CSR_QUEUED)) {
+			i2c_failed++;
+		}
+	}
+	Host_drain_log();
+
+	uint32_t direct_transfers = 0;
+	uint32_t shadow_transfers = 0;
+	uint32_t writes_before = shadow->writes;
+	for (uint32_t b = 0; b < bursts; b++) {
+		/* Relay bits on and off across both registers */
+		uint8_t masks[SHADOW_BURST];
+		uint8_t values[SHADOW_BURST];
+		for (uint8_t i = 0; i < SHADOW_BURST; i++) {
+			masks[i] = 1 << ((i >> 1) & 7);
+			values[i] = ((b + i) & 2) ? masks[i] : 0;
+		}
+
+		uint32_t transfers = hi2c1.Host_Transfer_Count;
+		uint64_t elapsed = 0;
+		for (uint8_t i = 0; i < SHADOW_BURST; i++) {
+			uint8_t reg = SHADOW_OUTPUTS + (i & 1);
+			uint8_t value;
+			uint64_t start = now_ns();
+			if (!I2c.queue_transaction(I2C_Engine::I2CT_READ_REG8, 0, I2C_TEST_DEVICE, reg, 1, &value, i2c_done, i) ||
+					(i2c_wait() != I2C_Engine::I2CEC_OK)) {
+				i2c_failed++;
+			}
+			value = (value & ~masks[i]) | values[i];
+			if (!I2c.queue_transaction(I2C_Engine::I2CT_WRITE_REG8, 0, I2C_TEST_DEVICE, reg, 1, &value, i2c_done, i) ||
+					(i2c_wait() != I2C_Engine::I2CEC_OK)) {
+				i2c_failed++;
+			}
+			elapsed += now_ns() - start;
+			expected[i & 1] = (expected[i & 1] & ~masks[i]) | values[i];
+			if (i & 1) {
+				Host_drain_log(); /* The engine logs every transaction */
+			}
+		}
+		stats_add(&direct, elapsed);
+		direct_transfers += hi2c1.Host_Transfer_Count - transfers;
+
+		/* The writes went round the shadow, read them back into it */
+		if ((I2c.shadow_read(shadow, SHADOW_OUTPUTS, 2, data, i2c_done, 0) != I2C_Engine::I2CSR_QUEUED) ||
+				(i2c_wait() != I2C_Engine::I2CEC_OK)) {
+			i2c_failed++;
+		}
+		Host_drain_log();
+
+		/* Turn the same bits the other way through the shadow */
+		transfers = hi2c1.Host_Transfer_Count;
+		uint64_t start = now_ns();
+		for (uint8_t i = 0; i < SHADOW_BURST; i++) {
+			uint8_t value = values[i] ^ masks[i];
+			if (!I2c.shadow_update(shadow, SHADOW_OUTPUTS + (i & 1), masks[i], value)) {
+				i2c_failed++;
+			}
+			expected[i & 1] = (expected[i & 1] & ~masks[i]) | value;
+		}
+		/* Queued behind the flush on the same bus */
+		if ((I2c.shadow_read(shadow, SHADOW_INPUTS, 1, data, i2c_done, 0) != I2C_Engine::I2CSR_QUEUED) ||
+				(i2c_wait() != I2C_Engine::I2CEC_OK)) {
+			i2c_failed++;
+		}
+		stats_add(&shadowed, now_ns() - start);
+		shadow_transfers += hi2c1.Host_Transfer_Count - transfers;
+		if (memcmp(&hi2c1.Host_Registers[I2C_TEST_DEVICE][SHADOW_OUTPUTS], expected, 2) ||
+				memcmp(&shadow->registers[SHADOW_OUTPUTS], expected, 2)) {
+			i2c_failed++; /* Device, shadow and model disagree */
+		}
+		Host_drain_log();
+	}
+	stats_print(&direct);
+	stats_print(&shadowed);
+	printf("  bus transfers per burst: %.1f read-mod-write, %.1f shadowed (%lu register writes for %lu updates), "
+			"cached reads: %lu, write errors: %lu\n",
+			bursts ? (double) direct_transfers / bursts : 0.0, bursts ? (double) shadow_transfers / bursts : 0.0,
+			(unsigned long) (shadow->writes - writes_before), (unsigned long) (bursts * SHADOW_BURST),
+			(unsigned long) shadow->cached_reads, (unsigned long) shadow->write_errors);
+}
+
+/*
+ * Line scanner: hook changes with contact bounce on a fixed number of lines per scan, for
+ * growing line counts. The scan cost should not grow with the line count. The events are
+ * checked against the settled port state, and each change must give exactly one event.
+ */
+
+static const uint8_t LINE_SCAN_SIZES = 4;
+static const uint16_t line_scan_lines[LINE_SCAN_SIZES] = {256, 512, 1024, 2048};
+static const uint8_t LINE_BOUNCE_FLIPS = 3; /* Flips per change, the last one sticks */
+static const uint8_t LINE_MAX_BOUNCING = 16;
+static uint32_t line_scan_bad;
+
+typedef struct Bouncing_Line {
+	uint16_t line;
+	uint8_t flips_left;
+} Bouncing_Line;
+
+static uint32_t line_scan_random(void) {
+	static uint32_t seed = 1;
+	seed = (seed * 1103515245UL) + 12345UL;
+	return seed >> 8;
+}
+
+/* Take the queued events the way the switch task does, and check each one is a change */
+static uint32_t line_scan_drain(uint32_t *debounced) {
+	Line_Scan::Hook_Event event;
+	uint32_t events = 0;
+	while (Lines.get_event(&event)) {
+		uint32_t *word = &debounced[event.line / Line_Scan::LINES_PER_WORD];
+		uint32_t bit = 1UL << (event.line % Line_Scan::LINES_PER_WORD);
+		if (((*word & bit) != 0) == event.off_hook) {
+			line_scan_bad++; /* Not a change */
+		}
+		*word ^= bit;
+		events++;
+	}
+	return events;
+}
+
+static void bench_line_scan(uint32_t scans) {
+	static char names[LINE_SCAN_SIZES][32];
+	static uint32_t raw[Line_Scan::MAX_WORDS];
+	static uint32_t debounced[Line_Scan::MAX_WORDS];
+	static uint32_t settled[Line_Scan::MAX_LINES]; /* Scan from which a line can change again and still give an event */
+
+	for (uint8_t size = 0; size < LINE_SCAN_SIZES; size++) {
+		uint16_t lines = line_scan_lines[size];
+		Bouncing_Line bouncing[LINE_MAX_BOUNCING];
+		uint8_t bouncing_count = 0;
+		uint32_t changes = 0;
+		uint32_t events = 0;
+
+		snprintf(names[size], sizeof(names[size]), "Line_Scan::scan %u lines", lines);
+		BenchStats s = {names[size]};
+		memset(raw, 0, sizeof(raw));
+		memset(debounced, 0, sizeof(debounced));
+		memset(settled, 0, sizeof(settled));
+		Lines.setup();
+
+		for (uint32_t i = 0; i < scans; i++) {
+			/* A new hook change every fourth scan, wherever it lands, unless that line has not settled */
+			if (((i & 3) == 0) && (bouncing_count < LINE_MAX_BOUNCING)) {
+				uint16_t line = line_scan_random() % lines;
+				if (i >= settled[line]) {
+					settled[line] = i + LINE_BOUNCE_FLIPS + Line_Scan::DEBOUNCE_SCANS;
+					bouncing[bouncing_count].line = line;
+					bouncing[bouncing_count].flips_left = LINE_BOUNCE_FLIPS;
+					bouncing_count++;
+					changes++;
+				}
+			}
+			/* Port snapshots only come in for ports which changed, as from the I2C polls */
+			for (uint8_t j = 0; j < bouncing_count;) {
+				uint16_t word = bouncing[j].line / Line_Scan::LINES_PER_WORD;
+				raw[word] ^= 1UL << (bouncing[j].line % Line_Scan::LINES_PER_WORD);
+				Lines.set_port(word, raw[word]);
+				if (--bouncing[j].flips_left == 0) {
+					bouncing[j] = bouncing[--bouncing_count];
+				}
+				else {
+					j++;
+				}
+			}
+
+			uint64_t start = now_ns();
+			Lines.scan();
+			stats_add(&s, now_ns() - start);
+			events += line_scan_drain(debounced);
+		}
+		/* Let the last changes settle */
+		for (uint8_t i = 0; i < (2 * Line_Scan::DEBOUNCE_SCANS); i++) {
+			Lines.scan();
+			events += line_scan_drain(debounced);
+		}
+
+		stats_print(&s);
+		if (memcmp(raw, debounced, sizeof(raw)) || (events != changes) || Lines.events_dropped()) {
+			line_scan_bad++;
+		}
+		for (uint16_t line = 0; line < lines; line++) {
+			if (Lines.off_hook(line) != ((raw[line / Line_Scan::LINES_PER_WORD] >> (line % Line_Scan::LINES_PER_WORD)) & 1)) {
+				line_scan_bad++;
+			}
+		}
+		printf("  %u lines, hook changes: %lu, events: %lu, dropped: %lu\n", lines, (unsigned long) changes,
+				(unsigned long) events, (unsigned long) Lines.events_dropped());
+	}
+
+	/* A line card on the second bus, read by an I2C engine poll: one line goes off hook and back */
+	static const uint16_t CARD_FIRST_LINE = 40;
+	static const uint8_t CARD_REGISTER = 0x60;
+	static const uint16_t CARD_LINE = CARD_FIRST_LINE + 10; /* Bit 2 of the second port */
+	Lines.setup();
+	memset(debounced, 0, sizeof(debounced));
+	if (!Lines.add_card(1, I2C_TEST_DEVICE, CARD_REGISTER, 2, CARD_FIRST_LINE, 2)) {
+		line_scan_bad++;
+	}
+	uint32_t card_events = 0;
+	for (uint8_t step = 0; step < 2; step++) {
+		hi2c2.Host_Registers[I2C_TEST_DEVICE][CARD_REGISTER + 1] = step ? 0x00 : 0x04;
+		for (uint8_t i = 0; i < 20; i++) {
+			osDelay(2);
+			Lines.scan();
+			card_events += line_scan_drain(debounced);
+		}
+		if (Lines.off_hook(CARD_LINE) != !step) {
+			line_scan_bad++;
+		}
+	}
+	if (card_events != 2) {
+		line_scan_bad++;
+	}
+	printf("  line card on I2C bus 1: %lu hook events, line scan errors: %lu\n", (unsigned long) card_events, (unsigned long) line_scan_bad);
+	Host_drain_log();
+}
+
+int main(int argc, char **argv) {
+	uint32_t frames = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_FRAMES;
+
+	Host_init();
+	Prof.setup();
+	srand(1);
+
+	printf("Host benchmark, %lu frames of %umS\n", (unsigned long) frames, Audio::FRAME_MS);
+	bench_audio(frames);
+	bench_stream(frames);
+	bench_g711();
+	bench_mf(frames);
+	bench_dtmf(frames);
+	bench_goertzel(frames);
+	bench_i2c(frames / 10);
+	Host_drain_log();
+	bench_i2c_shadow(frames / 100);
+	Host_drain_log();
+	bench_line_scan(frames);
+
+	/* Dump the built in profiler the same way the console task does */
+	Prof.request_dump();
+	while (Prof.dump_pending()) {
+		Prof.loop();
+		Logger.loop();
+	}
+	Host_drain_log();
+
+	return ((mf_strings_bad == 0) && (dtmf_strings_bad == 0) && (stream_underruns == 0) && (g711_bad == 0) && (audio_late_renders == 0) && (i2c_failed == 0) &&
+			(line_scan_bad == 0)) ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+/*
+ * bench_frames.cpp
+ *
+ * Host benchmark for the audio frame length and ring segment count settings.
+ *
+ * Built once for each setting (see CMakeLists.txt). Plays the same eight channel load as
+ * mockingbird_bench, with the segments handed to the render task by the same DMA callbacks
+ * and event counts as the target, and reports the render cost per second of audio
+ * against the latency of a command.
+ *
+ * Usage: mockingbird_audio_frames_<frame>ms_<segments> [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "host.h"
+#include "audio.h"
+
+static const uint32_t DEFAULT_SECONDS = 60;
+
+Audio::Audio Aud;
+
+static int16_t loop_sample[1000];
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void restart_sender(uint32_t channel_number);
+
+static void send_complete(uint32_t channel_number) {
+	restart_sender(channel_number);
+}
+
+static void restart_sender(uint32_t channel_number) {
+	if (channel_number & 1) {
+		Aud.send_mf(channel_number, "*1234567890#", send_complete);
+	}
+	else {
+		Aud.send_dtmf(channel_number, "0123456789*#", send_complete);
+	}
+}
+
+/*
+ * Finish playing the segment the DMA is on, as the I2S DMA interrupt would.
+ * Returns false if the DMA memory pointers have not moved on round the ring correctly.
+ */
+
+static bool play_segment(uint32_t frame) {
+#if AUDIO_RING_SEGMENTS > 2
+	DMA_HandleTypeDef *hdma = hi2s2.hdmatx;
+	static uintptr_t ring;
+	if (!ring) {
+		ring = hdma->Host_Memory[MEMORY0];
+	}
+	uint8_t memory = hdma->Host_Current_Memory;
+	Host_I2S_Segment_Played(&hi2s2);
+	/* The memory pointer which finished must now point at the segment after the one playing */
+	uint8_t next = ((frame % Audio::RING_SEGMENTS) + 2) % Audio::RING_SEGMENTS;
+	return hdma->Host_Memory[memory] == ring + (next * Audio::LR_AUDIO_BUFFER_SIZE * sizeof(int16_t));
+#else
+	Host_I2S_Segment_Played(&hi2s2);
+	return true;
+#endif
+}
+
+int main(int argc, char **argv) {
+	uint32_t seconds = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_SECONDS;
+	uint32_t frames = (seconds * 1000) / Audio::FRAME_MS;
+	uint32_t ring_errors = 0;
+	uint64_t total_ns = 0;
+	uint64_t max_ns = 0;
+	uint32_t dispatch_ms = 0;
+
+	Host_init();
+	for (int i = 0; i < 1000; i++) {
+		loop_sample[i] = (int16_t) (8000.0 * sin((2.0 * M_PI * i) / 1000.0));
+	}
+
+	Aud.setup();
+	for (int i = 0; i < Audio::NUM_AUDIO_CHANNELS; i++) {
+		uint32_t channel = Aud.seize();
+		switch (i % 6) {
+			case 0:
+				Aud.send_call_progress_tones(channel, Audio::CPT_DIAL_TONE);
+				break;
+			case 1:
+				Aud.send_call_progress_tones(channel, Audio::CPT_BUSY);
+				break;
+			case 2:
+				Aud.send_call_progress_tones(channel, Audio::CPT_RINGING);
+				break;
+			case 3:
+				Aud.send_loop(channel, loop_sample, 1000);
+				break;
+			default:
+				restart_sender(channel);
+				break;
+		}
+	}
+
+	for (uint32_t frame = 0; frame < frames; frame++) {
+		if (!play_segment(frame)) {
+			ring_errors++;
+		}
+		if (I2S_frame_sequence != (frame + 1)) {
+			ring_errors++;
+		}
+
+		/* The I2S audio task */
+		uint64_t start = now_ns();
+		Aud.render_segments(I2S_frame_sequence);
+		uint64_t ns = now_ns() - start;
+		total_ns += ns;
+		if (ns > max_ns) {
+			max_ns = ns;
+		}
+
+		/* The switch task dispatches every 50mS */
+		dispatch_ms += Audio::FRAME_MS;
+		if (dispatch_ms >= 50) {
+			dispatch_ms -= 50;
+			Aud.dispatch_completions();
+		}
+	}
+
+	Audio::DeadlineStats deadlines;
+	Aud.deadline_stats(&deadlines);
+
+	double mean_ns = frames ? (double) total_ns / frames : 0.0;
+	printf("%2u mS frames, %u segments: %7lu renders, mean %8.1f ns, max %8llu ns, %7.1f uS of render per second of audio, "
+			"command latency %u-%u mS\n",
+			Audio::FRAME_MS, Audio::RING_SEGMENTS, (unsigned long) frames, mean_ns, (unsigned long long) max_ns,
+			seconds ? (total_ns / 1000.0) / seconds : 0.0,
+			(Audio::RING_SEGMENTS - 1) * Audio::FRAME_MS, Audio::RING_SEGMENTS * Audio::FRAME_MS);
+	if (ring_errors || deadlines.late_renders || deadlines.segments_skipped || (deadlines.renders != frames)) {
+		printf("  ring errors: %lu, renders: %lu, late renders: %lu, skipped: %lu\n", (unsigned long) ring_errors,
+				(unsigned long) deadlines.renders, (unsigned long) deadlines.late_renders, (unsigned long) deadlines.segments_skipped);
+	}
+
+	return (ring_errors || deadlines.late_renders || deadlines.segments_skipped || (deadlines.renders != frames)) ? 1 : 0;
+}
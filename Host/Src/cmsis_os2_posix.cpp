@@ -0,0 +1,384 @@
+/*
+ * cmsis_os2_posix.cpp
+ *
+ * CMSIS-RTOS v2 subset implemented on top of POSIX threads for the host build.
+ *
+ * Timeouts are in ticks, and one tick is one millisecond, matching the
+ * FreeRTOS configuration used on the target.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "cmsis_os2.h"
+
+namespace {
+
+const uint32_t TICK_FREQ_HZ = 1000;
+
+typedef struct HostMutex {
+	pthread_mutex_t mutex;
+} HostMutex;
+
+typedef struct HostQueue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	uint32_t msg_count;
+	uint32_t msg_size;
+	uint32_t head;
+	uint32_t count;
+	uint8_t *storage;
+} HostQueue;
+
+typedef struct HostThread {
+	pthread_t thread;
+	osThreadFunc_t func;
+	void *argument;
+	pthread_mutex_t flags_lock;
+	pthread_cond_t flags_set;
+	uint32_t flags;
+} HostThread;
+
+thread_local HostThread *current_thread;
+struct timespec start_time;
+pthread_once_t start_time_once = PTHREAD_ONCE_INIT;
+
+void init_start_time(void) {
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+/*
+ * Convert a relative timeout in ticks to an absolute deadline for the pthread timed waits
+ */
+
+struct timespec deadline_from_ticks(uint32_t ticks) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ticks / TICK_FREQ_HZ;
+	ts.tv_nsec += (long) (ticks % TICK_FREQ_HZ) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return ts;
+}
+
+/*
+ * Wait on a condition variable with CMSIS timeout semantics.
+ * Returns false if the wait timed out.
+ */
+
+bool cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, uint32_t timeout, const struct timespec *deadline) {
+	if (timeout == osWaitForever) {
+		pthread_cond_wait(cond, lock);
+		return true;
+	}
+	return (pthread_cond_timedwait(cond, lock, deadline) != ETIMEDOUT);
+}
+
+void *thread_trampoline(void *arg) {
+	HostThread *t = (HostThread *) arg;
+	current_thread = t;
+	t->func(t->argument);
+	return NULL;
+}
+
+} /* End anonymous namespace */
+
+extern "C" {
+
+/*
+ * Kernel
+ */
+
+osStatus_t osKernelInitialize(void) {
+	pthread_once(&start_time_once, init_start_time);
+	return osOK;
+}
+
+osStatus_t osKernelStart(void) {
+	/* Threads start running as soon as they are created on the host */
+	return osOK;
+}
+
+uint32_t osKernelGetTickCount(void) {
+	pthread_once(&start_time_once, init_start_time);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t ms = (uint64_t) (now.tv_sec - start_time.tv_sec) * 1000ULL;
+	ms += (now.tv_nsec - start_time.tv_nsec) / 1000000L;
+	return (uint32_t) ms;
+}
+
+uint32_t osKernelGetTickFreq(void) {
+	return TICK_FREQ_HZ;
+}
+
+/*
+ * Threads
+ */
+
+osThreadId_t osThreadNew(osThreadFunc_t func, void *argument, const osThreadAttr_t *attr) {
+	(void) attr;
+	if (!func) {
+		return NULL;
+	}
+	HostThread *t = (HostThread *) calloc(1, sizeof(HostThread));
+	if (!t) {
+		return NULL;
+	}
+	t->func = func;
+	t->argument = argument;
+	pthread_mutex_init(&t->flags_lock, NULL);
+	pthread_cond_init(&t->flags_set, NULL);
+	if (pthread_create(&t->thread, NULL, thread_trampoline, t)) {
+		pthread_cond_destroy(&t->flags_set);
+		pthread_mutex_destroy(&t->flags_lock);
+		free(t);
+		return NULL;
+	}
+	pthread_detach(t->thread);
+	return (osThreadId_t) t;
+}
+
+osThreadId_t osThreadGetId(void) {
+	return (osThreadId_t) current_thread;
+}
+
+osStatus_t osThreadYield(void) {
+	sched_yield();
+	return osOK;
+}
+
+void osThreadExit(void) {
+	pthread_exit(NULL);
+}
+
+osStatus_t osThreadTerminate(osThreadId_t thread_id) {
+	if (!thread_id) {
+		pthread_exit(NULL);
+	}
+	HostThread *t = (HostThread *) thread_id;
+	pthread_cancel(t->thread);
+	return osOK;
+}
+
+osStatus_t osDelay(uint32_t ticks) {
+	struct timespec ts;
+	ts.tv_sec = ticks / TICK_FREQ_HZ;
+	ts.tv_nsec = (long) (ticks % TICK_FREQ_HZ) * 1000000L;
+	while (nanosleep(&ts, &ts) && errno == EINTR) {
+	}
+	return osOK;
+}
+
+/*
+ * Thread flags
+ */
+
+uint32_t osThreadFlagsSet(osThreadId_t thread_id, uint32_t flags) {
+	HostThread *t = (HostThread *) thread_id;
+	if (!t || (flags & osFlagsError)) {
+		return osFlagsErrorParameter;
+	}
+	pthread_mutex_lock(&t->flags_lock);
+	t->flags |= flags;
+	uint32_t result = t->flags;
+	pthread_cond_broadcast(&t->flags_set);
+	pthread_mutex_unlock(&t->flags_lock);
+	return result;
+}
+
+uint32_t osThreadFlagsClear(uint32_t flags) {
+	HostThread *t = current_thread;
+	if (!t || (flags & osFlagsError)) {
+		return t ? osFlagsErrorParameter : osFlagsErrorUnknown;
+	}
+	pthread_mutex_lock(&t->flags_lock);
+	uint32_t result = t->flags;
+	t->flags &= ~flags;
+	pthread_mutex_unlock(&t->flags_lock);
+	return result;
+}
+
+uint32_t osThreadFlagsWait(uint32_t flags, uint32_t options, uint32_t timeout) {
+	HostThread *t = current_thread;
+	if (!t) {
+		return osFlagsErrorUnknown; /* Not an RTOS thread */
+	}
+	if (flags & osFlagsError) {
+		return osFlagsErrorParameter;
+	}
+	struct timespec deadline = deadline_from_ticks(timeout);
+	uint32_t result;
+	pthread_mutex_lock(&t->flags_lock);
+	for (;;) {
+		result = t->flags;
+		bool satisfied = (options & osFlagsWaitAll) ? ((result & flags) == flags) : ((result & flags) != 0);
+		if (satisfied) {
+			break;
+		}
+		if (!timeout || !cond_wait(&t->flags_set, &t->flags_lock, timeout, &deadline)) {
+			pthread_mutex_unlock(&t->flags_lock);
+			return timeout ? osFlagsErrorTimeout : osFlagsErrorResource;
+		}
+	}
+	if (!(options & osFlagsNoClear)) {
+		t->flags &= ~flags;
+	}
+	pthread_mutex_unlock(&t->flags_lock);
+	return result;
+}
+
+/*
+ * Mutexes
+ */
+
+osMutexId_t osMutexNew(const osMutexAttr_t *attr) {
+	HostMutex *m = (HostMutex *) calloc(1, sizeof(HostMutex));
+	if (!m) {
+		return NULL;
+	}
+	pthread_mutexattr_t ma;
+	pthread_mutexattr_init(&ma);
+	if (attr && (attr->attr_bits & osMutexRecursive)) {
+		pthread_mutexattr_settype(&ma, PTHREAD_MUTEX_RECURSIVE);
+	}
+	if (attr && (attr->attr_bits & osMutexPrioInherit)) {
+		pthread_mutexattr_setprotocol(&ma, PTHREAD_PRIO_INHERIT);
+	}
+	pthread_mutex_init(&m->mutex, &ma);
+	pthread_mutexattr_destroy(&ma);
+	return (osMutexId_t) m;
+}
+
+osStatus_t osMutexAcquire(osMutexId_t mutex_id, uint32_t timeout) {
+	HostMutex *m = (HostMutex *) mutex_id;
+	if (!m) {
+		return osErrorParameter;
+	}
+	if (timeout == osWaitForever) {
+		return pthread_mutex_lock(&m->mutex) ? osError : osOK;
+	}
+	if (timeout == 0) {
+		return pthread_mutex_trylock(&m->mutex) ? osErrorResource : osOK;
+	}
+	struct timespec deadline = deadline_from_ticks(timeout);
+	return pthread_mutex_timedlock(&m->mutex, &deadline) ? osErrorTimeout : osOK;
+}
+
+osStatus_t osMutexRelease(osMutexId_t mutex_id) {
+	HostMutex *m = (HostMutex *) mutex_id;
+	if (!m) {
+		return osErrorParameter;
+	}
+	return pthread_mutex_unlock(&m->mutex) ? osErrorResource : osOK;
+}
+
+/*
+ * Message queues
+ */
+
+osMessageQueueId_t osMessageQueueNew(uint32_t msg_count, uint32_t msg_size, const osMessageQueueAttr_t *attr) {
+	(void) attr;
+	if (!msg_count || !msg_size) {
+		return NULL;
+	}
+	HostQueue *q = (HostQueue *) calloc(1, sizeof(HostQueue));
+	if (!q) {
+		return NULL;
+	}
+	q->storage = (uint8_t *) calloc(msg_count, msg_size);
+	if (!q->storage) {
+		free(q);
+		return NULL;
+	}
+	q->msg_count = msg_count;
+	q->msg_size = msg_size;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	return (osMessageQueueId_t) q;
+}
+
+osStatus_t osMessageQueuePut(osMessageQueueId_t mq_id, const void *msg_ptr, uint8_t msg_prio, uint32_t timeout) {
+	(void) msg_prio;
+	HostQueue *q = (HostQueue *) mq_id;
+	if (!q || !msg_ptr) {
+		return osErrorParameter;
+	}
+	struct timespec deadline = deadline_from_ticks(timeout == osWaitForever ? 0 : timeout);
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->msg_count) {
+		if (timeout == 0) {
+			pthread_mutex_unlock(&q->lock);
+			return osErrorResource;
+		}
+		if (!cond_wait(&q->not_full, &q->lock, timeout, &deadline)) {
+			pthread_mutex_unlock(&q->lock);
+			return osErrorTimeout;
+		}
+	}
+	uint32_t tail = (q->head + q->count) % q->msg_count;
+	memcpy(q->storage + (tail * q->msg_size), msg_ptr, q->msg_size);
+	q->count++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+	return osOK;
+}
+
+osStatus_t osMessageQueueGet(osMessageQueueId_t mq_id, void *msg_ptr, uint8_t *msg_prio, uint32_t timeout) {
+	HostQueue *q = (HostQueue *) mq_id;
+	if (!q || !msg_ptr) {
+		return osErrorParameter;
+	}
+	struct timespec deadline = deadline_from_ticks(timeout == osWaitForever ? 0 : timeout);
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0) {
+		if (timeout == 0) {
+			pthread_mutex_unlock(&q->lock);
+			return osErrorResource;
+		}
+		if (!cond_wait(&q->not_empty, &q->lock, timeout, &deadline)) {
+			pthread_mutex_unlock(&q->lock);
+			return osErrorTimeout;
+		}
+	}
+	memcpy(msg_ptr, q->storage + (q->head * q->msg_size), q->msg_size);
+	q->head = (q->head + 1) % q->msg_count;
+	q->count--;
+	if (msg_prio) {
+		*msg_prio = 0;
+	}
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+	return osOK;
+}
+
+uint32_t osMessageQueueGetCount(osMessageQueueId_t mq_id) {
+	HostQueue *q = (HostQueue *) mq_id;
+	if (!q) {
+		return 0;
+	}
+	pthread_mutex_lock(&q->lock);
+	uint32_t count = q->count;
+	pthread_mutex_unlock(&q->lock);
+	return count;
+}
+
+uint32_t osMessageQueueGetSpace(osMessageQueueId_t mq_id) {
+	HostQueue *q = (HostQueue *) mq_id;
+	if (!q) {
+		return 0;
+	}
+	pthread_mutex_lock(&q->lock);
+	uint32_t space = q->msg_count - q->count;
+	pthread_mutex_unlock(&q->lock);
+	return space;
+}
+
+} /* End extern "C" */
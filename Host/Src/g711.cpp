@@ -0,0 +1,56 @@
+/*
+ * g711.cpp
+ *
+ * G.711 encoders (ITU-T G.711), working on full scale 16 bit samples.
+ * Each code decodes to the middle of its step, see Audio::_build_g711_tables().
+ */
+
+#include "g711.h"
+
+namespace G711 {
+
+static const int32_t ULAW_BIAS = 0x84;
+static const int32_t ULAW_CLIP = 32635; /* Largest magnitude which still fits once biased */
+
+/* Position of the highest set bit */
+static uint8_t top_bit(int32_t value) {
+	return 31 - __builtin_clz((uint32_t) value);
+}
+
+uint8_t linear_to_ulaw(int16_t sample) {
+	int32_t magnitude = sample;
+	uint8_t sign = 0;
+
+	if (magnitude < 0) {
+		magnitude = -magnitude;
+		sign = 0x80;
+	}
+	if (magnitude > ULAW_CLIP) {
+		magnitude = ULAW_CLIP;
+	}
+
+	/* With the bias added, segment N has its top bit at bit 7 + N */
+	magnitude += ULAW_BIAS;
+	uint8_t segment = top_bit(magnitude) - 7;
+	uint8_t step = (magnitude >> (segment + 3)) & 0x0F;
+
+	return ~(sign | (segment << 4) | step);
+}
+
+uint8_t linear_to_alaw(int16_t sample) {
+	int32_t magnitude = sample;
+	uint8_t sign = 0x80;
+
+	if (magnitude < 0) {
+		magnitude = -magnitude - 1;
+		sign = 0;
+	}
+
+	/* Segment 0 covers 0-255 in steps of 16, segment N >= 1 has its top bit at bit 7 + N */
+	uint8_t segment = (magnitude < 0x100) ? 0 : top_bit(magnitude) - 7;
+	uint8_t step = (magnitude >> ((segment) ? segment + 3 : 4)) & 0x0F;
+
+	return (sign | (segment << 4) | step) ^ 0x55;
+}
+
+} /* End namespace G711 */
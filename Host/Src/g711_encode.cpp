@@ -0,0 +1,117 @@
+/*
+ * g711_encode.cpp
+ *
+ * Convert a WAV file to a G.711 encoded C array, for playing with Audio::send_g711() or
+ * Audio::send_loop_g711(). The WAV file must be 16 bit PCM, mono, 8000Hz.
+ *
+ * Usage: mockingbird_g711_encode [-a|-u] input.wav array_name > output.c
+ *
+ *   -u  mu-law (default)
+ *   -a  A-law
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "g711.h"
+
+static const uint32_t WAV_SAMPLE_RATE = 8000;
+
+static uint32_t read_le(const uint8_t *bytes, uint8_t count) {
+	uint32_t value = 0;
+	for (int i = count - 1; i >= 0; i--) {
+		value = (value << 8) | bytes[i];
+	}
+	return value;
+}
+
+static int usage(void) {
+	fprintf(stderr, "Usage: mockingbird_g711_encode [-a|-u] input.wav array_name > output.c\n");
+	return 2;
+}
+
+int main(int argc, char **argv) {
+	bool alaw = false;
+	int arg = 1;
+
+	if ((arg < argc) && (argv[arg][0] == '-')) {
+		if (!strcmp(argv[arg], "-a")) {
+			alaw = true;
+		}
+		else if (strcmp(argv[arg], "-u")) {
+			return usage();
+		}
+		arg++;
+	}
+	if ((argc - arg) != 2) {
+		return usage();
+	}
+	const char *path = argv[arg];
+	const char *name = argv[arg + 1];
+
+	FILE *in = fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		return 1;
+	}
+	fseek(in, 0, SEEK_END);
+	long file_size = ftell(in);
+	fseek(in, 0, SEEK_SET);
+	uint8_t *wav = (uint8_t *) malloc(file_size);
+	if ((!wav) || (fread(wav, 1, file_size, in) != (size_t) file_size)) {
+		fprintf(stderr, "%s: read failed\n", path);
+		return 1;
+	}
+	fclose(in);
+
+	if ((file_size < 12) || memcmp(wav, "RIFF", 4) || memcmp(wav + 8, "WAVE", 4)) {
+		fprintf(stderr, "%s: not a WAV file\n", path);
+		return 1;
+	}
+
+	/* Walk the chunks for the format and the samples */
+	const uint8_t *fmt = NULL;
+	const uint8_t *data = NULL;
+	uint32_t data_size = 0;
+	for (long offset = 12; offset + 8 <= file_size;) {
+		uint32_t chunk_size = read_le(wav + offset + 4, 4);
+		if (offset + 8 + chunk_size > (uint32_t) file_size) {
+			chunk_size = file_size - offset - 8; /* Truncated file, use what's there */
+		}
+		if (!memcmp(wav + offset, "fmt ", 4) && (chunk_size >= 16)) {
+			fmt = wav + offset + 8;
+		}
+		else if (!memcmp(wav + offset, "data", 4)) {
+			data = wav + offset + 8;
+			data_size = chunk_size;
+		}
+		offset += 8 + chunk_size + (chunk_size & 1);
+	}
+	if ((!fmt) || (!data)) {
+		fprintf(stderr, "%s: missing fmt or data chunk\n", path);
+		return 1;
+	}
+	if ((read_le(fmt, 2) != 1) || (read_le(fmt + 2, 2) != 1) || (read_le(fmt + 14, 2) != 16)) {
+		fprintf(stderr, "%s: must be 16 bit PCM mono\n", path);
+		return 1;
+	}
+	if (read_le(fmt + 4, 4) != WAV_SAMPLE_RATE) {
+		fprintf(stderr, "%s: must be sampled at %lu Hz\n", path, (unsigned long) WAV_SAMPLE_RATE);
+		return 1;
+	}
+
+	uint32_t length = data_size / 2;
+	printf("/* %s, %lu samples, G.711 %s */\n\n", path, (unsigned long) length, alaw ? "A-law" : "mu-law");
+	printf("#include <stdint.h>\n\n");
+	printf("const uint32_t %s_length = %lu;\n", name, (unsigned long) length);
+	printf("const uint8_t %s[] = {", name);
+	for (uint32_t i = 0; i < length; i++) {
+		int16_t sample = (int16_t) read_le(data + (i * 2), 2);
+		uint8_t code = alaw ? G711::linear_to_alaw(sample) : G711::linear_to_ulaw(sample);
+		printf("%s0x%02x", (i % 16) ? ", " : (i ? ",\n\t" : "\n\t"), code);
+	}
+	printf("\n};\n");
+
+	free(wav);
+	return 0;
+}
@@ -0,0 +1,276 @@
+/*
+ * hal_stub.cpp
+ *
+ * Host (Linux) stand-in for the STM32F4 HAL functions used by the application.
+ *
+ * DMA transfers do not run on their own. The host harness fills ADC buffers and
+ * calls the half/full callbacks itself. I2C transfers complete immediately against
+ * a simulated register file, and the completion callbacks are invoked from the
+ * calling thread, which plays the part of the interrupt.
+ */
+
+#include <string.h>
+#include "stm32f4xx_hal.h"
+
+GPIO_TypeDef Host_GPIOA, Host_GPIOB, Host_GPIOC;
+
+extern "C" {
+
+/*
+ * GPIO
+ */
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState) {
+	if (PinState == GPIO_PIN_SET) {
+		GPIOx->ODR |= GPIO_Pin;
+	}
+	else {
+		GPIOx->ODR &= ~((uint32_t) GPIO_Pin);
+	}
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+	return (GPIOx->IDR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+/*
+ * ADC
+ */
+
+HAL_StatusTypeDef HAL_ADC_Init(ADC_HandleTypeDef *hadc) {
+	if (!hadc || !hadc->Init.NbrOfConversion || (hadc->Init.NbrOfConversion > 16)) {
+		return HAL_ERROR;
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_ConfigChannel(ADC_HandleTypeDef *hadc, ADC_ChannelConfTypeDef *sConfig) {
+	if (!hadc || !sConfig || !sConfig->Rank || (sConfig->Rank > 16)) {
+		return HAL_ERROR;
+	}
+	hadc->Host_Channels[sConfig->Rank - 1] = sConfig->Channel;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_Start_DMA(ADC_HandleTypeDef *hadc, uint32_t *pData, uint32_t Length) {
+	if (!hadc || !pData || !Length) {
+		return HAL_ERROR;
+	}
+	hadc->Host_Buffer = pData;
+	hadc->Host_Length = Length;
+	hadc->Host_Running = 1;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_Stop_DMA(ADC_HandleTypeDef *hadc) {
+	hadc->Host_Running = 0;
+	return HAL_OK;
+}
+
+/*
+ * Timers
+ */
+
+HAL_StatusTypeDef HAL_TIM_OC_Start(TIM_HandleTypeDef *htim, uint32_t Channel) {
+	htim->Host_Channels_Running |= (1U << (Channel >> 2));
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_OC_Stop(TIM_HandleTypeDef *htim, uint32_t Channel) {
+	htim->Host_Channels_Running &= ~(1U << (Channel >> 2));
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef *htim, uint32_t Channel) {
+	return HAL_TIM_OC_Start(htim, Channel);
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Stop(TIM_HandleTypeDef *htim, uint32_t Channel) {
+	return HAL_TIM_OC_Stop(htim, Channel);
+}
+
+/*
+ * DMA double buffer mode. The test harness plays the segments by calling the transfer complete callbacks.
+ */
+
+HAL_StatusTypeDef HAL_DMAEx_MultiBufferStart_IT(DMA_HandleTypeDef *hdma, uintptr_t SrcAddress, uintptr_t DstAddress, uintptr_t SecondMemAddress, uint32_t DataLength) {
+	if (!hdma || !hdma->XferCpltCallback || !hdma->XferM1CpltCallback || !DataLength) {
+		return HAL_ERROR;
+	}
+	hdma->Host_Memory[MEMORY0] = SrcAddress;
+	hdma->Host_Memory[MEMORY1] = SecondMemAddress;
+	hdma->Host_Length = DataLength;
+	hdma->Host_Current_Memory = MEMORY0;
+	hdma->Instance->NDTR = DataLength;
+	hdma->Host_Running = 1;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMAEx_ChangeMemory(DMA_HandleTypeDef *hdma, uintptr_t Address, HAL_DMA_MemoryTypeDef memory) {
+	hdma->Host_Memory[memory] = Address;
+	return HAL_OK;
+}
+
+/*
+ * I2S
+ */
+
+HAL_StatusTypeDef HAL_I2S_Transmit_DMA(I2S_HandleTypeDef *hi2s, uint16_t *pData, uint16_t Size) {
+	if (!hi2s || !pData || !Size) {
+		return HAL_ERROR;
+	}
+	hi2s->Host_Buffer = pData;
+	hi2s->Host_Size = Size;
+	hi2s->Host_Running = 1;
+	hi2s->hdmatx->Instance->NDTR = Size;
+	return HAL_OK;
+}
+
+/*
+ * The DMA has played out the segment it was on. Move the transfer counter on to the start of the next one,
+ * and make the interrupt callback the target would.
+ */
+
+void Host_I2S_Segment_Played(I2S_HandleTypeDef *hi2s) {
+	DMA_HandleTypeDef *hdma = hi2s->hdmatx;
+
+	if (hdma->Host_Running) {
+		/* Double buffer mode, the other memory pointer starts */
+		uint8_t memory = hdma->Host_Current_Memory;
+		hdma->Host_Current_Memory ^= 1;
+		hdma->Instance->NDTR = hdma->Host_Length;
+		if (memory == MEMORY0) {
+			hdma->XferCpltCallback(hdma);
+		}
+		else {
+			hdma->XferM1CpltCallback(hdma);
+		}
+	}
+	else if (hi2s->Host_Running) {
+		/* Circular mode, half and full interrupts */
+		if (hdma->Instance->NDTR > (uint32_t) (hi2s->Host_Size / 2)) {
+			hdma->Instance->NDTR = hi2s->Host_Size / 2;
+			HAL_I2S_TxHalfCpltCallback(hi2s);
+		}
+		else {
+			hdma->Instance->NDTR = hi2s->Host_Size;
+			HAL_I2S_TxCpltCallback(hi2s);
+		}
+	}
+}
+
+HAL_StatusTypeDef HAL_I2S_DMAStop(I2S_HandleTypeDef *hi2s) {
+	hi2s->Host_Running = 0;
+	hi2s->hdmatx->Host_Running = 0;
+	return HAL_OK;
+}
+
+/*
+ * I2C
+ */
+
+void Host_I2C_Attach_Device(I2C_HandleTypeDef *hi2c, uint8_t device_address) {
+	hi2c->Host_Present[device_address & 0x7F] = 1;
+}
+
+HAL_StatusTypeDef HAL_I2C_Master_Transmit_DMA(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData, uint16_t Size) {
+	uint8_t addr = (DevAddress >> 1) & 0x7F;
+
+	if (!pData || !Size) {
+		return HAL_ERROR;
+	}
+	hi2c->Host_Transfer_Count++;
+	if (!hi2c->Host_Present[addr]) {
+		hi2c->ErrorCode = HAL_I2C_ERROR_AF;
+		HAL_I2C_ErrorCallback(hi2c);
+		return HAL_OK;
+	}
+	hi2c->ErrorCode = HAL_I2C_ERROR_NONE;
+	/* The first byte sets the register pointer, the rest are written sequentially */
+	uint8_t reg = pData[0];
+	for (uint16_t i = 1; i < Size; i++) {
+		hi2c->Host_Registers[addr][reg++] = pData[i];
+	}
+	hi2c->Host_Register_Pointer[addr] = (Size > 1) ? pData[0] : reg;
+	HAL_I2C_MasterTxCpltCallback(hi2c);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_Master_Receive_DMA(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint8_t *pData, uint16_t Size) {
+	uint8_t addr = (DevAddress >> 1) & 0x7F;
+
+	if (!pData || !Size) {
+		return HAL_ERROR;
+	}
+	hi2c->Host_Transfer_Count++;
+	if (!hi2c->Host_Present[addr]) {
+		hi2c->ErrorCode = HAL_I2C_ERROR_AF;
+		HAL_I2C_ErrorCallback(hi2c);
+		return HAL_OK;
+	}
+	hi2c->ErrorCode = HAL_I2C_ERROR_NONE;
+	uint8_t reg = hi2c->Host_Register_Pointer[addr];
+	for (uint16_t i = 0; i < Size; i++) {
+		pData[i] = hi2c->Host_Registers[addr][reg++];
+	}
+	HAL_I2C_MasterRxCpltCallback(hi2c);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Write_DMA(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress, uint16_t MemAddSize, uint8_t *pData, uint16_t Size) {
+	uint8_t addr = (DevAddress >> 1) & 0x7F;
+
+	if (!pData || !Size || ((MemAddSize != I2C_MEMADD_SIZE_8BIT) && (MemAddSize != I2C_MEMADD_SIZE_16BIT))) {
+		return HAL_ERROR;
+	}
+	hi2c->Host_Transfer_Count++;
+	if (!hi2c->Host_Present[addr]) {
+		hi2c->ErrorCode = HAL_I2C_ERROR_AF;
+		HAL_I2C_ErrorCallback(hi2c);
+		return HAL_OK;
+	}
+	hi2c->ErrorCode = HAL_I2C_ERROR_NONE;
+	uint8_t reg = (uint8_t) MemAddress;
+	for (uint16_t i = 0; i < Size; i++) {
+		hi2c->Host_Registers[addr][reg++] = pData[i];
+	}
+	hi2c->Host_Register_Pointer[addr] = (uint8_t) MemAddress;
+	HAL_I2C_MemTxCpltCallback(hi2c);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Read_DMA(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress, uint16_t MemAddSize, uint8_t *pData, uint16_t Size) {
+	uint8_t addr = (DevAddress >> 1) & 0x7F;
+
+	if (!pData || !Size || ((MemAddSize != I2C_MEMADD_SIZE_8BIT) && (MemAddSize != I2C_MEMADD_SIZE_16BIT))) {
+		return HAL_ERROR;
+	}
+	hi2c->Host_Transfer_Count++;
+	if (!hi2c->Host_Present[addr]) {
+		hi2c->ErrorCode = HAL_I2C_ERROR_AF;
+		HAL_I2C_ErrorCallback(hi2c);
+		return HAL_OK;
+	}
+	hi2c->ErrorCode = HAL_I2C_ERROR_NONE;
+	uint8_t reg = (uint8_t) MemAddress;
+	for (uint16_t i = 0; i < Size; i++) {
+		pData[i] = hi2c->Host_Registers[addr][reg++];
+	}
+	hi2c->Host_Register_Pointer[addr] = (uint8_t) MemAddress;
+	HAL_I2C_MemRxCpltCallback(hi2c);
+	return HAL_OK;
+}
+
+/*
+ * UART
+ */
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size, uint32_t Timeout) {
+	(void) huart;
+	(void) pData;
+	(void) Size;
+	(void) Timeout;
+	return HAL_OK;
+}
+
+} /* End extern "C" */
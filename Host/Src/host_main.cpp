@@ -0,0 +1,133 @@
+/*
+ * host_main.cpp
+ *
+ * Host (Linux) equivalent of the application parts of main.c:
+ * peripheral handles, RTOS queues, DMA event counts and HAL completion callbacks.
+ *
+ * Keep the callbacks here in step with the USER CODE 4 section of main.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "host.h"
+#include "logging.h"
+
+ADC_HandleTypeDef hadc1;
+DMA_HandleTypeDef hdma_adc1;
+
+I2C_HandleTypeDef hi2c1;
+I2C_HandleTypeDef hi2c2;
+
+I2S_HandleTypeDef hi2s2;
+SPI_TypeDef Host_SPI2;
+DMA_HandleTypeDef hdma_spi2_tx;
+
+TIM_HandleTypeDef htim3;
+
+USART_TypeDef Host_USART6;
+UART_HandleTypeDef huart6;
+
+osMessageQueueId_t Queue_I2C_BussesHandle;
+
+/* No MF or I2S tasks on the host, the benches read the event counts and call the task functions themselves */
+osThreadId_t MF_ReceiverHandle;
+osThreadId_t I2sAudioHandle;
+osThreadId_t I2C_TaskHandle; /* Created by the benches which run the I2C engine */
+uint32_t MF_frame_sequence;
+uint32_t I2S_frame_sequence;
+
+/*
+ * Create the queues and link the DMA handles the same way main.c and the MSP code do.
+ */
+
+void Host_init(void) {
+	osKernelInitialize();
+
+	hdma_adc1.Instance = &hdma_adc1.Host_Stream;
+	hadc1.DMA_Handle = &hdma_adc1;
+	hdma_spi2_tx.Instance = &hdma_spi2_tx.Host_Stream;
+	hi2s2.Instance = &Host_SPI2;
+	hi2s2.hdmatx = &hdma_spi2_tx;
+	huart6.Instance = &Host_USART6;
+
+	Queue_I2C_BussesHandle = osMessageQueueNew (4, sizeof(I2C_Queue_Message), NULL);
+
+	Logger.setup();
+}
+
+/*
+ * Print everything waiting in the logging queue
+ */
+
+void Host_drain_log(void) {
+	for (int i = 0; i <= LOGGING::LOG_QUEUE_DEPTH; i++) {
+		Logger.loop();
+	}
+}
+
+/* Called when the first half of the buffer is filled */
+void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef* hadc) {
+	__atomic_fetch_add(&MF_frame_sequence, 1, __ATOMIC_RELEASE);
+	osThreadFlagsSet(MF_ReceiverHandle, FRAME_EVENT_FLAG); /* Wake the MF receiver task */
+}
+
+/* Called when the second half of the buffer is filled */
+void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef* hadc) {
+	__atomic_fetch_add(&MF_frame_sequence, 1, __ATOMIC_RELEASE);
+	osThreadFlagsSet(MF_ReceiverHandle, FRAME_EVENT_FLAG); /* Wake the MF receiver task */
+}
+
+/* Called when the first half of the audio buffer has been transmitted */
+void HAL_I2S_TxHalfCpltCallback(I2S_HandleTypeDef *hi2s) {
+	__atomic_fetch_add(&I2S_frame_sequence, 1, __ATOMIC_RELEASE);
+	osThreadFlagsSet(I2sAudioHandle, FRAME_EVENT_FLAG); /* Wake the audio processing task */
+}
+
+/* Called when the second half of the audio buffer has been transmitted */
+void HAL_I2S_TxCpltCallback(I2S_HandleTypeDef *hi2s) {
+	__atomic_fetch_add(&I2S_frame_sequence, 1, __ATOMIC_RELEASE);
+	osThreadFlagsSet(I2sAudioHandle, FRAME_EVENT_FLAG); /* Wake the audio processing task */
+}
+
+/*
+ * Post an I2C completion message to the I2C task
+ */
+
+static void host_i2c_post(I2C_HandleTypeDef *hi2c, uint8_t type) {
+	I2C_Queue_Message msg;
+	msg.bus = (hi2c == &hi2c1) ? 0 : 1;
+	msg.type = type;
+	msg.handle = hi2c;
+	osMessageQueuePut(Queue_I2C_BussesHandle, &msg, 0U, 0U); /* Send message to I2C task */
+	osThreadFlagsSet(I2C_TaskHandle, I2C_EVENT_FLAG);
+}
+
+/* Called when the I2C master transmission completes */
+void HAL_I2C_MasterTxCpltCallback(I2C_HandleTypeDef *hi2c) {
+	host_i2c_post(hi2c, MSG_I2C_TX);
+}
+
+/* Called when the I2C master reception completes */
+void HAL_I2C_MasterRxCpltCallback(I2C_HandleTypeDef *hi2c) {
+	host_i2c_post(hi2c, MSG_I2C_RX);
+}
+
+/* Called when an I2C memory mode write completes */
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c) {
+	host_i2c_post(hi2c, MSG_I2C_TX);
+}
+
+/* Called when an I2C memory mode read completes */
+void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c) {
+	host_i2c_post(hi2c, MSG_I2C_RX);
+}
+
+/* Called when an error occurs during an I2C transaction */
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c) {
+	host_i2c_post(hi2c, MSG_I2C_ERR);
+}
+
+void Error_Handler(void) {
+	fprintf(stderr, "Error_Handler() called\n");
+	abort();
+}